@@ -0,0 +1,174 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../common/helpers.h"
+
+// ======================================
+// Parallel checkout benchmark
+// ======================================
+// usage: checkout_bench [<clients>] [<files>] [<dir>]
+//
+// Builds (once) a project of <files> files of 0-4 KiB in a server
+// directory under <dir>, starts bin/WTFserver there and times 1, 2,
+// 4, ... <clients> checkouts of it running at the same time, each
+// by its own bin/WTF process. Read-only commands share the project
+// lock, so throughput should grow with the clients up to the cores.
+
+#define BENCH_PROJECT "bench_proj"
+#define BENCH_PORT "5200"
+#define BENCH_MAX_SIZE 4096
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Writes the files and a matching .Manifest straight into the
+ * server's copy of the project.
+ */
+static void build_project(char *dir, int count){
+    char *marker;
+    asprintf(&marker, "%s/.complete_%d", dir, count);
+    if (access(marker, F_OK) != -1){
+        free(marker);
+        return;
+    }
+
+    printf("Building %d files under %s...\n", count, dir);
+    char *cmd;
+    asprintf(&cmd, "rm -rf %s/server && mkdir -p %s/server/%s", dir, dir, BENCH_PROJECT);
+    system(cmd);
+    free(cmd);
+
+    char *manifest;
+    asprintf(&manifest, "%s/server/%s/.Manifest", dir, BENCH_PROJECT);
+    int fout = open(manifest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dprintf(fout, "1 %s\n", BENCH_PROJECT);
+
+    unsigned char buf[BENCH_MAX_SIZE];
+    srand(count);
+    int i;
+    for (i = 0; i < count; i++){
+        char *fname;
+        char *path;
+        asprintf(&fname, "%s/%d/%d", BENCH_PROJECT, i / 1000, i);
+        asprintf(&path, "%s/server/%s", dir, fname);
+        if (i % 1000 == 0)
+            mkpath(path);
+
+        int size = rand() % (BENCH_MAX_SIZE + 1);
+        int j;
+        for (j = 0; j < size; j++)
+            buf[j] = rand();
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        write(fd, buf, size);
+        close(fd);
+
+        char hexdigest[HEXDIGEST_MAX+1];
+        md5sum(path, hexdigest);
+        char *line = generate_manifest_line('-', hexdigest, 0, fname);
+        write(fout, line, strlen(line));
+        free(line);
+        free(fname);
+        free(path);
+    }
+    close(fout);
+    free(manifest);
+    close(open(marker, O_WRONLY | O_CREAT, 0644));
+    free(marker);
+}
+
+/**
+ * Runs `count` checkouts at once, each in <dir>/client<i>.
+ * Returns how many failed.
+ */
+static int run_checkouts(char *dir, char *wtf, int count){
+    pid_t *pids = malloc(count * sizeof(pid_t));
+    int i;
+    for (i = 0; i < count; i++){
+        char *client;
+        asprintf(&client, "%s/client%d", dir, i);
+        char *cmd;
+        asprintf(&cmd, "rm -rf %s && mkdir -p %s && printf 'localhost %s\\n' > %s/.configure",
+                 client, client, BENCH_PORT, client);
+        system(cmd);
+        free(cmd);
+
+        pids[i] = fork();
+        if (pids[i] == 0){
+            chdir(client);
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            execl(wtf, wtf, "checkout", BENCH_PROJECT, (char *) NULL);
+            _exit(127);
+        }
+        free(client);
+    }
+
+    int failed = 0;
+    for (i = 0; i < count; i++){
+        int status;
+        waitpid(pids[i], &status, 0);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    free(pids);
+    return failed;
+}
+
+int main(int argc, char *argv[]){
+    int clients = argc > 1 ? atoi(argv[1]) : 8;
+    int count = argc > 2 ? atoi(argv[2]) : 10000;
+    char *dir = argc > 3 ? argv[3] : "/tmp/wtf_checkout_bench";
+
+    char server_bin[PATH_MAX];
+    char wtf[PATH_MAX];
+    if (!realpath("bin/WTFserver", server_bin) || !realpath("bin/WTF", wtf)){
+        puts("Run from the repository root after `make all`");
+        return 1;
+    }
+    build_project(dir, count);
+
+    // server runs in the directory holding the project
+    pid_t server = fork();
+    if (server == 0){
+        char *server_dir;
+        asprintf(&server_dir, "%s/server", dir);
+        chdir(server_dir);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(server_bin, server_bin, BENCH_PORT, (char *) NULL);
+        _exit(127);
+    }
+    usleep(200 * 1000);
+
+    printf("%d files, %ld cores\n", count, sysconf(_SC_NPROCESSORS_ONLN));
+    int failed = 0;
+    int n;
+    for (n = 1; n <= clients; n *= 2){
+        double start = now();
+        failed += run_checkouts(dir, wtf, n);
+        double seconds = now() - start;
+        printf("%3d parallel  %8.3f s  %8.2f checkouts/s\n", n, seconds, n / seconds);
+        if (n < clients && n * 2 > clients)
+            n = clients / 2;
+    }
+
+    kill(server, SIGINT);
+    waitpid(server, NULL, 0);
+    printf("%d failed checkouts\n", failed);
+    return failed != 0;
+}
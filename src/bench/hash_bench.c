@@ -0,0 +1,143 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../common/helpers.h"
+#include "../common/hashpool.h"
+#include "../common/digest.h"
+#include "../common/md5_mb.h"
+
+// ======================================
+// Small file hashing benchmark
+// ======================================
+// usage: hash_bench [<files>] [<dir>]
+//
+// Builds (once) a tree of <files> files of 0-4 KiB under <dir>,
+// then times hashing all of them:
+//   md5sum      one call per file, as the client used to
+//   hash_files  batched through the hashing pool
+//   md5_mb      in memory, scalar vs SIMD lanes, to show the
+//               hashing cost without the filesystem
+
+#define BENCH_FILES_PER_DIR 1000
+#define BENCH_MAX_SIZE 4096
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *bench_fname(char *dir, int i){
+    char *fname;
+    asprintf(&fname, "%s/%d/%d", dir, i / BENCH_FILES_PER_DIR, i);
+    return fname;
+}
+
+static void build_tree(char *dir, int count){
+    char *marker;
+    asprintf(&marker, "%s/.complete_%d", dir, count);
+    if (access(marker, F_OK) != -1){
+        free(marker);
+        return;
+    }
+
+    printf("Building %d files under %s...\n", count, dir);
+    unsigned char buf[BENCH_MAX_SIZE];
+    srand(count);
+    int i;
+    for (i = 0; i < count; i++){
+        char *fname = bench_fname(dir, i);
+        if (i % BENCH_FILES_PER_DIR == 0)
+            mkpath(fname);
+
+        int size = rand() % (BENCH_MAX_SIZE + 1);
+        int j;
+        for (j = 0; j < size; j++)
+            buf[j] = rand();
+        int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        write(fd, buf, size);
+        close(fd);
+        free(fname);
+    }
+    close(open(marker, O_WRONLY | O_CREAT, 0644));
+    free(marker);
+}
+
+static void report(char *name, int count, double seconds){
+    printf("%-22s %8.3f s  %10.0f files/s\n", name, seconds, count / seconds);
+}
+
+int main(int argc, char *argv[]){
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    char *dir = argc > 2 ? argv[2] : "/tmp/wtf_hash_bench";
+    build_tree(dir, count);
+    printf("SIMD lanes: %s\n", md5_mb_supported() ? "avx2" : "none (scalar fallback)");
+
+    hash_job_t *jobs = calloc(count, sizeof(hash_job_t));
+    int i;
+    for (i = 0; i < count; i++){
+        jobs[i].fname = bench_fname(dir, i);
+        struct stat st = {0};
+        stat(jobs[i].fname, &st);
+        jobs[i].size = st.st_size;
+    }
+
+    // one md5sum per file
+    char (*expected)[HEXDIGEST_MAX+1] = malloc(count * sizeof(*expected));
+    double start = now();
+    for (i = 0; i < count; i++)
+        md5sum(jobs[i].fname, expected[i]);
+    report("md5sum", count, now() - start);
+
+    // batched through the pool
+    start = now();
+    hash_files(jobs, count, HASH_MD5);
+    report("hash_files", count, now() - start);
+
+    int mismatches = 0;
+    for (i = 0; i < count; i++)
+        mismatches += strcmp(jobs[i].hexdigest, expected[i]) != 0;
+
+    // in memory: read everything, then hash only
+    unsigned char **data = malloc(count * sizeof(unsigned char *));
+    size_t *lens = malloc(count * sizeof(size_t));
+    for (i = 0; i < count; i++){
+        data[i] = malloc(BENCH_MAX_SIZE);
+        int fd = open(jobs[i].fname, O_RDONLY);
+        lens[i] = read(fd, data[i], BENCH_MAX_SIZE);
+        close(fd);
+    }
+    char (*digests)[HEXDIGEST_MAX+1] = malloc(count * sizeof(*digests));
+
+    start = now();
+    md5_mb_scalar(data, lens, count, digests);
+    report("md5_mb_scalar (mem)", count, now() - start);
+
+    start = now();
+    md5_mb(data, lens, count, digests);
+    report("md5_mb (mem)", count, now() - start);
+
+    for (i = 0; i < count; i++)
+        mismatches += strcmp(digests[i], expected[i]) != 0;
+    printf("%d mismatched digests\n", mismatches);
+
+    for (i = 0; i < count; i++){
+        free(jobs[i].fname);
+        free(data[i]);
+    }
+    free(jobs);
+    free(expected);
+    free(data);
+    free(lens);
+    free(digests);
+    return mismatches != 0;
+}
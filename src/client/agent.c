@@ -0,0 +1,509 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "agent.h"
+#include "commands.h"
+
+// ======================================
+// Client agent
+// ======================================
+// An optional background process that keeps what every WTF
+// invocation would otherwise rebuild from scratch: the resolved
+// server address, open server connections, and parsed .Index files
+// and .Manifest trees of the projects it served.
+//
+// WTF hands its command line and its stdin/stdout/stderr to the agent
+// over AGENT_SOCKET, and the agent forks a process that runs the
+// command as usual. The fork inherits the warm state, and an idle
+// server connection from the pool is used by init_socket_server.
+// The exit status is sent back once the command is done:
+//
+// front end -> agent: {argc, length} + fds 0,1,2, then argv
+// agent -> front end: exit status (or AGENT_BUSY)
+//
+// A connection goes back to the pool only if the command succeeded
+// and the server still answers a ping, so it is known to be in step.
+// The agent is opt-in: it is spawned when WTF_AGENT is set, or
+// started with `WTF agent start`.
+
+typedef struct agent_req_t {
+    pid_t pid;
+    int client_fd;
+    int server_sock;
+    char *project;
+    int interrupted;
+} agent_req_t;
+
+typedef struct agent_t {
+    int listen_fd;
+    int lock_fd;
+    unsigned long socket_ino;
+    int stopping;
+    time_t last_request;
+
+    // resolved .configure
+    struct sockaddr_in serv_addr;
+    file_version_t config_version;
+    int resolved;
+
+    int pool[AGENT_POOL_SIZE];
+    int pool_count;
+
+    agent_req_t reqs[AGENT_MAX_REQUESTS];
+    int num_reqs;
+} agent_t;
+
+/****************************************************************
+ *  FRONT END
+ ***************************************************************/
+
+static int agent_connect(){
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, AGENT_SOCKET);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void run_agent();
+
+/**
+ * Starts an agent for the current directory in the background.
+ */
+static void spawn_agent(){
+    pid_t pid = fork();
+    if (pid != 0){
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
+        return;
+    }
+
+    // detach: new session, and a grandchild so nobody has to reap it
+    setsid();
+    if (fork() != 0)
+        _exit(0);
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO)
+        close(null_fd);
+    run_agent();
+    _exit(0);
+}
+
+static int connect_or_spawn(int spawn){
+    int fd = agent_connect();
+    if (fd != -1 || !spawn)
+        return fd;
+
+    spawn_agent();
+    int i;
+    for (i = 0; i < 1000 && fd == -1; i++){
+        usleep(1000);
+        fd = agent_connect();
+    }
+    return fd;
+}
+
+/**
+ * Runs a command through the agent. Returns its exit status, or -1
+ * if it has to be run here (no agent, or the agent is busy).
+ */
+int agent_request(int argc, char *argv[], int spawn){
+    int fd = connect_or_spawn(spawn);
+    if (fd == -1)
+        return -1;
+
+    // arguments go NUL-separated after the header
+    int len = 0;
+    int i;
+    for (i = 0; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    char *args = malloc(len);
+    char *p = args;
+    for (i = 0; i < argc; i++){
+        strcpy(p, argv[i]);
+        p += strlen(argv[i]) + 1;
+    }
+
+    int header[2] = {argc, len};
+    struct iovec iov = {header, sizeof(header)};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(header) &&
+               send(fd, args, len, MSG_NOSIGNAL) == len;
+    free(args);
+    if (!sent){
+        close(fd);
+        return -1;
+    }
+
+    // the command has started; never run it twice
+    int status;
+    if (recv(fd, &status, sizeof(status), MSG_WAITALL) != sizeof(status)){
+        puts("Lost connection to the agent");
+        status = EXIT_FAILURE;
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * Makes sure an agent is serving the current directory.
+ */
+void agent_start(){
+    int fd = connect_or_spawn(1);
+    if (fd == -1){
+        puts("Couldn't start the agent");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+void agent_stop(){
+    char *argv[] = {"WTF", "agent", "stop"};
+    if (agent_request(3, argv, 0) == -1)
+        puts("No agent is running");
+}
+
+/****************************************************************
+ *  AGENT
+ ***************************************************************/
+
+/**
+ * Checks a connection is still in step with the server, without the
+ * usual helpers: they exit on a bad ACK, and the agent has to survive.
+ */
+static int ping_server(int sock){
+    struct timeval timeout = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char buf[5];
+    int ok = send(sock, "ping\n", 5, MSG_NOSIGNAL) == 5 &&
+             recv(sock, buf, 4, MSG_WAITALL) == 4 && !memcmp(buf, "ACK", 4) &&
+             recv(sock, buf, 5, MSG_WAITALL) == 5 && !memcmp(buf, "pong\n", 5) &&
+             send(sock, "ACK", 4, MSG_NOSIGNAL) == 4;
+
+    struct timeval none = {0, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    return ok;
+}
+
+static int dial_server(agent_t *agent){
+
+    // resolve again whenever .configure changes
+    if (!agent->resolved || !file_version_current(".configure", &agent->config_version)){
+        int i;
+        for (i = 0; i < agent->pool_count; i++)
+            close(agent->pool[i]);
+        agent->pool_count = 0;
+        get_file_version(".configure", &agent->config_version);
+        agent->resolved = !resolve_server(&agent->serv_addr);
+    }
+    if (!agent->resolved)
+        return -1;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(sock, (struct sockaddr *) &agent->serv_addr, sizeof(agent->serv_addr)) == -1){
+        close(sock);
+        return -1;
+    }
+    set_nodelay(sock);
+    return sock;
+}
+
+/**
+ * An idle connection from the pool, or a new one. An idle connection
+ * with anything to read has been closed by the server.
+ */
+static int take_server_sock(agent_t *agent){
+    if (agent->resolved && !file_version_current(".configure", &agent->config_version))
+        return dial_server(agent);
+
+    while (agent->pool_count > 0){
+        int sock = agent->pool[--agent->pool_count];
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if (poll(&pfd, 1, 0) == 0)
+            return sock;
+        close(sock);
+    }
+    return dial_server(agent);
+}
+
+static void return_server_sock(agent_t *agent, int sock){
+    if (agent->pool_count < AGENT_POOL_SIZE && ping_server(sock))
+        agent->pool[agent->pool_count++] = sock;
+    else
+        close(sock);
+}
+
+/**
+ * Reads a request and forks the process that runs it.
+ */
+static void start_request(agent_t *agent, int client_fd){
+    int header[2];
+    int fds[3] = {-1, -1, -1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {header, sizeof(header)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int ok = recvmsg(client_fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) == sizeof(header);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (ok && cmsg && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    int argc = header[0];
+    int len = header[1];
+    ok = ok && fds[2] != -1 && argc >= 3 && len > 0 && len <= 64 * 1024;
+
+    char *args = ok ? malloc(len) : NULL;
+    ok = ok && recv(client_fd, args, len, MSG_WAITALL) == len && args[len - 1] == '\0';
+
+    char **argv = ok ? calloc(argc + 1, sizeof(char *)) : NULL;
+    int i;
+    char *p = args;
+    for (i = 0; ok && i < argc; i++){
+        if (p >= args + len){
+            ok = 0;
+            break;
+        }
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    int status = AGENT_BUSY;
+    if (ok && !strcmp(argv[1], "agent")){
+        // only "stop" gets this far
+        agent->stopping = 1;
+        status = EXIT_SUCCESS;
+    } else if (ok && agent->num_reqs < AGENT_MAX_REQUESTS && !agent->stopping){
+        agent_req_t *req = &agent->reqs[agent->num_reqs];
+        req->server_sock = take_server_sock(agent);
+        req->client_fd = client_fd;
+        req->project = strdup(argv[2]);
+        req->interrupted = 0;
+
+        req->pid = fork();
+        if (req->pid == 0){
+            // the command gets the caller's terminal, and nothing of the agent's
+            close(agent->listen_fd);
+            close(agent->lock_fd);
+            for (i = 0; i < agent->pool_count; i++)
+                close(agent->pool[i]);
+            for (i = 0; i < agent->num_reqs; i++){
+                close(agent->reqs[i].client_fd);
+                if (agent->reqs[i].server_sock != -1)
+                    close(agent->reqs[i].server_sock);
+            }
+            close(client_fd);
+            dup2(fds[0], STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            dup2(fds[2], STDERR_FILENO);
+
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            signal(SIGPIPE, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+
+            agent_sock = req->server_sock;
+            exit(run_command(argc, argv));
+        }
+
+        if (req->pid > 0){
+            agent->num_reqs++;
+            client_fd = -1;
+        } else {
+            if (req->server_sock != -1)
+                close(req->server_sock);
+            free(req->project);
+        }
+    }
+
+    for (i = 0; i < 3; i++)
+        if (fds[i] != -1)
+            close(fds[i]);
+    free(argv);
+    free(args);
+
+    // anything not handed to a process is answered right away
+    if (client_fd != -1){
+        send(client_fd, &status, sizeof(status), MSG_NOSIGNAL);
+        close(client_fd);
+    }
+}
+
+/**
+ * Answers the front end of a finished command, and keeps what
+ * the command left behind warm.
+ */
+static void finish_request(agent_t *agent, int index, int wstatus){
+    agent_req_t *req = &agent->reqs[index];
+    int status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    send(req->client_fd, &status, sizeof(status), MSG_NOSIGNAL);
+    close(req->client_fd);
+
+    if (req->server_sock != -1){
+        if (status == EXIT_SUCCESS)
+            return_server_sock(agent, req->server_sock);
+        else
+            close(req->server_sock);
+    }
+
+    // parse what the next command on this project will read
+    struct stat st = {0};
+    if (status == EXIT_SUCCESS && stat(req->project, &st) != -1 && S_ISDIR(st.st_mode)){
+        char *manifest;
+        asprintf(&manifest, "%s/.Manifest", req->project);
+        warm_merkle_tree(manifest, 1);
+        warm_stat_index(req->project);
+        free(manifest);
+    }
+    free(req->project);
+
+    agent->reqs[index] = agent->reqs[--agent->num_reqs];
+
+    // have a connection ready for the next command
+    if (agent->pool_count == 0){
+        int sock = dial_server(agent);
+        if (sock != -1)
+            agent->pool[agent->pool_count++] = sock;
+    }
+}
+
+static void on_sigchld(int sig){
+}
+
+static void run_agent(){
+
+    // one agent per directory
+    agent_t agent = {0};
+    agent.lock_fd = open(AGENT_LOCK, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (agent.lock_fd == -1 || flock(agent.lock_fd, LOCK_EX | LOCK_NB) == -1)
+        return;
+
+    // a socket left by an agent that died is ours to replace
+    unlink(AGENT_SOCKET);
+    agent.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, AGENT_SOCKET);
+    if (bind(agent.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+            listen(agent.listen_fd, 64) == -1)
+        return;
+    struct stat st = {0};
+    stat(AGENT_SOCKET, &st);
+    agent.socket_ino = st.st_ino;
+
+    // SIGCHLD is only let through while waiting in ppoll
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = {0};
+    sa.sa_handler = on_sigchld;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigset_t block, wait_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &wait_mask);
+    sigdelset(&wait_mask, SIGCHLD);
+
+    agent.last_request = time(NULL);
+    int sock = dial_server(&agent);
+    if (sock != -1)
+        agent.pool[agent.pool_count++] = sock;
+
+    while (!agent.stopping || agent.num_reqs > 0){
+        struct pollfd pfds[AGENT_MAX_REQUESTS + 1];
+        pfds[0].fd = agent.listen_fd;
+        pfds[0].events = POLLIN;
+        int i;
+        for (i = 0; i < agent.num_reqs; i++){
+            pfds[i + 1].fd = agent.reqs[i].client_fd;
+            pfds[i + 1].events = POLLRDHUP;
+        }
+        struct timespec timeout = {1, 0};
+        int ready = ppoll(pfds, agent.num_reqs + 1, &timeout, &wait_mask);
+
+        if (ready > 0){
+            // a front end that went away (ctrl-c) takes its command with it
+            for (i = 0; i < agent.num_reqs; i++){
+                if ((pfds[i + 1].revents & (POLLRDHUP | POLLHUP)) && !agent.reqs[i].interrupted){
+                    kill(agent.reqs[i].pid, SIGINT);
+                    agent.reqs[i].interrupted = 1;
+                }
+            }
+
+            if (pfds[0].revents & POLLIN){
+                int client_fd = accept4(agent.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (client_fd != -1){
+                    agent.last_request = time(NULL);
+                    start_request(&agent, client_fd);
+                }
+            }
+        }
+
+        // finished commands
+        int wstatus;
+        pid_t pid;
+        while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0){
+            for (i = 0; i < agent.num_reqs; i++){
+                if (agent.reqs[i].pid == pid){
+                    finish_request(&agent, i, wstatus);
+                    break;
+                }
+            }
+        }
+
+        // exit when idle, or when the socket was removed (make clean, rm -r)
+        struct stat st = {0};
+        if (stat(AGENT_SOCKET, &st) == -1 || st.st_ino != agent.socket_ino)
+            agent.stopping = 1;
+        if (agent.num_reqs == 0 && time(NULL) - agent.last_request >= AGENT_IDLE_TIMEOUT)
+            agent.stopping = 1;
+    }
+
+    // stop taking commands before giving up the lock
+    if (stat(AGENT_SOCKET, &st) != -1 && st.st_ino == agent.socket_ino)
+        unlink(AGENT_SOCKET);
+    close(agent.listen_fd);
+    int i;
+    for (i = 0; i < agent.pool_count; i++)
+        close(agent.pool[i]);
+    close(agent.lock_fd);
+}
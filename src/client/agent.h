@@ -0,0 +1,24 @@
+#pragma once
+
+// unix socket and lock of the agent serving the current directory
+#define AGENT_SOCKET ".agent.sock"
+#define AGENT_LOCK ".agent.lock"
+
+// idle server connections kept open
+#define AGENT_POOL_SIZE 4
+
+// commands run at the same time
+#define AGENT_MAX_REQUESTS 32
+
+// seconds without a command before the agent exits
+#define AGENT_IDLE_TIMEOUT 600
+
+// reply when the agent can't take the command
+#define AGENT_BUSY -1
+
+int agent_request(int argc, char *argv[], int spawn);
+void agent_start();
+void agent_stop();
+
+// provided by main.c
+int run_command(int argc, char *argv[]);
@@ -25,7 +25,7 @@ void configure(char *hostname, char *port){
     free(buf);
 }
 
-void checkout(char *project){
+void checkout(char *project, char **paths, int num_paths){
 
     // check if project already exists locally
     struct stat st = {0};
@@ -43,8 +43,67 @@ void checkout(char *project){
         exit(EXIT_FAILURE);
     }
 
-    recv_directory(sock, project);
+    // a sparse checkout only receives the files under its paths
+    sparse_t *sparse = init_sparse(project, paths, num_paths);
+    send_sparse(sock, sparse);
+
+    char *hash_name = recv_line(sock);
+
+    // receive the archive, picking up where an interrupted
+    // checkout of the same paths left off
+    char *request = strdup("");
+    int i;
+    for (i = 0; sparse && i < sparse->count; i++){
+        char *next;
+        asprintf(&next, "%s%s\n", request, sparse->prefixes[i]);
+        free(request);
+        request = next;
+    }
+    char key[HEXDIGEST_MAX+1];
+    md5sum_buf(request, strlen(request), key);
+    free(request);
+    char *name;
+    asprintf(&name, "checkout.%s", project);
+    transfer_t *transfer = load_transfer(name, key);
+    free(name);
+    int received = recv_transfer(sock, transfer);
+    if (received != 1){
+        if (received == -1)
+            puts("Run checkout again to resume.");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    // files are hashed as they are extracted, then checked
+    // against the .Manifest and remembered in the stat index
+    archive_file_t *files;
+    if (!extract_archive(transfer->part, NULL, parse_hash_algo(hash_name), &files))
+        puts("Received archive is incomplete");
+    free(hash_name);
+
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
+    stat_index_t *index = load_stat_index(project);
+    int verified = verify_archive_files(files, manifest, 1, index, sparse);
+    save_stat_index(index);
+    clean_stat_index(index);
+    clean_archive_files(files);
+    free(manifest);
+
+    // the server can let go of the archive now
+    send_int(sock, 1);
     close(sock);
+    finish_transfer(transfer);
+    clean_transfer(transfer);
+
+    // later commands stay within the same paths
+    save_sparse(sparse);
+    clean_sparse(sparse);
+
+    if (!verified){
+        puts("Checked out files don't match the server .Manifest!");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void update(char *project){
@@ -60,17 +119,24 @@ void update(char *project){
     char *conflict;
     asprintf(&conflict, "%s/.Conflict", project);
 
-    // retrieve server .Manifest and parse version
-    char tempfile[15+1];
-    gen_temp_filename(tempfile);
-    recv_file(sock, tempfile);
-    int server_manifest_version = get_manifest_version(tempfile);
-
     // retrieve client .Manifest and parse version
     char *manifest;
     asprintf(&manifest, "%s/.Manifest", project);
     int client_manifest_version = get_manifest_version(manifest);
 
+    // rebuild server .Manifest from what changed since our version and parse it
+    char tempfile[15+1];
+    gen_temp_filename(tempfile);
+    recv_manifest_sync(sock, manifest, tempfile);
+    int server_manifest_version = get_manifest_version(tempfile);
+
+    // server switched content hash; convert our digests before comparing
+    int server_algo = get_manifest_hash(tempfile);
+    if (server_algo != get_manifest_hash(manifest)){
+        printf("Project now uses %s; converting local .Manifest\n", hash_algo_name(server_algo));
+        convert_manifest_hash(manifest, server_algo, client_manifest_version, 1);
+    }
+
     // if client and server .Manifest versions are same: write blank .Update file and remove .Conflict
     if (server_manifest_version == client_manifest_version){
         puts("Client and server .Manifest versions match!");
@@ -138,28 +204,68 @@ void upgrade(char *project){
         exit(EXIT_FAILURE);
     }
 
-    // receive tar of modified/added files from server
+    // send the files we want, only asking for the
+    // ones that are part of a sparse checkout
+    sparse_t *sparse = load_sparse(project);
     char tempfile[15+1];
     gen_temp_filename(tempfile);
-    send_file(update, sock, 0);
-    recv_file(sock, tempfile);
+    if (sparse)
+        filter_sparse_listing(sparse, update, tempfile);
+    char *request = sparse ? tempfile : update;
+    send_file(request, sock, 0);
+
+    // receive tar of modified/added files from server, picking up
+    // where an interrupted upgrade for the same files left off
+    char key[HEXDIGEST_MAX+1];
+    md5sum(request, key);
+    if (sparse)
+        remove(tempfile);
+    char *name;
+    asprintf(&name, "upgrade.%s", project);
+    transfer_t *transfer = load_transfer(name, key);
+    free(name);
+    int received = recv_transfer(sock, transfer);
+    if (received != 1){
+        if (received == -1)
+            puts("Run upgrade again to resume.");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+    int server_manifest_version = recv_int(sock);
 
-    // if tar is not empty, untar it into project
+    // if tar is not empty, untar it into project, hashing files as they
+    // are written and checking them against the .Update
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
     struct stat st_tar = {0};
-    stat(tempfile, &st_tar);
+    stat(transfer->part, &st_tar);
+    int verified = 1;
     if(st_tar.st_size > 0){
-        char *untar_cmd;
-        asprintf(&untar_cmd, "tar xzf %s", tempfile);
-        system(untar_cmd);
-        free(untar_cmd);
+        archive_file_t *files;
+        extract_archive(transfer->part, NULL, get_manifest_hash(manifest), &files);
+        stat_index_t *index = load_stat_index(project);
+        verified = verify_archive_files(files, update, 0, index, sparse);
+        save_stat_index(index);
+        clean_stat_index(index);
+        clean_archive_files(files);
     }
-    remove(tempfile);
+    clean_sparse(sparse);
+
+    // the server can let go of the archive now
+    send_int(sock, 1);
+    finish_transfer(transfer);
+    clean_transfer(transfer);
 
     // after pulling in all changes, recreate
     // using server manifest version and update information
-    int server_manifest_version = recv_int(sock);
-    char *manifest;
-    asprintf(&manifest, "%s/.Manifest", project);
+    if (!verified){
+        puts("Upgraded files don't match the .Update; run update and upgrade again.");
+        free(manifest);
+        free(update);
+        free(conflict);
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
     regenerate_manifest_from_update(manifest, update, server_manifest_version);
 
     // cleanup
@@ -188,61 +294,68 @@ void commit(char *project){
         exit(EXIT_FAILURE);
     }
 
+    // create .Commit file from local changes
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
+    char *commit;
+    asprintf(&commit, "%s/.Commit", project);
+    if (!generate_commit_file(project, commit, manifest)){
+        remove(commit);
+        free(manifest);
+        free(commit);
+        exit(EXIT_FAILURE);
+    }
+
     // connect to server and make sure project exists
     init_socket_server(&sock, "commit");
     if (!server_project_exists(sock, project)){
         puts("Project doesn't exist on server!");
         puts("Client disconnecting.");
+        remove(commit);
         close(sock);
         exit(EXIT_FAILURE);
     }
 
-    // retrieve server .Manifest and parse version
-    char tempfile[15+1];
-    gen_temp_filename(tempfile);
-    recv_file(sock, tempfile);
-    int server_manifest_version = get_manifest_version(tempfile);
-
-    // retrieve client .Manifest and parse version
-    char *manifest;
-    asprintf(&manifest, "%s/.Manifest", project);
-    int client_manifest_version = get_manifest_version(manifest);
-
     // verify .Manifest versions are equal
-    if (server_manifest_version != client_manifest_version){
+    send_int(sock, get_manifest_version(manifest));
+    if (!recv_int(sock)){
         puts("Client and server .Manifest versions don't match!");
         puts("You need to update to the latest server code first.");
-        send_int(sock, 0);
+        remove(commit);
         free(manifest);
-        remove(tempfile);
+        free(commit);
         close(sock);
         exit(EXIT_FAILURE);
     }
 
-    // create .Commit file
-    char *commit;
-    asprintf(&commit, "%s/.Commit", project);
-    if (!generate_commit_file(commit, manifest, tempfile)){
-        send_int(sock, 0);
+    // send proposed .Commit and receive the server's verdict on each entry
+    send_file(commit, sock, 0);
+    int accepted = recv_int(sock);
+    char results[15+1];
+    gen_temp_filename(results);
+    recv_file(sock, results);
+
+    if (!accepted){
+        file_buf_t *info = init_file_buf(results);
+        while (1){
+            read_file_until(info, '\n');
+            if (info->file_eof)
+                break;
+            if (!strncmp(info->data, "rejected", strlen("rejected")))
+                puts(info->data);
+        }
+        clean_file_buf(info);
+        puts("Client must sync with repository before commiting changes!");
         remove(commit);
-        close(sock);
-        free(manifest);
-        free(commit);
-        remove(tempfile);
-        exit(EXIT_FAILURE);
     }
 
-    // send success
-    send_int(sock, 1);
-
-    // send commit file to server
-    send_file(commit, sock, 1);
-
     // cleanup
+    remove(results);
     free(manifest);
     free(commit);
-    remove(tempfile);
     close(sock);
+    if (!accepted)
+        exit(EXIT_FAILURE);
 }
 
 void push(char *project){
@@ -272,27 +385,65 @@ void push(char *project){
     // send local .Commit file md5sum to server and wait for acceptance
     char *commitPath;
     asprintf(&commitPath, "%s/.Commit", project);
-    char digest[32+1];
+    char digest[HEXDIGEST_MAX+1];
     md5sum(commitPath, digest);
     send_line(sock, digest);
 
     int success = recv_int(sock);
 
     if (success){
-        // generate a tar of all A/M files in .Commit and send to server
-        char *tar_name = generate_am_tar(commitPath);
-        send_file(tar_name, sock, 0);
+        // tar all A/M files in .Commit, or reuse the tar of an earlier,
+        // interrupted push of this commit, and send what the server lacks
+        char *tar_name = staged_transfer(digest);
+        if (!tar_name){
+            char *built = generate_am_tar(".", commitPath);
+            tar_name = stage_transfer(built, digest);
+            free(built);
+        }
+        long offset;
+        char *id = recv_transfer_request(sock, &offset);
+        if (strcmp(id, digest))
+            offset = 0;
+        free(id);
+        if (!send_transfer(sock, digest, tar_name, offset)){
+            puts("Run push again to resume.");
+            exit(EXIT_FAILURE);
+        }
+        remove(tar_name);
+        free(tar_name);
+
+        // server checks the files it received against the .Commit
+        if (!recv_int(sock)){
+            puts("Pushed files don't match the .Commit; commit and push again.");
+            free(commitPath);
+            close(sock);
+            exit(EXIT_FAILURE);
+        }
 
         // regenerate manifest file from .Commit
         char *manifestPath;
         asprintf(&manifestPath, "%s/.Manifest", project);
         regenerate_manifest_from_commit(manifestPath, commitPath);
 
-        // send the manifest to the server
+        // send the manifest to the server, which answers with the
+        // version the push became once other clients can see it
         send_file(manifestPath, sock, 0);
-
-        remove(tar_name);
-        free(tar_name);
+        int version = recv_int(sock);
+        if (!version){
+            puts("Pushed files were changed on the server since the commit; update, commit and push again.");
+            free(manifestPath);
+            free(commitPath);
+            close(sock);
+            exit(EXIT_FAILURE);
+        }
+
+        // other pushes landed first. the .Manifest stays at the version
+        // it was made against, so update fetches them (and ours again)
+        int base = get_manifest_version(manifestPath) - 1;
+        if (version != base + 1){
+            set_manifest_version(manifestPath, base);
+            printf("Pushed as version %d on top of other changes; update to get them.\n", version);
+        }
         free(manifestPath);
     } else {
         puts("Client push rejected");
@@ -304,7 +455,7 @@ void push(char *project){
     close(sock);
 }
 
-void create(char *project){
+void create(char *project, int algo){
     init_socket_server(&sock, "create");
 
     // make sure project doesn't exist on server
@@ -315,6 +466,9 @@ void create(char *project){
         exit(EXIT_FAILURE);
     }
 
+    // choose the project's content hash
+    send_line(sock, hash_algo_name(algo));
+
     // create local project folder
     mkdir(project, 0755);
 
@@ -340,6 +494,15 @@ void destroy(char *project){
 
 void add(char *project, char *filename){
     assert_project_exists_local(project);
+
+    // a sparse checkout can't commit files outside its paths
+    sparse_t *sparse = load_sparse(project);
+    int in_checkout = sparse_match(sparse, filename);
+    clean_sparse(sparse);
+    if (!in_checkout){
+        puts("File is outside the sparse checkout's paths.");
+        exit(EXIT_FAILURE);
+    }
     add_to_manifest(project, filename);
 }
 
@@ -348,6 +511,57 @@ void remove_cmd(char *project, char *filename){
     remove_from_manifest(project, filename);
 }
 
+/**
+ * Lists what a commit would contain, without asking the server.
+ * With `WTF monitor` running, only files it saw change are looked at.
+ */
+void status(char *project){
+    assert_project_exists_local(project);
+
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
+    sparse_t *sparse = load_sparse(project);
+    stat_index_t *index = load_stat_index(project);
+    index_hash_manifest(index, manifest, sparse);
+
+    file_buf_t *info = init_file_buf(manifest);
+    read_file_until(info, '\n');
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (!sparse_match(sparse, ml->fname)){
+            clean_manifest_line(ml);
+            continue;
+        }
+
+        // "!" marks tracked files missing from disk
+        index_entry_t *entry = find_index_entry(index, ml->fname);
+        if (ml->code == 'A' || ml->code == 'D'){
+            printf("%c %s\n", ml->code, ml->fname);
+        } else if (!entry){
+            printf("! %s\n", ml->fname);
+        } else if (strcmp(entry->hexdigest, ml->hexdigest)){
+            printf("M %s\n", ml->fname);
+        }
+        clean_manifest_line(ml);
+    }
+    clean_file_buf(info);
+    save_stat_index(index);
+    clean_stat_index(index);
+    clean_sparse(sparse);
+    free(manifest);
+}
+
+/**
+ * Watches the project and journals changed files until interrupted.
+ */
+void monitor(char *project){
+    assert_project_exists_local(project);
+    run_monitor(project);
+}
+
 void currentversion(char *project){
     init_socket_server(&sock, "currentversion");
 
@@ -359,10 +573,13 @@ void currentversion(char *project){
         exit(EXIT_FAILURE);
     }
 
-    // receive .Manifest into a tempfile
+    // rebuild server .Manifest into a tempfile from what changed since our version
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
     char tempfile[15+1];
     gen_temp_filename(tempfile);
-    recv_file(sock, tempfile);
+    recv_manifest_sync(sock, manifest, tempfile);
+    free(manifest);
 
     file_buf_t *info = init_file_buf(tempfile);
 
@@ -389,7 +606,7 @@ void currentversion(char *project){
     puts("Client gracefully disconnected from server");
 }
 
-void history(char *project){
+void history(char *project, int since, int limit, char *path){
     init_socket_server(&sock, "history");
     if (!server_project_exists(sock, project)){
         puts("Project doesn't exist on server!");
@@ -398,21 +615,15 @@ void history(char *project){
         exit(EXIT_FAILURE);
     }
 
-    // receive .History into a tempfile
-    char tempfile[15+1];
-    gen_temp_filename(tempfile);
-    recv_file(sock, tempfile);
+    // request a range of versions, optionally limited to a path
+    send_int(sock, since);
+    send_int(sock, limit);
+    send_line(sock, path ? path : "");
 
-    file_buf_t *info = init_file_buf(tempfile);
-
-    // go through the file and print output
+    // print rows as they are streamed in
     puts("");
-    while(1) {
-        read_file_until(info, '\n');
-        if (info->file_eof)
-            break;
-        printf("%s\n", info->data);
-    }
+    fflush(stdout);
+    recv_history(sock, STDOUT_FILENO);
     puts("");
     close(sock);
 }
@@ -432,3 +643,36 @@ void rollback(char *project, char *version){
     }
     close(sock);
 }
+
+void rehash(char *project, int algo){
+    assert_project_exists_local(project);
+
+    init_socket_server(&sock, "rehash");
+    if (!server_project_exists(sock, project)){
+        puts("Project doesn't exist on server!");
+        puts("Client disconnecting.");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    // have the server convert its copy first
+    send_line(sock, hash_algo_name(algo));
+    int server_version = recv_int(sock);
+    int converted = recv_int(sock);
+    close(sock);
+    if (server_version == -1){
+        puts("Server doesn't support that hash.");
+        exit(EXIT_FAILURE);
+    }
+
+    // then convert ours. if we were up to date, the conversion
+    // is the only change in the new server version
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
+    int version = get_manifest_version(manifest);
+    if (converted && version == server_version - 1)
+        version = server_version;
+    convert_manifest_hash(manifest, algo, version, 1);
+    printf("Project now uses %s\n", hash_algo_name(algo));
+    free(manifest);
+}
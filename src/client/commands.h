@@ -1,17 +1,29 @@
 #pragma once
 
 #include "../common/helpers.h"
+#include "../common/merkle.h"
+#include "../common/sync.h"
+#include "../common/history.h"
+#include "../common/digest.h"
+#include "../common/archive.h"
+#include "../common/index.h"
+#include "../common/journal.h"
+#include "../common/sparse.h"
+#include "../common/transfer.h"
 
 void configure(char *hostname, char *port);
-void checkout(char *project);
+void checkout(char *project, char **paths, int num_paths);
 void update(char *project);
 void upgrade(char *project);
 void commit(char *project);
 void push(char *project);
-void create(char *project);
+void create(char *project, int algo);
 void destroy(char *project);
 void add(char *project, char *filename);
 void remove_cmd(char *project, char *filename);
+void status(char *project);
+void monitor(char *project);
 void currentversion(char *project);
-void history(char *project);
+void history(char *project, int since, int limit, char *path);
 void rollback(char *project, char *version);
+void rehash(char *project, int algo);
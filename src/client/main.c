@@ -5,23 +5,29 @@
 #include <arpa/inet.h>
 
 #include "commands.h"
+#include "agent.h"
 
 const char *usage_str =
 "\nusage: wtf <command> [<args>]\n\n"
 "commands:\n"
 "    configure      <hostname> <port>\n"
-"    checkout       <project>\n"
+"    checkout       <project> [--path <dir>/...]...\n"
 "    update         <project>\n"
 "    upgrade        <project>\n"
 "    commit         <project>\n"
 "    push           <project>\n"
-"    create         <project>\n"
+"    create         <project> [--hash md5|blake2s|xxh64]\n"
 "    destroy        <project>\n"
 "    add            <project> <filename>\n"
 "    remove         <project> <filename>\n"
+"    status         <project>\n"
+"    monitor        <project>\n"
 "    currentversion <project>\n"
-"    history        <project>\n"
-"    rollback       <project> <version>";
+"    history        <project> [--since <version>] [--limit <count>] [--path <path>]\n"
+"    rollback       <project> <version>\n"
+"    rehash         <project> md5|blake2s|xxh64\n"
+"    agent          start|stop\n\n"
+"set WTF_AGENT to run commands through a background agent";
 
 void usage(char *msg){
     if (msg) puts(msg);
@@ -29,16 +35,28 @@ void usage(char *msg){
     exit(EXIT_FAILURE);
 }
 
-int main(int argc, char *argv[]){
+/**
+ * Runs one command, here or in a process forked by the agent.
+ * Returns the exit status.
+ */
+int run_command(int argc, char *argv[]){
     seed_rand();
-    if (argc < 3) usage("Unreconized command or missing argument");
     char *cmd = argv[1];
 
     if (!strcmp(cmd, "configure")){
         if (argc < 4) usage("Missing port arg for configure");
         configure(argv[2], argv[3]);
     } else if (!strcmp(cmd, "checkout")){
-        checkout(argv[2]);
+        // each --path limits the checkout to a directory of the project
+        char **paths = malloc(argc * sizeof(char *));
+        int num_paths = 0;
+        int i;
+        for (i = 3; i < argc; i++){
+            if (strcmp(argv[i], "--path") || i + 1 >= argc) usage("Invalid checkout option");
+            paths[num_paths++] = argv[++i];
+        }
+        checkout(argv[2], paths, num_paths);
+        free(paths);
     } else if (!strcmp(cmd, "update")){
         update(argv[2]);
     } else if (!strcmp(cmd, "upgrade")){
@@ -48,7 +66,13 @@ int main(int argc, char *argv[]){
     } else if (!strcmp(cmd, "push")){
         push(argv[2]);
     } else if (!strcmp(cmd, "create")){
-        create(argv[2]);
+        int algo = HASH_MD5;
+        if (argc >= 4){
+            if (strcmp(argv[3], "--hash") || argc < 5) usage("Invalid create option");
+            algo = parse_hash_algo(argv[4]);
+            if (algo == -1) usage("Unknown hash");
+        }
+        create(argv[2], algo);
     } else if (!strcmp(cmd, "destroy")){
         destroy(argv[2]);
     } else if (!strcmp(cmd, "add")){
@@ -57,16 +81,62 @@ int main(int argc, char *argv[]){
     } else if (!strcmp(cmd, "remove")){
         if (argc < 4) usage("Missing filename args for remove");
         remove_cmd(argv[2], argv[3]);
+    } else if (!strcmp(cmd, "status")){
+        status(argv[2]);
+    } else if (!strcmp(cmd, "monitor")){
+        monitor(argv[2]);
     } else if (!strcmp(cmd, "currentversion")){
         currentversion(argv[2]);
     } else if (!strcmp(cmd, "history")){
-        history(argv[2]);
+        int since = -1;
+        int limit = 0;
+        char *path = NULL;
+        int i;
+        for (i = 3; i < argc; i++){
+            if (i + 1 >= argc) usage("Missing value for history option");
+            if (!strcmp(argv[i], "--since")){
+                since = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "--limit")){
+                limit = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "--path")){
+                path = argv[++i];
+            } else {
+                usage("Invalid history option");
+            }
+        }
+        history(argv[2], since, limit, path);
     } else if (!strcmp(cmd, "rollback")){
         if (argc < 4) usage("Missing version arg for rollback");
         rollback(argv[2], argv[3]);
+    } else if (!strcmp(cmd, "rehash")){
+        if (argc < 4) usage("Missing hash arg for rehash");
+        int algo = parse_hash_algo(argv[3]);
+        if (algo == -1) usage("Unknown hash");
+        rehash(argv[2], algo);
+    } else if (!strcmp(cmd, "agent")){
+        if (!strcmp(argv[2], "start")){
+            agent_start();
+        } else if (!strcmp(argv[2], "stop")){
+            agent_stop();
+        } else {
+            usage("Invalid agent option");
+        }
     } else {
         usage("Invalid command");
     }
     puts("Command completed successfully");
     return 0;
 }
+
+int main(int argc, char *argv[]){
+    if (argc < 3) usage("Unreconized command or missing argument");
+
+    // hand the command to the agent if there is one, or spawn
+    // it if asked to. monitor runs until interrupted, so not there
+    if (strcmp(argv[1], "agent") && strcmp(argv[1], "monitor")){
+        int status = agent_request(argc, argv, getenv("WTF_AGENT") != NULL);
+        if (status != -1)
+            return status;
+    }
+    return run_command(argc, argv);
+}
@@ -0,0 +1,606 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "digest.h"
+
+// ======================================
+// Archive extraction
+// ======================================
+// Archives are the .tar.gz files made by `tar -czf`. Rather than
+// shelling out to `tar -xzf` and hashing every file again afterwards,
+// extract_archive unpacks them itself and hashes each file's bytes on
+// their way to disk. Callers then check the digests against the
+// manifest entries the archive was built from.
+//
+// Inflating is inherently serial, so the calling thread only does that:
+// it parses headers, creates each directory once, and hands whole files
+// to a pool of workers that write and hash them. With 100k small files
+// the open/write/close syscalls, not inflate, are the bulk of the work.
+
+#define ARCHIVE_READ_SIZE (64 * 1024)
+
+/**
+ * Parses a numeric header field: octal text, or GNU base-256
+ * for values too large for it.
+ */
+static long tar_number(unsigned char *field, int len){
+    long value = 0;
+    int i;
+    if (field[0] & 0x80){
+        value = field[0] & 0x3f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | field[i];
+        return value;
+    }
+    for (i = 0; i < len && (field[i] == ' ' || field[i] == '\0'); i++);
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+/**
+ * Copies a fixed-size, maybe unterminated header string.
+ */
+static char *tar_string(unsigned char *field, int len){
+    return strndup((char *) field, len);
+}
+
+/**
+ * Strips "./" and "/" prefixes. Returns NULL for paths that are
+ * empty or would escape the destination directory.
+ */
+static char *clean_archive_path(char *path){
+    while (!strncmp(path, "./", 2) || path[0] == '/')
+        path += path[0] == '/' ? 1 : 2;
+    if (!*path || !strcmp(path, "."))
+        return NULL;
+
+    char *p = path;
+    while (p){
+        if (!strncmp(p, "..", 2) && (p[2] == '/' || p[2] == '\0'))
+            return NULL;
+        p = strchr(p, '/');
+        if (p)
+            p++;
+    }
+    return path;
+}
+
+/**
+ * Reads exactly len bytes (or skips them if buf is NULL).
+ * Returns whether the archive had that many.
+ */
+static int archive_read(gzFile gz, unsigned char *buf, long len){
+    unsigned char skip[TAR_BLOCK_SIZE];
+    while (len > 0){
+        int want = len > ARCHIVE_READ_SIZE ? ARCHIVE_READ_SIZE : len;
+        if (!buf && want > TAR_BLOCK_SIZE)
+            want = TAR_BLOCK_SIZE;
+        int got = gzread(gz, buf ? buf : skip, want);
+        if (got <= 0)
+            return 0;
+        if (buf)
+            buf += got;
+        len -= got;
+    }
+    return 1;
+}
+
+static long padded_size(long size){
+    return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+/**
+ * Reads a pax extended header and returns its path record, if any.
+ */
+static char *pax_path(gzFile gz, long size){
+    char *data = malloc(size + 1);
+    if (!archive_read(gz, (unsigned char *) data, size)){
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    archive_read(gz, NULL, padded_size(size) - size);
+
+    // records are "<len> <key>=<value>\n"
+    char *path = NULL;
+    char *record = data;
+    while (record < data + size){
+        long len = strtol(record, NULL, 10);
+        char *key = strchr(record, ' ');
+        if (len <= 0 || !key)
+            break;
+        key++;
+        if (!strncmp(key, "path=", 5))
+            path = strndup(key + 5, record + len - 1 - (key + 5));
+        record += len;
+    }
+    free(data);
+    return path;
+}
+
+/**
+ * Makes dir and any missing parents, skipping the ones already made.
+ */
+static void make_dirs(archive_dir_t **dirs, char *dir){
+    if (!*dir)
+        return;
+    unsigned long hash = 5381;
+    char *c;
+    for (c = dir; *c; c++)
+        hash = hash * 33 + (unsigned char) *c;
+    archive_dir_t **bucket = &dirs[hash % ARCHIVE_DIR_BUCKETS];
+    archive_dir_t *known;
+    for (known = *bucket; known; known = known->next)
+        if (!strcmp(known->path, dir))
+            return;
+
+    char *slash = strrchr(dir, '/');
+    if (slash){
+        *slash = '\0';
+        make_dirs(dirs, dir);
+        *slash = '/';
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST){
+        puts("Error while creating path");
+        exit(EXIT_FAILURE);
+    }
+
+    known = malloc(sizeof(archive_dir_t));
+    known->path = strdup(dir);
+    known->next = *bucket;
+    *bucket = known;
+}
+
+/**
+ * Makes the directory a file will be written to.
+ */
+static void make_parent_dirs(archive_dir_t **dirs, char *fname){
+    char *slash = strrchr(fname, '/');
+    if (!slash)
+        return;
+    *slash = '\0';
+    make_dirs(dirs, fname);
+    *slash = '/';
+}
+
+static void clean_dirs(archive_dir_t **dirs){
+    int i;
+    for (i = 0; i < ARCHIVE_DIR_BUCKETS; i++){
+        while (dirs[i]){
+            archive_dir_t *next = dirs[i]->next;
+            free(dirs[i]->path);
+            free(dirs[i]);
+            dirs[i] = next;
+        }
+    }
+    free(dirs);
+}
+
+/**
+ * Opens a file for extraction. Large files get their blocks
+ * allocated in one go instead of as each write extends them.
+ */
+static int open_extracted(char *fname, long size, int mode){
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
+    if (fd != -1 && size >= ARCHIVE_FALLOCATE_MIN)
+        fallocate(fd, 0, 0, size);
+    return fd;
+}
+
+/**
+ * Gives an extracted file its archived mtime, like tar does, and
+ * remembers its stat so verifying it needs no second lookup.
+ */
+static void close_extracted(int fd, long mtime, archive_file_t *file){
+    if (fd == -1)
+        return;
+    struct timespec times[2] = {{0, UTIME_OMIT}, {mtime, 0}};
+    futimens(fd, times);
+    fstat(fd, &file->st);
+    close(fd);
+}
+
+/**
+ * Streams one entry's data to fname, hashing it as it goes.
+ * Used for files too large to hand to the workers whole.
+ */
+static int extract_file(gzFile gz, char *fname, long size, int mode, long mtime,
+                        int algo, archive_file_t *file){
+    int fd = open_extracted(fname, size, mode);
+
+    digest_ctx_t ctx;
+    digest_init(&ctx, algo);
+    unsigned char *buf = malloc(ARCHIVE_READ_SIZE);
+    long left = size;
+    int ok = 1;
+    while (left > 0){
+        int want = left > ARCHIVE_READ_SIZE ? ARCHIVE_READ_SIZE : left;
+        if (!archive_read(gz, buf, want)){
+            ok = 0;
+            break;
+        }
+        digest_update(&ctx, buf, want);
+        if (fd != -1)
+            write(fd, buf, want);
+        left -= want;
+    }
+    digest_final(&ctx, file->hexdigest);
+    free(buf);
+
+    close_extracted(fd, mtime, file);
+    return ok && archive_read(gz, NULL, padded_size(size) - size);
+}
+
+/**
+ * Writes and hashes one file read whole from the archive.
+ */
+static void write_extract_job(extract_job_t *job, int algo){
+    digest_ctx_t ctx;
+    digest_init(&ctx, algo);
+    digest_update(&ctx, job->data, job->size);
+    digest_final(&ctx, job->file->hexdigest);
+
+    int fd = open_extracted(job->out, job->size, job->mode);
+    if (fd != -1){
+        long written = 0;
+        while (written < job->size){
+            ssize_t bytes = write(fd, job->data + written, job->size - written);
+            if (bytes <= 0)
+                break;
+            written += bytes;
+        }
+    }
+    close_extracted(fd, job->mtime, job->file);
+}
+
+static void *extract_worker(void *arg){
+    extract_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1){
+        while (!pool->head && !pool->done){
+            pool->idle++;
+            pthread_cond_wait(&pool->has_jobs, &pool->lock);
+            pool->idle--;
+        }
+        extract_job_t *job = pool->head;
+        if (!job)
+            break;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        write_extract_job(job, pool->algo);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued_bytes -= job->size;
+        pthread_cond_signal(&pool->has_room);
+        free(job->out);
+        free(job->data);
+        free(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Hands a file to the workers, waiting while too much data is queued.
+ * Starts another worker if none is free to take it.
+ */
+static void queue_extract_job(extract_pool_t *pool, extract_job_t *job){
+    // with a single core, handing files over only adds context switches
+    if (!pool->max_workers){
+        write_extract_job(job, pool->algo);
+        free(job->out);
+        free(job->data);
+        free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued_bytes > 0 && pool->queued_bytes + job->size > ARCHIVE_QUEUE_BYTES)
+        pthread_cond_wait(&pool->has_room, &pool->lock);
+
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    pool->queued_bytes += job->size;
+
+    if (pool->queued > pool->idle && pool->num_workers < pool->max_workers){
+        pthread_create(&pool->workers[pool->num_workers], NULL, extract_worker, pool);
+        pool->num_workers++;
+    } else {
+        pthread_cond_signal(&pool->has_jobs);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void init_extract_pool(extract_pool_t *pool, int algo){
+    memset(pool, 0, sizeof(extract_pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_jobs, NULL);
+    pthread_cond_init(&pool->has_room, NULL);
+    pool->algo = algo;
+
+    // the calling thread keeps one core busy inflating
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->max_workers = cores < 2 ? 0 : cores - 1;
+    if (pool->max_workers > ARCHIVE_MAX_WORKERS)
+        pool->max_workers = ARCHIVE_MAX_WORKERS;
+}
+
+/**
+ * Lets the workers drain the queue and waits for them to exit.
+ */
+static void finish_extract_pool(extract_pool_t *pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->has_jobs);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i = 0; i < pool->num_workers; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_jobs);
+    pthread_cond_destroy(&pool->has_room);
+}
+
+/**
+ * Extracts a .tar.gz into dest (the current directory if NULL).
+ * Every regular file written is returned in files, in archive order,
+ * with the digest of its contents under the given content hash.
+ *
+ * Returns whether the whole archive could be read.
+ */
+int extract_archive(char *archive, char *dest, int algo, archive_file_t **files){
+    *files = NULL;
+    archive_file_t *last = NULL;
+
+    gzFile gz = gzopen(archive, "rb");
+    if (!gz)
+        return 0;
+    gzbuffer(gz, ARCHIVE_READ_SIZE);
+
+    archive_dir_t **dirs = calloc(ARCHIVE_DIR_BUCKETS, sizeof(archive_dir_t *));
+    if (dest)
+        make_dirs(dirs, dest);
+    extract_pool_t pool;
+    init_extract_pool(&pool, algo);
+
+    int ok = 1;
+    char *long_name = NULL;
+    unsigned char header[TAR_BLOCK_SIZE];
+    while (1){
+        int got = gzread(gz, header, TAR_BLOCK_SIZE);
+        if (got == 0)
+            break;
+        if (got != TAR_BLOCK_SIZE){
+            ok = 0;
+            break;
+        }
+
+        // an empty block marks the end of the archive
+        int i;
+        for (i = 0; i < TAR_BLOCK_SIZE && !header[i]; i++);
+        if (i == TAR_BLOCK_SIZE)
+            break;
+
+        char type = header[156];
+        long size = tar_number(header + 124, 12);
+        int mode = tar_number(header + 100, 8);
+        long mtime = tar_number(header + 136, 12);
+
+        // GNU long names and pax paths apply to the next entry
+        if (type == 'L'){
+            free(long_name);
+            long_name = calloc(1, size + 1);
+            ok = archive_read(gz, (unsigned char *) long_name, size) &&
+                 archive_read(gz, NULL, padded_size(size) - size);
+            if (!ok)
+                break;
+            continue;
+        }
+        if (type == 'x'){
+            char *path = pax_path(gz, size);
+            if (path){
+                free(long_name);
+                long_name = path;
+            }
+            continue;
+        }
+
+        // full name is prefix/name for ustar archives
+        char *name;
+        if (long_name){
+            name = long_name;
+            long_name = NULL;
+        } else if (!strncmp((char *) header + 257, "ustar", 5) && header[345]){
+            char *prefix = tar_string(header + 345, 155);
+            char *base = tar_string(header, 100);
+            asprintf(&name, "%s/%s", prefix, base);
+            free(prefix);
+            free(base);
+        } else {
+            name = tar_string(header, 100);
+        }
+
+        char *path = clean_archive_path(name);
+        char *out = NULL;
+        if (path){
+            if (dest)
+                asprintf(&out, "%s/%s", dest, path);
+            else
+                out = strdup(path);
+        }
+
+        if (out && type == '5'){
+            // directory: make sure it and its parents exist
+            int len = strlen(out);
+            while (len > 1 && out[len-1] == '/')
+                out[--len] = '\0';
+            make_dirs(dirs, out);
+            ok = archive_read(gz, NULL, padded_size(size));
+        } else if (out && (type == '0' || type == '\0' || type == '7')){
+            archive_file_t *file = calloc(1, sizeof(archive_file_t));
+            file->fname = strdup(path);
+            if (last)
+                last->next = file;
+            else
+                *files = file;
+            last = file;
+
+            // the workers only ever open files in directories made here
+            make_parent_dirs(dirs, out);
+            if (size > ARCHIVE_QUEUE_BYTES / 4){
+                ok = extract_file(gz, out, size, mode, mtime, algo, file);
+            } else {
+                extract_job_t *job = calloc(1, sizeof(extract_job_t));
+                job->data = malloc(size ? size : 1);
+                ok = archive_read(gz, job->data, size) &&
+                     archive_read(gz, NULL, padded_size(size) - size);
+                if (!ok){
+                    free(job->data);
+                    free(job);
+                } else {
+                    job->out = out;
+                    out = NULL;
+                    job->size = size;
+                    job->mode = mode;
+                    job->mtime = mtime;
+                    job->file = file;
+                    queue_extract_job(&pool, job);
+                }
+            }
+        } else if (out && type == '2'){
+            char *target = tar_string(header + 157, 100);
+            make_parent_dirs(dirs, out);
+            remove(out);
+            symlink(target, out);
+            free(target);
+            ok = archive_read(gz, NULL, padded_size(size));
+        } else {
+            // links between archived files and anything exotic are skipped
+            ok = archive_read(gz, NULL, padded_size(size));
+        }
+        free(out);
+        free(name);
+        if (!ok)
+            break;
+    }
+
+    finish_extract_pool(&pool);
+    clean_dirs(dirs);
+    free(long_name);
+    gzclose(gz);
+    return ok;
+}
+
+void clean_archive_files(archive_file_t *files){
+    while (files){
+        archive_file_t *next = files->next;
+        free(files->fname);
+        free(files);
+        files = next;
+    }
+}
+
+static int compare_archive_files(const void *a, const void *b){
+    return strcmp((*(archive_file_t **) a)->fname, (*(archive_file_t **) b)->fname);
+}
+
+/**
+ * Checks extracted files against the manifest-format listing the
+ * archive was built from (a .Manifest, .Update or .Commit). Every entry
+ * not coded "D" and part of the checkout (all of them if sparse is NULL)
+ * must have been extracted with the listed digest.
+ *
+ * If index is given, the digests of verified files are recorded in it,
+ * so nothing is hashed again until the files change.
+ *
+ * Returns whether every entry matched.
+ */
+int verify_archive_files(archive_file_t *files, char *listing, int skip_header, stat_index_t *index,
+                         sparse_t *sparse){
+    int count = 0;
+    archive_file_t *file;
+    for (file = files; file; file = file->next)
+        count++;
+    archive_file_t **sorted = malloc((count + 1) * sizeof(archive_file_t *));
+    count = 0;
+    for (file = files; file; file = file->next)
+        sorted[count++] = file;
+    qsort(sorted, count, sizeof(archive_file_t *), compare_archive_files);
+
+    int verified = 1;
+    file_buf_t *info = init_file_buf(listing);
+    if (skip_header)
+        read_file_until(info, '\n');
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (ml->code == 'D' || !sparse_match(sparse, ml->fname)){
+            clean_manifest_line(ml);
+            continue;
+        }
+
+        archive_file_t key = {.fname = ml->fname};
+        archive_file_t *key_ptr = &key;
+        archive_file_t **match = bsearch(&key_ptr, sorted, count, sizeof(archive_file_t *),
+                                         compare_archive_files);
+        if (!match){
+            printf("Missing from transfer: %s\n", ml->fname);
+            verified = 0;
+        } else if (strcmp((*match)->hexdigest, ml->hexdigest)){
+            printf("Checksum mismatch: %s\n", ml->fname);
+            verified = 0;
+        } else if (index){
+            // the stat taken when the file was written saves a lookup
+            struct stat st = (*match)->st;
+            if (st.st_ino || stat(ml->fname, &st) != -1)
+                update_index_entry(index, ml->fname, &st, ml->hexdigest);
+        }
+        clean_manifest_line(ml);
+    }
+    clean_file_buf(info);
+    free(sorted);
+    return verified;
+}
+
+/**
+ * Moves files extracted under staging to the same paths
+ * relative to the current directory. They are renamed over the
+ * old ones, never written into them, as the server's snapshots
+ * share the old files' inodes.
+ */
+void install_archive_files(archive_file_t *files, char *staging){
+    archive_file_t *file;
+    for (file = files; file; file = file->next){
+        char *src;
+        asprintf(&src, "%s/%s", staging, file->fname);
+        mkpath(file->fname);
+        if (rename(src, file->fname) == -1)
+            move_file(src, file->fname);
+        free(src);
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "helpers.h"
+#include "index.h"
+#include "sparse.h"
+
+#define TAR_BLOCK_SIZE 512
+
+// file data waiting to be written is held in memory up to this size;
+// larger files are streamed to disk by the thread reading the archive
+#define ARCHIVE_QUEUE_BYTES (64 * 1024 * 1024)
+#define ARCHIVE_MAX_WORKERS 16
+
+// files at least this large get their blocks allocated up front
+#define ARCHIVE_FALLOCATE_MIN (256 * 1024)
+
+#define ARCHIVE_DIR_BUCKETS 4096
+
+/**
+ * A regular file written by extract_archive, with the digest of
+ * its contents computed while it was written.
+ */
+typedef struct archive_file_t {
+    char *fname;
+    char hexdigest[HEXDIGEST_MAX+1];
+
+    // taken from the open file once written; st_ino is 0 if it couldn't be
+    struct stat st;
+
+    struct archive_file_t *next;
+} archive_file_t;
+
+/**
+ * Directories extract_archive made (or found) this run, so each
+ * one costs a single mkdir no matter how many files it holds.
+ */
+typedef struct archive_dir_t {
+    char *path;
+    struct archive_dir_t *next;
+} archive_dir_t;
+
+/**
+ * A file read whole from the archive, waiting for a worker to write it.
+ */
+typedef struct extract_job_t {
+    char *out;
+    unsigned char *data;
+    long size;
+    int mode;
+    long mtime;
+    archive_file_t *file;
+
+    struct extract_job_t *next;
+} extract_job_t;
+
+/**
+ * Workers writing and hashing files while the calling thread keeps
+ * inflating the archive. Workers are started as jobs queue up faster
+ * than the idle ones take them.
+ */
+typedef struct extract_pool_t {
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    pthread_cond_t has_room;
+
+    extract_job_t *head;
+    extract_job_t *tail;
+    int queued;
+    long queued_bytes;
+    int idle;
+    int done;
+
+    pthread_t workers[ARCHIVE_MAX_WORKERS];
+    int num_workers;
+    int max_workers;
+    int algo;
+} extract_pool_t;
+
+int extract_archive(char *archive, char *dest, int algo, archive_file_t **files);
+void clean_archive_files(archive_file_t *files);
+int verify_archive_files(archive_file_t *files, char *listing, int skip_header, stat_index_t *index,
+                         sparse_t *sparse);
+void install_archive_files(archive_file_t *files, char *staging);
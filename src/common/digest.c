@@ -0,0 +1,369 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "digest.h"
+#include "hashpool.h"
+
+static char *hash_names[NUM_HASHES] = {"md5", "blake2s", "xxh64"};
+static int hash_lengths[NUM_HASHES] = {32, 64, 16};
+
+/**********************************************************************************
+                                      XXH64
+***********************************************************************************/
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh_rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t xxh_read32(unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input){
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val){
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_reset(xxh64_state_t *state){
+    memset(state, 0, sizeof(xxh64_state_t));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+}
+
+static void xxh64_stripe(xxh64_state_t *state, unsigned char *p){
+    int i;
+    for (i = 0; i < 4; i++)
+        state->v[i] = xxh64_round(state->v[i], xxh_read64(p + 8 * i));
+}
+
+static void xxh64_update(xxh64_state_t *state, unsigned char *p, size_t len){
+    state->total_len += len;
+
+    // top up a partial stripe left by the last update
+    if (state->memsize + len < 32){
+        memcpy(state->mem + state->memsize, p, len);
+        state->memsize += len;
+        return;
+    }
+    if (state->memsize){
+        int fill = 32 - state->memsize;
+        memcpy(state->mem + state->memsize, p, fill);
+        xxh64_stripe(state, state->mem);
+        p += fill;
+        len -= fill;
+        state->memsize = 0;
+    }
+
+    while (len >= 32){
+        xxh64_stripe(state, p);
+        p += 32;
+        len -= 32;
+    }
+    memcpy(state->mem, p, len);
+    state->memsize = len;
+}
+
+static uint64_t xxh64_digest(xxh64_state_t *state){
+    uint64_t h;
+    if (state->total_len >= 32){
+        h = xxh_rotl64(state->v[0], 1) + xxh_rotl64(state->v[1], 7) +
+            xxh_rotl64(state->v[2], 12) + xxh_rotl64(state->v[3], 18);
+        int i;
+        for (i = 0; i < 4; i++)
+            h = xxh64_merge_round(h, state->v[i]);
+    } else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+    h += state->total_len;
+
+    // consume the remaining bytes
+    unsigned char *p = state->mem;
+    int len = state->memsize;
+    while (len >= 8){
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4){
+        h ^= (uint64_t) xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0){
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+        len--;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**********************************************************************************
+                                  HASH SELECTION
+***********************************************************************************/
+
+/**
+ * Returns the hash with the given name, or -1 if there is none.
+ */
+int parse_hash_algo(char *name){
+    int i;
+    for (i = 0; i < NUM_HASHES; i++)
+        if (!strcmp(name, hash_names[i]))
+            return i;
+    return -1;
+}
+
+char *hash_algo_name(int algo){
+    return hash_names[algo];
+}
+
+/**
+ * Number of hex characters in a digest.
+ */
+int hash_hex_length(int algo){
+    return hash_lengths[algo];
+}
+
+/**
+ * Returns the content hash named in a manifest's header line.
+ */
+int get_manifest_hash(char *manifest){
+    file_buf_t *info = init_file_buf(manifest);
+    read_file_until(info, '\n');
+
+    // header is "<version> <project> [<hash>]"
+    int algo = HASH_MD5;
+    if (info->file_eof){
+        clean_file_buf(info);
+        return algo;
+    }
+    char *name = strchr(info->data, ' ');
+    if (name)
+        name = strchr(name + 1, ' ');
+    if (name && parse_hash_algo(name + 1) != -1)
+        algo = parse_hash_algo(name + 1);
+
+    clean_file_buf(info);
+    return algo;
+}
+
+/**
+ * Returns a manifest header line (without newline). md5 projects
+ * keep the original two-field header.
+ *
+ * The returned pointer must be freed.
+ */
+char *generate_manifest_header(int version, char *project, int algo){
+    char *header;
+    if (algo == HASH_MD5)
+        asprintf(&header, "%d %s", version, project);
+    else
+        asprintf(&header, "%d %s %s", version, project, hash_names[algo]);
+    return header;
+}
+
+/**********************************************************************************
+                                     DIGESTS
+***********************************************************************************/
+
+void digest_init(digest_ctx_t *ctx, int algo){
+    ctx->algo = algo;
+    if (algo == HASH_MD5){
+        MD5_Init(&ctx->md5);
+    } else if (algo == HASH_BLAKE2S){
+        ctx->evp = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx->evp, EVP_blake2s256(), NULL);
+    } else {
+        xxh64_reset(&ctx->xxh64);
+    }
+}
+
+void digest_update(digest_ctx_t *ctx, void *data, size_t len){
+    if (ctx->algo == HASH_MD5)
+        MD5_Update(&ctx->md5, data, len);
+    else if (ctx->algo == HASH_BLAKE2S)
+        EVP_DigestUpdate(ctx->evp, data, len);
+    else
+        xxh64_update(&ctx->xxh64, data, len);
+}
+
+/**
+ * Writes the uppercase hex digest (hash_hex_length + 1 bytes).
+ */
+void digest_final(digest_ctx_t *ctx, char *hexstring){
+    if (ctx->algo == HASH_MD5){
+        unsigned char out[MD5_DIGEST_LENGTH];
+        MD5_Final(out, &ctx->md5);
+        hexlify(out, MD5_DIGEST_LENGTH, hexstring);
+    } else if (ctx->algo == HASH_BLAKE2S){
+        unsigned char out[EVP_MAX_MD_SIZE];
+        unsigned int len;
+        EVP_DigestFinal_ex(ctx->evp, out, &len);
+        EVP_MD_CTX_free(ctx->evp);
+        hexlify(out, len, hexstring);
+    } else {
+        // canonical (big endian) form
+        uint64_t h = xxh64_digest(&ctx->xxh64);
+        unsigned char out[8];
+        int i;
+        for (i = 0; i < 8; i++)
+            out[i] = h >> (56 - 8 * i);
+        hexlify(out, 8, hexstring);
+    }
+}
+
+/**
+ * Hashes a file through buf. A missing file hashes like an empty one.
+ */
+void digest_file(int algo, char *fname, unsigned char *buf, int buf_size, char *hexstring){
+    digest_ctx_t ctx;
+    digest_init(&ctx, algo);
+
+    int fd = open(fname, O_RDONLY);
+    if (fd != -1){
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ssize_t bytes;
+        while ((bytes = read(fd, buf, buf_size)) > 0)
+            digest_update(&ctx, buf, bytes);
+        close(fd);
+    }
+    digest_final(&ctx, hexstring);
+}
+
+/**********************************************************************************
+                                  CONVERSION
+***********************************************************************************/
+
+/**
+ * Rewrites a manifest to use another content hash, with the given
+ * project version in its header.
+ *
+ * If verify is set, a file is only re-hashed if it still matches its
+ * old digest; otherwise its old digest is kept, which can never match
+ * a new one, so a locally modified file still shows up as modified.
+ */
+void convert_manifest_hash(char *manifest, int algo, int version, int verify){
+    int old_algo = get_manifest_hash(manifest);
+    file_buf_t *info = init_file_buf(manifest);
+
+    // header: "<version> <project> [<hash>]"
+    read_file_until(info, ' ');
+    read_file_until(info, '\n');
+    char *project = strdup(info->data);
+    char *space = strchr(project, ' ');
+    if (space)
+        *space = '\0';
+
+    int count = 0;
+    int max_count = 64;
+    manifest_line_t **lines = malloc(max_count * sizeof(manifest_line_t *));
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        if (count >= max_count){
+            max_count *= 2;
+            lines = realloc(lines, max_count * sizeof(manifest_line_t *));
+        }
+        lines[count++] = parse_manifest_line(info->data);
+    }
+    clean_file_buf(info);
+
+    hash_job_t *jobs = calloc(count + 1, sizeof(hash_job_t));
+    long *sizes = calloc(count + 1, sizeof(long));
+    int i;
+    for (i = 0; i < count; i++){
+        struct stat st = {0};
+        stat(lines[i]->fname, &st);
+        sizes[i] = st.st_size;
+        jobs[i].fname = lines[i]->fname;
+        jobs[i].size = sizes[i];
+    }
+
+    // find the files that are unchanged since they were hashed
+    int *unchanged = calloc(count + 1, sizeof(int));
+    if (verify){
+        hash_files(jobs, count, old_algo);
+        for (i = 0; i < count; i++)
+            unchanged[i] = !strcmp(jobs[i].hexdigest, lines[i]->hexdigest);
+    } else {
+        for (i = 0; i < count; i++)
+            unchanged[i] = 1;
+    }
+
+    // hash them again with the new algorithm
+    int num_jobs = 0;
+    for (i = 0; i < count; i++)
+        if (unchanged[i]){
+            jobs[num_jobs].fname = lines[i]->fname;
+            jobs[num_jobs].size = sizes[i];
+            num_jobs++;
+        }
+    hash_files(jobs, num_jobs, algo);
+
+    char tempfile[15+1];
+    gen_temp_filename(tempfile);
+    int fout = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *header = generate_manifest_header(version, project, algo);
+    write_line(fout, header);
+    free(header);
+
+    int job = 0;
+    for (i = 0; i < count; i++){
+        manifest_line_t *ml = lines[i];
+        char *hexdigest = unchanged[i] ? jobs[job++].hexdigest : ml->hexdigest;
+        char *line = generate_manifest_line(ml->code, hexdigest, ml->version, ml->fname);
+        write(fout, line, strlen(line));
+        free(line);
+        clean_manifest_line(ml);
+    }
+    close(fout);
+
+    // replaced rather than rewritten, it may be linked into a snapshot
+    move_file(tempfile, manifest);
+
+    free(unchanged);
+    free(sizes);
+    free(jobs);
+    free(lines);
+    free(project);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+
+#include "helpers.h"
+
+// ======================================
+// Content hashes
+// ======================================
+// A project's content hash is named after its name in the .Manifest
+// header ("<version> <project> <hash>"). Projects without one use md5.
+
+#define HASH_MD5     0
+#define HASH_BLAKE2S 1
+#define HASH_XXH64   2
+#define NUM_HASHES   3
+
+typedef struct xxh64_state_t {
+    uint64_t total_len;
+    uint64_t v[4];
+    unsigned char mem[32];
+    int memsize;
+} xxh64_state_t;
+
+typedef struct digest_ctx_t {
+    int algo;
+    MD5_CTX md5;
+    EVP_MD_CTX *evp;
+    xxh64_state_t xxh64;
+} digest_ctx_t;
+
+int parse_hash_algo(char *name);
+char *hash_algo_name(int algo);
+int hash_hex_length(int algo);
+int get_manifest_hash(char *manifest);
+char *generate_manifest_header(int version, char *project, int algo);
+
+void digest_init(digest_ctx_t *ctx, int algo);
+void digest_update(digest_ctx_t *ctx, void *data, size_t len);
+void digest_final(digest_ctx_t *ctx, char *hexstring);
+void digest_file(int algo, char *fname, unsigned char *buf, int buf_size, char *hexstring);
+void convert_manifest_hash(char *manifest, int algo, int version, int verify);
@@ -0,0 +1,279 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "hashpool.h"
+#include "digest.h"
+#include "md5_mb.h"
+
+/**
+ * Asks the kernel to start reading a file we will hash soon, so the
+ * device has more than one request in flight per worker.
+ */
+static void readahead_file(char *fname){
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/**
+ * Takes the next unit from the worker's own range.
+ * Returns -1 if the range is empty.
+ */
+static int take_own_job(hash_worker_t *worker){
+    int job = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->lo < worker->hi)
+        job = worker->lo++;
+    pthread_mutex_unlock(&worker->lock);
+    return job;
+}
+
+/**
+ * Moves the back half of the fullest other range to this worker.
+ * Returns whether anything was stolen.
+ */
+static int steal_jobs(hash_worker_t *thief){
+    hash_pool_t *pool = thief->pool;
+    int self = thief - pool->workers;
+
+    // pick the victim with the most work left
+    hash_worker_t *victim = NULL;
+    int most = 0;
+    int i;
+    for (i = 1; i < pool->num_workers; i++){
+        hash_worker_t *worker = &pool->workers[(self + i) % pool->num_workers];
+        pthread_mutex_lock(&worker->lock);
+        int left = worker->hi - worker->lo;
+        pthread_mutex_unlock(&worker->lock);
+        if (left > most){
+            most = left;
+            victim = worker;
+        }
+    }
+    if (!victim)
+        return 0;
+
+    int lo = 0;
+    int hi = 0;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->hi > victim->lo){
+        int mid = victim->lo + (victim->hi - victim->lo) / 2;
+        lo = mid;
+        hi = victim->hi;
+        victim->hi = mid;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    // the victim finished the range before we got to it; look again
+    if (lo == hi)
+        return 1;
+
+    pthread_mutex_lock(&thief->lock);
+    thief->lo = lo;
+    thief->hi = hi;
+    pthread_mutex_unlock(&thief->lock);
+    return 1;
+}
+
+/**
+ * Reads up to MD5_MB_LANES small files whole and hashes them in
+ * SIMD lanes. A file that grew past the small size since it was
+ * stat'd is hashed on its own instead.
+ */
+static void hash_batched_unit(hash_worker_t *worker, hash_unit_t *unit){
+    hash_pool_t *pool = worker->pool;
+    unsigned char *data[MD5_MB_LANES];
+    size_t lens[MD5_MB_LANES];
+    char (*hexdigests[MD5_MB_LANES])[HEXDIGEST_MAX+1];
+    int lanes = 0;
+
+    int i;
+    for (i = 0; i < unit->count; i++){
+        hash_job_t *job = &pool->jobs[pool->order[unit->first + i]];
+        unsigned char *buf = worker->buf + i * (MD5_MB_MAX_SIZE + 1);
+
+        // a missing file hashes like an empty one
+        size_t len = 0;
+        int fd = open(job->fname, O_RDONLY);
+        if (fd != -1){
+            ssize_t bytes;
+            while (len <= MD5_MB_MAX_SIZE &&
+                   (bytes = read(fd, buf + len, MD5_MB_MAX_SIZE + 1 - len)) > 0)
+                len += bytes;
+            close(fd);
+        }
+
+        if (len > MD5_MB_MAX_SIZE){
+            digest_file(pool->algo, job->fname, buf, MD5_MB_MAX_SIZE, job->hexdigest);
+            continue;
+        }
+        data[lanes] = buf;
+        lens[lanes] = len;
+        hexdigests[lanes] = &job->hexdigest;
+        lanes++;
+    }
+
+    char out[MD5_MB_LANES][HEXDIGEST_MAX+1];
+    md5_mb(data, lens, lanes, out);
+    for (i = 0; i < lanes; i++)
+        strcpy(*hexdigests[i], out[i]);
+}
+
+static void *hash_worker(void *arg){
+    hash_worker_t *worker = arg;
+    hash_pool_t *pool = worker->pool;
+
+    while (1){
+        int u = take_own_job(worker);
+        if (u == -1){
+            if (!steal_jobs(worker))
+                break;
+            continue;
+        }
+
+        hash_unit_t *unit = &pool->units[u];
+        if (unit->batched){
+            hash_batched_unit(worker, unit);
+            continue;
+        }
+
+        // hint the next file in our range before reading this one
+        pthread_mutex_lock(&worker->lock);
+        int next = worker->lo < worker->hi ? worker->lo : -1;
+        pthread_mutex_unlock(&worker->lock);
+        if (next != -1 && !pool->units[next].batched)
+            readahead_file(pool->jobs[pool->order[pool->units[next].first]].fname);
+
+        hash_job_t *job = &pool->jobs[pool->order[unit->first]];
+        digest_file(pool->algo, job->fname, worker->buf, HASH_READ_SIZE, job->hexdigest);
+    }
+    return NULL;
+}
+
+/**
+ * Orders job indices by file size.
+ */
+static int compare_job_sizes(const void *a, const void *b, void *jobs){
+    long sa = ((hash_job_t *) jobs)[*(int *) a].size;
+    long sb = ((hash_job_t *) jobs)[*(int *) b].size;
+    return (sa > sb) - (sa < sb);
+}
+
+/**
+ * Splits a batch into units. With md5, small files are grouped
+ * MD5_MB_LANES at a time, smallest first, so the files sharing
+ * a SIMD pass have about the same number of blocks.
+ */
+static void plan_hash_units(hash_pool_t *pool, int count){
+    pool->order = malloc(count * sizeof(int));
+    pool->units = malloc(count * sizeof(hash_unit_t));
+    pool->num_units = 0;
+
+    int i;
+    for (i = 0; i < count; i++)
+        pool->order[i] = i;
+
+    int num_small = 0;
+    if (pool->algo == HASH_MD5){
+        // small files to the front
+        int j = 0;
+        for (i = 0; i < count; i++){
+            if (pool->jobs[pool->order[i]].size <= MD5_MB_MAX_SIZE){
+                int tmp = pool->order[j];
+                pool->order[j++] = pool->order[i];
+                pool->order[i] = tmp;
+            }
+        }
+        num_small = j;
+        qsort_r(pool->order, num_small, sizeof(int), compare_job_sizes, pool->jobs);
+    }
+
+    for (i = 0; i < num_small; i += MD5_MB_LANES){
+        hash_unit_t *unit = &pool->units[pool->num_units++];
+        unit->first = i;
+        unit->count = num_small - i < MD5_MB_LANES ? num_small - i : MD5_MB_LANES;
+        unit->batched = 1;
+    }
+    for (i = num_small; i < count; i++){
+        hash_unit_t *unit = &pool->units[pool->num_units++];
+        unit->first = i;
+        unit->count = 1;
+        unit->batched = 0;
+    }
+}
+
+/**
+ * Number of workers for a batch: one per online core, at most one per
+ * unit, and none at all for batches too small to be worth the threads.
+ */
+static int hash_pool_size(hash_pool_t *pool, int count){
+    long total = 0;
+    int i;
+    for (i = 0; i < count; i++)
+        total += pool->jobs[i].size;
+    if (total < HASH_PARALLEL_MIN_BYTES)
+        return 1;
+
+    long cores = online_cores();
+    int workers = cores < 1 ? 1 : cores;
+    if (workers > HASH_MAX_WORKERS)
+        workers = HASH_MAX_WORKERS;
+    if (workers > pool->num_units)
+        workers = pool->num_units;
+    return workers;
+}
+
+/**
+ * Fills in the hexdigest of every job using the given content hash.
+ * Digests are computed in parallel but each lands in its own job, so
+ * callers read them back in the order they were submitted. Fill in each job's size (st_size) first
+ * so small batches can skip starting threads.
+ */
+void hash_files(hash_job_t *jobs, int count, int algo){
+    if (count <= 0)
+        return;
+
+    hash_pool_t pool;
+    pool.jobs = jobs;
+    pool.algo = algo;
+    plan_hash_units(&pool, count);
+    pool.num_workers = hash_pool_size(&pool, count);
+    pool.workers = calloc(pool.num_workers, sizeof(hash_worker_t));
+
+    // split the units into one contiguous range per worker
+    int units = pool.num_units;
+    int i;
+    for (i = 0; i < pool.num_workers; i++){
+        hash_worker_t *worker = &pool.workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->lo = (long) units * i / pool.num_workers;
+        worker->hi = (long) units * (i + 1) / pool.num_workers;
+        worker->pool = &pool;
+        posix_memalign((void **) &worker->buf, HASH_BUF_ALIGN, HASH_READ_SIZE);
+    }
+
+    // the calling thread is worker 0
+    for (i = 1; i < pool.num_workers; i++)
+        pthread_create(&pool.workers[i].thread, NULL, hash_worker, &pool.workers[i]);
+    hash_worker(&pool.workers[0]);
+    for (i = 1; i < pool.num_workers; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    for (i = 0; i < pool.num_workers; i++){
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        free(pool.workers[i].buf);
+    }
+    free(pool.workers);
+    free(pool.units);
+    free(pool.order);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "helpers.h"
+
+// files are read in blocks of this size into aligned buffers
+#define HASH_READ_SIZE (1024 * 1024)
+#define HASH_BUF_ALIGN 4096
+
+// batches smaller than this (in bytes) are hashed on the calling thread
+#define HASH_PARALLEL_MIN_BYTES (4 * 1024 * 1024)
+#define HASH_MAX_WORKERS 64
+
+/**
+ * One file to hash. hexdigest is filled in by hash_files.
+ */
+typedef struct hash_job_t {
+    char *fname;
+    long size;
+    char hexdigest[HEXDIGEST_MAX+1];
+} hash_job_t;
+
+/**
+ * A worker owns the range [lo, hi) of the batch's units. It takes
+ * units from the front of its own range and, once that is empty,
+ * steals the back half of another worker's range.
+ */
+typedef struct hash_worker_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int lo;
+    int hi;
+
+    unsigned char *buf;
+    struct hash_pool_t *pool;
+} hash_worker_t;
+
+/**
+ * Unit of work: one large file, or up to MD5_MB_LANES small
+ * files hashed together (jobs order[first] .. order[first+count-1]).
+ */
+typedef struct hash_unit_t {
+    int first;
+    int count;
+    int batched;
+} hash_unit_t;
+
+typedef struct hash_pool_t {
+    hash_job_t *jobs;
+    int algo;
+
+    int *order;
+    hash_unit_t *units;
+    int num_units;
+
+    hash_worker_t *workers;
+    int num_workers;
+} hash_pool_t;
+
+void hash_files(hash_job_t *jobs, int count, int algo);
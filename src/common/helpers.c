@@ -8,9 +8,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <time.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
 #include <sys/types.h>
@@ -19,8 +21,18 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <libgen.h>
+#include <immintrin.h>
+#include <endian.h>
+#include <stdint.h>
 
 #include "helpers.h"
+#include "merkle.h"
+#include "history.h"
+#include "index.h"
+#include "hashpool.h"
+#include "digest.h"
+#include "archive.h"
+#include "sparse.h"
 
 /**********************************************************************************
                                   GENERAL HELPERS
@@ -30,37 +42,74 @@
 // ------------------------------------
 //        SEND / RECV / ACK
 // ------------------------------------
+// A client just exits when the server goes away. A server thread
+// mustn't take every other connection down with it, so the server
+// turns that off: a peer that goes away or breaks the protocol marks
+// the thread's connection lost, and from then on every send and recv
+// on it returns at once with nothing (0, "" or an empty file). The
+// command runs out without applying anything, and the server drops
+// the connection after it.
+
+static int lost_connection_exits = 1;
+static __thread int lost_connection = 0;
+
+/**
+ * Whether losing the connection ends the process, as for a client.
+ */
+void set_lost_connection_exits(int exits){
+    lost_connection_exits = exits;
+}
+
+/**
+ * Whether this thread's connection was lost.
+ */
+int connection_lost(){
+    return lost_connection;
+}
+
+static void lose_connection(int sock, char *why){
+    if (!lost_connection)
+        puts(why);
+    if (lost_connection_exits){
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+    lost_connection = 1;
+}
 
 /**
  * Acknowledge receipt of packet.
  */
 void ack(int sock){
-    write(sock, "ACK", 4);
+    if (!lost_connection)
+        write(sock, "ACK", 4);
 }
 
 /**
  * Acknowledge receipt of packet after reading socket.
+ * The buffer is left as it is if the connection is gone.
  */
 void recv_ack(int sock, void *buf, int num_bytes, int flags){
-    recv(sock, buf, num_bytes, flags);
+    if (lost_connection)
+        return;
+    if (recv(sock, buf, num_bytes, flags) <= 0){
+        // a client only notices once it waits for more
+        lost_connection = !lost_connection_exits;
+        return;
+    }
     ack(sock);
 }
 
 /**
  * Wait for ACK.
- * Quit if none is received.
+ * Quit (or mark the connection lost) if none is received.
  */
 void wait_for_ack(int sock){
-    char buf[4];
-    recv(sock, buf, 4, MSG_WAITALL);
-    if (strcmp(buf, "ACK")){
-        puts("Failed to receive ACK after writing data");
-        printf("Here is the received data:\n");
-        int i;
-        for (i = 0; i < 4; i++) printf("%02X ", buf[i]);
-        close(sock);
-        exit(EXIT_FAILURE);
-    }
+    if (lost_connection)
+        return;
+    char buf[4] = {0};
+    if (recv(sock, buf, 4, MSG_WAITALL) != 4 || memcmp(buf, "ACK", 4))
+        lose_connection(sock, "Failed to receive ACK after writing data");
 }
 
 /**
@@ -95,7 +144,13 @@ char *recv_line(int sock){
     int data_size = 0;
 
     while (1){
-        int bytes_read = recv(sock, temp, CHUNK_SIZE, 0);
+        int bytes_read = lost_connection ? 0 : recv(sock, temp, CHUNK_SIZE, 0);
+        if (bytes_read <= 0){
+            lose_connection(sock, "Connection lost while receiving a line");
+            free(temp);
+            line[0] = '\0';
+            return line;
+        }
 
         // ensure that data buffer has enough space
         if (data_size + bytes_read >= line_buf_size){
@@ -126,11 +181,25 @@ char *recv_line(int sock){
     }
 }
 
+/**
+ * Receive the next command on a connection that may be reused
+ * for several. Returns NULL once the peer has hung up.
+ *
+ * The returned pointer must be freed.
+ */
+char *recv_command(int sock){
+    char c;
+    if (lost_connection || recv(sock, &c, 1, MSG_PEEK) <= 0)
+        return NULL;
+    return recv_line(sock);
+}
+
 /**
  * Receive an integer from socket.
  */
 int recv_int(int sock){
-    int number;
+    // stays 0 if the connection is gone
+    int number = 0;
     recv_ack(sock, &number, sizeof(number), MSG_WAITALL);
     return ntohl(number);
 }
@@ -143,6 +212,46 @@ void send_int(int sock, int num){
     send_ack(sock, &num_to_send, sizeof(num_to_send));
 }
 
+/**
+ * Receive a 64-bit integer (file sizes and offsets) from socket.
+ */
+long recv_long(int sock){
+    uint64_t number = 0;
+    recv_ack(sock, &number, sizeof(number), MSG_WAITALL);
+    return be64toh(number);
+}
+
+/**
+ * Send a 64-bit integer to socket.
+ */
+void send_long(int sock, long num){
+    uint64_t num_to_send = htobe64(num);
+    send_ack(sock, &num_to_send, sizeof(num_to_send));
+}
+
+/**
+ * Send a length-prefixed chunk of a stream.
+ * A zero-length chunk ends the stream.
+ */
+void send_chunk(int sock, char *data, int len){
+    send_int(sock, len);
+    if (len > 0)
+        send_ack(sock, data, len);
+}
+
+/**
+ * Receive a chunk of a stream into a new buffer and return its length.
+ * The buffer must be freed if the length is non-zero.
+ */
+int recv_chunk(int sock, char **data){
+    int len = recv_int(sock);
+    if (len > 0){
+        *data = malloc(len);
+        recv_ack(sock, *data, len, MSG_WAITALL);
+    }
+    return len;
+}
+
 // ------------------------------------
 //               FILES
 // ------------------------------------
@@ -152,6 +261,10 @@ void write_line(int fd, char *line){
     write(fd, "\n", 1);
 }
 
+/**
+ * Replaces dst with src. On the server this is how project files
+ * change: snapshots hard link them, so they are never rewritten.
+ */
 void move_file(char *src, char *dst){
     char *mv_cmd;
     asprintf(&mv_cmd, "mv %s %s", src, dst);
@@ -265,8 +378,8 @@ void read_file_until(file_buf_t *info, char delim){
     while (1){
         int bytes_read = read(info->fd, temp, CHUNK_SIZE);
 
-        // check if nothing left to read
-        if (bytes_read == 0){
+        // check if nothing left to read (or the file couldn't be read)
+        if (bytes_read <= 0){
             info->file_eof = 1;
             free(temp);
             return;
@@ -304,6 +417,46 @@ void read_file_until(file_buf_t *info, char delim){
     }
 }
 
+/**
+ * Records which version of a file a cached parse of it was made from.
+ * The clock is read first, so any later write gets a newer mtime.
+ * Returns whether the file exists.
+ */
+int get_file_version(char *fname, file_version_t *version){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    version->cached_sec = now.tv_sec;
+    version->cached_nsec = now.tv_nsec;
+
+    struct stat st = {0};
+    if (stat(fname, &st) == -1)
+        return 0;
+    version->ino = st.st_ino;
+    version->size = st.st_size;
+    version->mtime_sec = st.st_mtim.tv_sec;
+    version->mtime_nsec = st.st_mtim.tv_nsec;
+    return 1;
+}
+
+/**
+ * Whether a file is still the version a cache was made from.
+ *
+ * Timestamps come from the same coarse clock, so a file written in
+ * the tick the cache was made could change again without its mtime
+ * moving; such a cache is never trusted.
+ */
+int file_version_current(char *fname, file_version_t *version){
+    if (version->mtime_sec > version->cached_sec ||
+            (version->mtime_sec == version->cached_sec && version->mtime_nsec >= version->cached_nsec))
+        return 0;
+
+    struct stat st = {0};
+    if (stat(fname, &st) == -1)
+        return 0;
+    return st.st_ino == version->ino && st.st_size == version->size &&
+           st.st_mtim.tv_sec == version->mtime_sec && st.st_mtim.tv_nsec == version->mtime_nsec;
+}
+
 /**
  * Recursively make directories for a file path.
  * https://stackoverflow.com/a/9210960/5183816
@@ -338,6 +491,10 @@ void send_file(char *filename, int sock, int send_filename){
     int exists = stat(filename, &st) != -1;
     send_int(sock, st.st_size);
 
+    // hash the bytes as they are sent so the receiver can check them
+    digest_ctx_t ctx;
+    digest_init(&ctx, HASH_XXH64);
+
     if(exists){
 
         // send file data
@@ -348,11 +505,16 @@ void send_file(char *filename, int sock, int send_filename){
             int bytes_read = 0;
             char *data = read_file_chunk(fd, &bytes_read, &eof);
             write(sock, data, bytes_read);
+            digest_update(&ctx, data, bytes_read);
             free(data);
         }
         close(fd);
     }
 
+    char checksum[HEXDIGEST_MAX+1];
+    digest_final(&ctx, checksum);
+    send_line(sock, checksum);
+
     // wait for ACK
     wait_for_ack(sock);
 }
@@ -362,8 +524,11 @@ void send_file(char *filename, int sock, int send_filename){
  * If the receiver indicated a destination filename,
  * that filename is used. Otherwise, the server must
  * provide a location to write it to.
+ *
+ * The bytes are hashed as they arrive and checked against the
+ * sender's checksum. Returns whether they matched.
  */
-void recv_file(int sock, char *dest){
+int recv_file(int sock, char *dest){
 
     int local_fd;
     char *fname;
@@ -392,67 +557,56 @@ void recv_file(int sock, char *dest){
     // receive file size
     int file_size = recv_int(sock);
 
-    // receive file bytes, then ACK the file received
+    // receive file bytes, never reading past them into the checksum
+    digest_ctx_t ctx;
+    digest_init(&ctx, HASH_XXH64);
     char *data = malloc(CHUNK_SIZE);
     while (file_size > 0){
-        int bytes_read = recv(sock, data, CHUNK_SIZE, 0);
+        int bytes_read = recv(sock, data, file_size < CHUNK_SIZE ? file_size : CHUNK_SIZE, 0);
+        if (bytes_read <= 0){
+            lose_connection(sock, "Connection lost while receiving file");
+            ftruncate(local_fd, 0);
+            free(data);
+            close(local_fd);
+            return 0;
+        }
         file_size -= bytes_read;
         write(local_fd, data, bytes_read);
+        digest_update(&ctx, data, bytes_read);
     }
+
+    // check the sender's checksum, then ACK the file received
+    char hexstring[HEXDIGEST_MAX+1];
+    digest_final(&ctx, hexstring);
+    char *checksum = recv_line(sock);
+    int verified = !lost_connection && !strcmp(checksum, hexstring);
+    if (!verified && !lost_connection)
+        puts("Received file doesn't match the sender's checksum");
+    free(checksum);
     ack(sock);
 
     // cleanup
     free(data);
     close(local_fd);
+    return verified;
 }
 
 /**
- * Sends directory over socket to client.
- * Makes use of system tar command with
- * gzip compression.
+ * Makes a .tar.gz of a whole directory under root with the system
+ * tar command. Returns the name of the tar file. Should be freed
+ * after use.
  */
-void send_directory(int sock, char *dirname){
-
-    // create a tar file for given directory
+char *generate_directory_tar(char *root, char *dirname){
     char tempfile[15+1];
     gen_temp_filename(tempfile);
+    char *tar_name;
+    asprintf(&tar_name, "%s.tar.gz", tempfile);
+
     char *create_tar_cmd;
-    asprintf(&create_tar_cmd, "tar -czf %s.tar.gz ./%s", tempfile, dirname);
+    asprintf(&create_tar_cmd, "tar -czf %s -C %s ./%s", tar_name, root, dirname);
     system(create_tar_cmd);
-
-    // send tar file to client
-    char *dir_tar_name;
-    asprintf(&dir_tar_name, "%s.tar.gz", tempfile);
-    send_file(dir_tar_name, sock, 0);
-
-    // cleanup
-    remove(dir_tar_name);
     free(create_tar_cmd);
-    free(dir_tar_name);
-}
-
-/**
- * Receive a directory from over the network.
- * Untar and unzip the file received.
- */
-void recv_directory(int sock, char *dirname){
-
-    // recieve the tar file
-    char tempfile[15+1];
-    gen_temp_filename(tempfile);
-    char *dir_tar_name;
-    asprintf(&dir_tar_name, "%s.tar.gz", tempfile);
-    recv_file(sock, dir_tar_name);
-
-    // untar and unzip it here in repository
-    char *untar_cmd;
-    asprintf(&untar_cmd, "tar -xzf %s", dir_tar_name);
-    system(untar_cmd);
-
-    // clean up
-    remove(dir_tar_name);
-    free(untar_cmd);
-    free(dir_tar_name);
+    return tar_name;
 }
 
 /**
@@ -477,9 +631,58 @@ void md5sum(char *filename, char *hexstring){
     MD5_Final(out, &c);
     close(fd);
 
-    // convert bytes to hexstring
+    hexlify(out, MD5_DIGEST_LENGTH, hexstring);
+}
+
+/**
+ * Computes the md5sum of the given buffer.
+ */
+void md5sum_buf(char *data, int len, char *hexstring){
+    unsigned char out[MD5_DIGEST_LENGTH];
+    MD5((unsigned char *) data, len, out);
+    hexlify(out, MD5_DIGEST_LENGTH, hexstring);
+}
+
+/**
+ * Hex encodes 16 bytes at a time: split every byte into its two
+ * nibbles, look both up in one shuffle and interleave them.
+ */
+__attribute__((target("ssse3")))
+static void hexlify_ssse3(unsigned char *bytes, int len, char *hexstring){
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
     int i;
-    for (i = 0; i < 16; i++) sprintf(hexstring+2*i, "%02X", out[i]);
+    for (i = 0; i + 16 <= len; i += 16){
+        __m128i in = _mm_loadu_si128((__m128i *) (bytes + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), low_nibble);
+        __m128i lo = _mm_and_si128(in, low_nibble);
+        hi = _mm_shuffle_epi8(digits, hi);
+        lo = _mm_shuffle_epi8(digits, lo);
+        _mm_storeu_si128((__m128i *) (hexstring + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) (hexstring + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+}
+
+/**
+ * Converts bytes to an uppercase, null-terminated hexstring.
+ */
+void hexlify(unsigned char *bytes, int len, char *hexstring){
+    static const char digits[] = "0123456789ABCDEF";
+    static int has_ssse3 = -1;
+    if (has_ssse3 == -1)
+        has_ssse3 = __builtin_cpu_supports("ssse3");
+
+    int i = 0;
+    if (has_ssse3){
+        hexlify_ssse3(bytes, len, hexstring);
+        i = len / 16 * 16;
+    }
+    for (; i < len; i++){
+        hexstring[2*i] = digits[bytes[i] >> 4];
+        hexstring[2*i+1] = digits[bytes[i] & 0x0f];
+    }
+    hexstring[2*len] = '\0';
 }
 
 /**
@@ -504,6 +707,18 @@ void seed_rand(){
     srand(c);
 }
 
+/**
+ * Number of cores the hashing and extraction workers are sized for.
+ * WTF_CORES stands in for the online count if it is set, so their
+ * threads can be exercised on a smaller machine.
+ */
+long online_cores(){
+    char *forced = getenv("WTF_CORES");
+    if (forced)
+        return atol(forced);
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
 /**
  * Generate random temp file name.
  */
@@ -515,21 +730,6 @@ void gen_temp_filename(char *tempfile){
     }
 }
 
-/**
- * Generate random commit file name.
- * The returned pointer must be freed.
- */
- char* gen_commit_filename(char *project){
-    char *commitfile = malloc(strlen(project) + strlen("/.Commit_") + 10 + 1);
-    sprintf(commitfile, "%s/.Commit_", project);
-    int startIdx = strlen(commitfile);
-    int i;
-    for(i = startIdx; i < startIdx + 10; i++) {
-        sprintf(commitfile + i, "%x", rand() % 16);
-    }
-    return commitfile;
-}
-
 /**********************************************************************************
                                   CLIENT HELPERS
 ***********************************************************************************/
@@ -546,19 +746,23 @@ void assert_project_exists_local(char *project){
 }
 
 /**
- * Before commands that need the server are run, we first
- * check to see if a .configure file exists. If so, read it
- * and attempt to connect to the server.
- *
- * Then, send a command to the server over the socket.
+ * Every message waits for an ACK, so small writes must go out at once
+ * rather than wait for the previous segment's (delayed) TCP ack.
  */
-void init_socket_server(int *sock, char *command){
+void set_nodelay(int sock){
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+/**
+ * Reads the .configure file and resolves the server's address.
+ * Returns an error message, or NULL on success.
+ */
+char *resolve_server(struct sockaddr_in *serv_addr){
 
     // check if file exists
-    if(access(".configure", F_OK) == -1){
-        puts("Missing .configure file! Did you run configure?");
-        exit(EXIT_FAILURE);
-    }
+    if(access(".configure", F_OK) == -1)
+        return "Missing .configure file! Did you run configure?";
 
     // read data from file
     file_buf_t *info = init_file_buf(".configure");
@@ -572,33 +776,60 @@ void init_socket_server(int *sock, char *command){
     int port = atoi(info->data);
     clean_file_buf(info);
 
-    // create socket
-    if ((*sock = socket(AF_INET, SOCK_STREAM, 0)) < 0){
-        puts("Could not create socket");
-        exit(EXIT_FAILURE);
-    }
-
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
+    memset(serv_addr, 0, sizeof(struct sockaddr_in));
+    serv_addr->sin_family = AF_INET;
+    serv_addr->sin_port = htons(port);
 
     // convert hostname/ip to binary form of IP address
-    if(inet_pton(AF_INET, hostname, &serv_addr.sin_addr) <= 0){
+    if(inet_pton(AF_INET, hostname, &serv_addr->sin_addr) <= 0){
         // try resolving hostname
         struct hostent *he;
         if ((he = gethostbyname(hostname)) == NULL) {
-            puts("Could not resolve hostname in .configure file");
             free(hostname);
-            exit(EXIT_FAILURE);
+            return "Could not resolve hostname in .configure file";
         }
-        memcpy(&serv_addr.sin_addr, he->h_addr_list[0], he->h_length);
+        memcpy(&serv_addr->sin_addr, he->h_addr_list[0], he->h_length);
     }
     free(hostname);
+    return NULL;
+}
+
+// connection to the server handed over by the client agent, if any
+int agent_sock = -1;
 
-    // repeatedly try connecting to server
-    while (connect(*sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0){
-        puts("Connection Failed, retrying in 3 seconds...");
-        sleep(3);
+/**
+ * Before commands that need the server are run, we first
+ * check to see if a .configure file exists. If so, read it
+ * and attempt to connect to the server.
+ *
+ * Then, send a command to the server over the socket.
+ */
+void init_socket_server(int *sock, char *command){
+
+    if (agent_sock != -1){
+        // the agent already has a connection open
+        *sock = agent_sock;
+        agent_sock = -1;
+    } else {
+        struct sockaddr_in serv_addr;
+        char *error = resolve_server(&serv_addr);
+        if (error){
+            puts(error);
+            exit(EXIT_FAILURE);
+        }
+
+        // create socket
+        if ((*sock = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+            puts("Could not create socket");
+            exit(EXIT_FAILURE);
+        }
+
+        // repeatedly try connecting to server
+        while (connect(*sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0){
+            puts("Connection Failed, retrying in 3 seconds...");
+            sleep(3);
+        }
+        set_nodelay(*sock);
     }
 
     // send command
@@ -628,6 +859,10 @@ int server_project_exists(int sock, char *project){
  */
 char *set_create_project(int sock, int should_create){
     char *project = recv_line(sock);
+    if (connection_lost()){
+        free(project);
+        return NULL;
+    }
 
     // check if project exists
     struct stat st = {0};
@@ -708,7 +943,7 @@ char *generate_manifest_line(char code, char *hexdigest, int version, char *fnam
 manifest_line_t *parse_manifest_line(char *line){
     manifest_line_t *ml = calloc(1, sizeof(manifest_line_t));
     ml->fname = calloc(1, strlen(line)+1);
-    sscanf(line, "%c %s %d %s", &(ml->code), ml->hexdigest, &(ml->version), ml->fname);
+    sscanf(line, "%c %64s %d %s", &(ml->code), ml->hexdigest, &(ml->version), ml->fname);
     return ml;
 }
 
@@ -745,6 +980,9 @@ void add_to_manifest(char *project, char *filename){
     write_line(fout, info->data);
     int found_file = 0;
 
+    // digests use the project's content hash
+    stat_index_t *index = load_stat_index(project);
+
     // line by line copy
     while (1){
         read_file_until(info, '\n');
@@ -766,24 +1004,28 @@ void add_to_manifest(char *project, char *filename){
             puts("File already exists in client Manifest; doing nothing");
         } else if (ml->code == 'A'){
             puts("File already marked as 'A', just updating hash in Manifest.");
-            md5sum(ml->fname, ml->hexdigest);
+            index_digest(index, ml->fname, ml->hexdigest);
         } else if (ml->code == 'D'){
             puts("File already marked as 'D', changing back to '-'");
             ml->code = '-';
         }
-        write_line(fout, info->data);
+        char *line = generate_manifest_line(ml->code, ml->hexdigest, ml->version, ml->fname);
+        write(fout, line, strlen(line));
+        free(line);
         clean_manifest_line(ml);
     }
     clean_file_buf(info);
 
     // new filenames get appended with a hash and version 0
     if (!found_file){
-        char hexstring[33];
-        md5sum(filename, hexstring);
+        char hexstring[HEXDIGEST_MAX+1];
+        index_digest(index, filename, hexstring);
         char *line = generate_manifest_line('A', hexstring, 0, filename);
         write(fout, line, strlen(line));
         free(line);
     }
+    save_stat_index(index);
+    clean_stat_index(index);
 
     // cleanup
     close(fout);
@@ -857,25 +1099,33 @@ void remove_from_manifest(char *project, char *filename){
 
 /**
  * Generate a commit file from the project's Manifest file.
- * Returns error if server Manifest file has different version.
+ * Only local checks happen here; the server validates the
+ * resulting change set against its own manifest.
  *
  * If a commit file already exists, overwrite it. Commits are
  * a full history of local changes. That haven't been pushed.
  *
  * Returns success
  */
-int generate_commit_file(char *commit, char *client_manifest, char *server_manifest){
+int generate_commit_file(char *project, char *commit, char *client_manifest){
 
     // prepare local manifest for reading
     file_buf_t *info = init_file_buf(client_manifest);
 
+    // cached digests of files whose stat data hasn't changed,
+    // everything else is hashed up front in parallel. files outside
+    // a sparse checkout aren't on disk and can't have changed
+    sparse_t *sparse = load_sparse(project);
+    stat_index_t *index = load_stat_index(project);
+    index_hash_manifest(index, client_manifest, sparse);
+
     // open temp file for writing new manifest
     char tempfile[15+1];
     gen_temp_filename(tempfile);
     int fout = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
     // buffer for hash verification
-    char cur_hexdigest[32+1];
+    char cur_hexdigest[HEXDIGEST_MAX+1];
 
     // skip first line of manifest
     read_file_until(info, '\n');
@@ -884,13 +1134,10 @@ int generate_commit_file(char *commit, char *client_manifest, char *server_manif
     // How to generate a .Commit file
     // ======================================
     // for each line in client's manifest:
-    // 1. verify server line
-    //        - if line has code "A", server shouldn't have the filename
-    //        - if line has code "D", server SHOULD have the filename
-    // 2. if line has code "A" or "D":
+    // 1. if line has code "A" or "D":
     //        - write line to commit
     //        - A should compute a live hash
-    // 3.  else if (cur_hash_on_disk != manifest_hash)
+    // 2. else if (cur_hash_on_disk != manifest_hash)
     //        - write line to commit with "M", new hash, and incr version
 
     while (1){
@@ -898,63 +1145,36 @@ int generate_commit_file(char *commit, char *client_manifest, char *server_manif
         if (info->file_eof)
             break;
         manifest_line_t *ml_local = parse_manifest_line(info->data);
-        char *server_line = search_file_in_manifest(server_manifest, ml_local->fname);
 
         char *commit_line = NULL;
         int autogenerated_commit_line = 0;
-        int pass_server_check = 1;
         if (ml_local->code == 'D'){
             // commit logs a new deletion
             commit_line = info->data;
-
-            // server SHOULD have this file
-            if (!server_line){
-                printf("Server manifest does NOT contains file %s"
-                      "which is locally marked for deletion!\n", ml_local->fname);
-                puts("Client must sync with repository before commiting changes!");
-                pass_server_check = 0;
-            }
         } else if (ml_local->code == 'A'){
             // commit logs a new addition
             commit_line = info->data;
 
             // verification correctness
-            md5sum(ml_local->fname, cur_hexdigest);
-
+            index_digest(index, ml_local->fname, cur_hexdigest);
             if (strcmp(ml_local->hexdigest, cur_hexdigest)){
                 // hash is not up-to-date
                 puts("New file added but Manifest hash is not up-to-date with disk hash.");
                 printf("Please first run 'WTF add <project> %s'\n", ml_local->fname);
-                pass_server_check = 0;
-            } else if (server_line) {
-                // server should NOT have this file
-                printf("Server manifest DOES contain file %s"
-                       "which is locally marked for addition!\n", ml_local->fname);
-                puts("Client must sync with repository before commiting changes!");
-                pass_server_check = 0;
+                close(fout);
+                clean_file_buf(info);
+                clean_manifest_line(ml_local);
+                save_stat_index(index);
+                clean_stat_index(index);
+                clean_sparse(sparse);
+                remove(tempfile);
+                return 0;
             }
-        } else if (ml_local->code == '-'){
+        } else if (ml_local->code == '-' && sparse_match(sparse, ml_local->fname)){
             ml_local->code = 'M';
-            // make sure file exists on server
-            if (!server_line){
-                printf("Server manifest does NOT contains file %s"
-                       "which is locally marked as present!\n", ml_local->fname);
-                puts("Client must sync with repository before commiting changes!");
-                pass_server_check = 0;
-            } else {
-                // if local file has different hexdigest from server,
-                // make sure version is less than server's version
-                manifest_line_t *ml_server = parse_manifest_line(server_line);
-                if (strcmp(ml_server->hexdigest, ml_local->hexdigest) &&
-                            ml_server->version >= ml_local->version){
-                    puts("Client must sync with repository before commiting changes!");
-                    pass_server_check = 0;
-                }
-                clean_manifest_line(ml_server);
-            }
 
            // rehash to see if this needs to be added to commit
-            md5sum(ml_local->fname, cur_hexdigest);
+            index_digest(index, ml_local->fname, cur_hexdigest);
             if (strcmp(ml_local->hexdigest, cur_hexdigest)){
                 // increment version number and change code to 'M'
                 commit_line = generate_manifest_line(
@@ -962,15 +1182,6 @@ int generate_commit_file(char *commit, char *client_manifest, char *server_manif
                 autogenerated_commit_line = 1;
             }
         }
-        free(server_line);
-
-        if (!pass_server_check){
-            close(fout);
-            clean_file_buf(info);
-            clean_manifest_line(ml_local);
-            remove(tempfile);
-            return 0;
-        }
 
         // write results to commit file appropriately
         if (commit_line){
@@ -986,21 +1197,121 @@ int generate_commit_file(char *commit, char *client_manifest, char *server_manif
     }
     close(fout);
     clean_file_buf(info);
+    save_stat_index(index);
+    clean_stat_index(index);
+    clean_sparse(sparse);
     move_file(tempfile, commit);
     return 1;
 }
 
 /**
- * Generates a tar file with files that have code "A" or "M" in the .Commit.
- * Returns the name of the tar file. Should be freed after use.
+ * Validate a client's proposed .Commit against the server's manifest tree
+ * and the sorted paths changed since the client's version.
+ * One result line is written per entry:
+ *     "ok <code> <fname>" or "rejected <code> <fname>: <reason>"
+ *
+ * Returns whether every entry was accepted.
  */
-char *generate_am_tar(char *commitPath) {
+int validate_commit_file(char *commit, merkle_node_t *root, int algo,
+                         char **changed, int num_changed, char *results){
+
+    file_buf_t *info = init_file_buf(commit);
+    int fout = open(results, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int accepted = 1;
+
+    // ======================================
+    // How to validate a .Commit file
+    // ======================================
+    // - "A" lines: server shouldn't have the filename
+    // - "D" lines: server SHOULD have the filename
+    // - "M" lines: server SHOULD have the filename, at the version
+    //              the client modified (one less than the new one)
+    // - "A"/"M" digests must use the project's content hash
+    // - no path may have changed since the client's version; others
+    //   may have, the push is applied on top of them
+
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        merkle_node_t *node = find_merkle_node(root, ml->fname);
+        manifest_line_t *ml_server = (node && !node->is_dir) ? node->ml : NULL;
+
+        char *reason = NULL;
+        if (path_in_list(changed, num_changed, ml->fname)){
+            reason = "changed on server since last update";
+        } else if (ml->code == 'A' && ml_server){
+            reason = "already on server";
+        } else if (ml->code == 'D' && !ml_server){
+            reason = "not on server";
+        } else if (ml->code == 'M'){
+            if (!ml_server)
+                reason = "not on server";
+            else if (ml_server->version != ml->version - 1)
+                reason = "modified on server since last update";
+        } else if (ml->code != 'A' && ml->code != 'D'){
+            reason = "unknown code";
+        }
+        if (!reason && ml->code != 'D' && strlen(ml->hexdigest) != hash_hex_length(algo))
+            reason = "digest is not the project's content hash";
+
+        char *result;
+        if (reason){
+            accepted = 0;
+            asprintf(&result, "rejected %c %s: %s", ml->code, ml->fname, reason);
+        } else {
+            asprintf(&result, "ok %c %s", ml->code, ml->fname);
+        }
+        write_line(fout, result);
+        free(result);
+        clean_manifest_line(ml);
+    }
+    close(fout);
+    clean_file_buf(info);
+    return accepted;
+}
+
+/**
+ * Makes a .tar.gz of the given files under root, or an empty file if
+ * there are none. Names are passed to tar through a list file, so any
+ * number fit. Returns the name of the tar file. Should be freed after use.
+ */
+static char *tar_files(char *root, char **files, int count){
+    char tempfile[15+1];
+    gen_temp_filename(tempfile);
+    char *tar_name;
+    asprintf(&tar_name, "%s.tar.gz", tempfile);
+
+    // only tar if at least 1 file
+    if (count > 0){
+        char list[15+1];
+        gen_temp_filename(list);
+        int fd = open(list, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int i;
+        for (i = 0; i < count; i++)
+            write(fd, files[i], strlen(files[i]) + 1);
+        close(fd);
+
+        char *cmd;
+        asprintf(&cmd, "tar czf %s -C %s --null -T %s", tar_name, root, list);
+        system(cmd);
+        free(cmd);
+        remove(list);
+    }
+    return tar_name;
+}
+
+/**
+ * Generates a tar file with files under root that have code "A" or "M"
+ * in the .Commit. Returns the name of the tar file. Should be freed after use.
+ */
+char *generate_am_tar(char *root, char *commitPath) {
 
     // maintain list of files to tar
     int file_count = 0;
     int max_file_count = 50;
     char **files_to_tar = malloc(max_file_count * sizeof(char *));
-    int cmd_length = 0;
 
     // get list of files to tar from commit file's "A" or "M" codes
     file_buf_t *info = init_file_buf(commitPath);
@@ -1018,38 +1329,60 @@ char *generate_am_tar(char *commitPath) {
                 files_to_tar = realloc(files_to_tar, max_file_count * sizeof(char *));
             }
             files_to_tar[file_count++] = strdup(ml->fname);
-            cmd_length += strlen(ml->fname) + 1; // name and space
         }
         clean_manifest_line(ml);
     }
+    clean_file_buf(info);
 
-    // create tar
-    char tempfile[15+1];
-    gen_temp_filename(tempfile);
-    char *tar_name;
-    asprintf(&tar_name, "%s.tar.gz", tempfile);
+    char *tar_name = tar_files(root, files_to_tar, file_count);
 
-    char *cmd = malloc(strlen("tar czf ") + strlen(tar_name) + cmd_length);
-    sprintf(cmd, "tar czf %s", tar_name);
-    char *cur = cmd + strlen(cmd);
+    // cleanup
     int i;
-    for (i = 0; i < file_count; i++){
-        *cur = ' ';
-        cur += 1;
-        strcpy(cur, files_to_tar[i]);
-        cur += strlen(files_to_tar[i]);
+    for (i = 0; i < file_count; i++)
         free(files_to_tar[i]);
-    }
+    free(files_to_tar);
+    return tar_name;
+}
 
-    // only tar if at least 1 file
-    if (file_count > 0) {
-        system(cmd);
+/**
+ * Generates a tar file with a project's .Manifest and the tracked
+ * files of a sparse checkout, from the project directory under root.
+ * Returns the name of the tar file. Should be freed after use.
+ */
+char *generate_sparse_tar(char *root, char *project, sparse_t *sparse){
+    int file_count = 0;
+    int max_file_count = 50;
+    char **files_to_tar = malloc(max_file_count * sizeof(char *));
+
+    char *manifest;
+    asprintf(&manifest, "%s/%s/.Manifest", root, project);
+    asprintf(&files_to_tar[file_count++], "%s/.Manifest", project);
+
+    file_buf_t *info = init_file_buf(manifest);
+    read_file_until(info, '\n');
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (ml->code != 'D' && sparse_match(sparse, ml->fname)){
+            if (file_count >= max_file_count){
+                max_file_count *= 2;
+                files_to_tar = realloc(files_to_tar, max_file_count * sizeof(char *));
+            }
+            files_to_tar[file_count++] = strdup(ml->fname);
+        }
+        clean_manifest_line(ml);
     }
+    clean_file_buf(info);
 
-    // cleanup
-    free(cmd);
+    char *tar_name = tar_files(root, files_to_tar, file_count);
+
+    int i;
+    for (i = 0; i < file_count; i++)
+        free(files_to_tar[i]);
     free(files_to_tar);
-    clean_file_buf(info);
+    free(manifest);
     return tar_name;
 }
 
@@ -1165,6 +1498,100 @@ void regenerate_manifest_from_commit(char *client_manifest, char *commit){
     move_file(tempfile, client_manifest);
 }
 
+static int compare_paths(const void *a, const void *b){
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+static int compare_line_paths(const void *a, const void *b){
+    return strcmp((*(manifest_line_t **) a)->fname, (*(manifest_line_t **) b)->fname);
+}
+
+/**
+ * Applies a pushed .Commit to the server's .Manifest, writing the
+ * next project version to dest. The commit may have been made against
+ * an older version; it only changes the paths it names.
+ */
+void rebase_manifest(char *manifest, char *commit, char *dest){
+    int count = 0;
+    int max_count = 64;
+    manifest_line_t **changes = malloc(max_count * sizeof(manifest_line_t *));
+    file_buf_t *info = init_file_buf(commit);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        if (count >= max_count){
+            max_count *= 2;
+            changes = realloc(changes, max_count * sizeof(manifest_line_t *));
+        }
+        changes[count++] = parse_manifest_line(info->data);
+    }
+    clean_file_buf(info);
+    qsort(changes, count, sizeof(manifest_line_t *), compare_line_paths);
+
+    int fout = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    info = init_file_buf(manifest);
+
+    // header: "<version> <project> [<hash>]"
+    read_file_until(info, ' ');
+    dprintf(fout, "%d ", atoi(info->data) + 1);
+    read_file_until(info, '\n');
+    write_line(fout, info->data);
+
+    // modified lines get the commit's digest and version, deleted ones
+    // are dropped and the rest is kept as it is
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        manifest_line_t **found = bsearch(&ml, changes, count, sizeof(manifest_line_t *), compare_line_paths);
+        manifest_line_t *line_ml = found ? *found : ml;
+        if (line_ml->code != 'D'){
+            char *line = generate_manifest_line('-', line_ml->hexdigest, line_ml->version, line_ml->fname);
+            write(fout, line, strlen(line));
+            free(line);
+        }
+        clean_manifest_line(ml);
+    }
+    clean_file_buf(info);
+
+    // then the added ones
+    int i;
+    for (i = 0; i < count; i++){
+        if (changes[i]->code == 'A'){
+            char *line = generate_manifest_line('-', changes[i]->hexdigest, changes[i]->version, changes[i]->fname);
+            write(fout, line, strlen(line));
+            free(line);
+        }
+        clean_manifest_line(changes[i]);
+    }
+    close(fout);
+    free(changes);
+}
+
+/**
+ * Rewrites the version in a manifest's header.
+ */
+void set_manifest_version(char *manifest, int version){
+    char tempfile[15+1];
+    gen_temp_filename(tempfile);
+    int fout = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    file_buf_t *info = init_file_buf(manifest);
+    read_file_until(info, ' ');
+    dprintf(fout, "%d ", version);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        write_line(fout, info->data);
+    }
+    clean_file_buf(info);
+    close(fout);
+    move_file(tempfile, manifest);
+}
+
 /**
  * Returns the version number of a manifest
  */
@@ -1260,80 +1687,265 @@ void regenerate_manifest_from_update(char *manifest, char *update, int server_ma
 ***********************************************************************************/
 
 /**
- * For every .Commit file in the project dir, compute the hash of it
- * If it's equal to the client commit hash, return name of that file
- * If the commit file wasn't found, return null byte
+ * Returns the name a pending .Commit is kept under. It's named after
+ * its md5, so a push finds it without hashing the others.
+ * The returned pointer must be freed.
+ */
+char *commit_filename(char *project, char *digest){
+    char *commit;
+    asprintf(&commit, "%s/.Commit_%s", project, digest);
+    return commit;
+}
+
+/**
+ * Index of the pending .Commit files, one "<digest> <path>" line per
+ * path each one changes. Kept out of the project dir so snapshots
+ * don't share it.
+ */
+static char *pending_index(char *project){
+    char *index;
+    asprintf(&index, "history/%s/.Pending", project);
+    return index;
+}
+
+/**
+ * If the client's digest names a pending .Commit, returns its name.
+ * Otherwise returns NULL.
  */
 char *commit_exists(char *project, char *client_hex){
+    // it becomes part of a path, so it has to look like a digest
+    if (strlen(client_hex) != 32 || strspn(client_hex, "0123456789abcdefABCDEF") != 32)
+        return NULL;
 
-    // open the project directory
-    struct dirent *de;
-    DIR *proj_dir = opendir(project);
-    char *commitBuff = calloc(8, sizeof(char));
-    char hexstring[33];
+    char *commit = commit_filename(project, client_hex);
+    if (access(commit, F_OK) == -1){
+        free(commit);
+        return NULL;
+    }
+    return commit;
+}
 
-    // go through the files of the project directory
-    while ((de = readdir(proj_dir)) != NULL) {
-        // only read files with names longer than ".Commit" length
-        if (strlen(de->d_name) >= 7) {
-            int i;
-            for (i = 0; i < 7; i++) {
-                commitBuff[i] = (de->d_name)[i];
-            }
+/**
+ * Keeps an accepted .Commit until it's pushed, and adds the paths it
+ * changes to the pending index.
+ */
+void save_pending_commit(char *project, char *commit){
+    char digest[32+1];
+    md5sum(commit, digest);
+
+    int count;
+    char **paths = commit_paths(commit, &count);
+    char *index = pending_index(project);
+    mkpath(index);
+    FILE *fidx = fopen(index, "a");
+    int i;
+    for (i = 0; i < count; i++)
+        fprintf(fidx, "%s %s\n", digest, paths[i]);
+    if (count == 0)
+        fprintf(fidx, "%s \n", digest);
+    fclose(fidx);
+    clean_paths(paths, count);
+    free(index);
+
+    char *dest = commit_filename(project, digest);
+    move_file(commit, dest);
+    free(dest);
+}
 
-            // if the file name starts with .Commit,
-            // check that its hash is the same as client .Commit
-            if (!strcmp(commitBuff, ".Commit")) {
-                char *buf;
-                asprintf(&buf, "%s/%s", project, de->d_name);
-                md5sum(buf, hexstring);
-
-                // if hash is same, return file name
-                if (!strcmp(hexstring, client_hex)) {
-                    free(commitBuff);
-                    closedir(proj_dir);
-                    return buf;
-                }
-                free(buf);
-            }
+/**
+ * Remove all pending .Commit files from given project
+ */
+void remove_all_commits(char *project) {
+    char *index = pending_index(project);
+    file_buf_t *info = init_file_buf(index);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        char *space = strchr(info->data, ' ');
+        if (space)
+            *space = '\0';
+        char *commit = commit_filename(project, info->data);
+        remove(commit);
+        free(commit);
+    }
+    clean_file_buf(info);
+    remove(index);
+    free(index);
+}
+
+/**
+ * Returns the paths named in a .Commit (or in history records, which
+ * are .Commit lines back to back), sorted and without repeats.
+ * Free with clean_paths.
+ */
+char **commit_paths(char *commit, int *count){
+    int max_count = 64;
+    char **paths = malloc(max_count * sizeof(char *));
+    *count = 0;
+
+    file_buf_t *info = init_file_buf(commit);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (*count >= max_count){
+            max_count *= 2;
+            paths = realloc(paths, max_count * sizeof(char *));
         }
+        paths[(*count)++] = strdup(ml->fname);
+        clean_manifest_line(ml);
     }
-    closedir(proj_dir);
-    free(commitBuff);
-    return NULL;
+    clean_file_buf(info);
+
+    qsort(paths, *count, sizeof(char *), compare_paths);
+    int i;
+    int unique = 0;
+    for (i = 0; i < *count; i++){
+        if (unique && !strcmp(paths[unique-1], paths[i]))
+            free(paths[i]);
+        else
+            paths[unique++] = paths[i];
+    }
+    *count = unique;
+    return paths;
+}
+
+int path_in_list(char **paths, int count, char *fname){
+    return bsearch(&fname, paths, count, sizeof(char *), compare_paths) != NULL;
+}
+
+void clean_paths(char **paths, int count){
+    int i;
+    for (i = 0; i < count; i++)
+        free(paths[i]);
+    free(paths);
 }
 
 /**
- * Remove all .Commit files from given project
+ * Returns whether a .Commit names any of the given sorted paths.
  */
-void remove_all_commits(char *project) {
+int commit_conflicts(char *commit, char **paths, int count){
+    int conflicts = 0;
+    file_buf_t *info = init_file_buf(commit);
+    while (!conflicts){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        conflicts = path_in_list(paths, count, ml->fname);
+        clean_manifest_line(ml);
+    }
+    clean_file_buf(info);
+    return conflicts;
+}
 
-    // open the project directory
-    struct dirent *de;
-    DIR *proj_dir = opendir(project);
-
-    // go through the files of the project directory
-    while ((de = readdir(proj_dir)) != NULL) {
-        // only read files with names longer than ".Commit" length
-        if (strlen(de->d_name) >= 7) {
-            // delete all .Commit files
-            if (!strncmp(de->d_name, ".Commit", strlen(".Commit"))) {
-                char *rm_commit_path;
-                asprintf(&rm_commit_path, "%s/%s", project, de->d_name);
-                remove(rm_commit_path);
-                free(rm_commit_path);
-            }
+/**
+ * Removes a pushed .Commit and every pending one that changes a path
+ * it changed; those can never be pushed now. Others stay pending.
+ */
+void remove_conflicting_commits(char *project, char *pushed){
+    int count;
+    char **paths = commit_paths(pushed, &count);
+
+    // the pushed one is named after its digest
+    int num_expired = 1;
+    int max_expired = 16;
+    char **expired = malloc(max_expired * sizeof(char *));
+    expired[0] = strdup(strrchr(pushed, '_') + 1);
+
+    // find the pending ones sharing a path with it
+    char *index = pending_index(project);
+    file_buf_t *info = init_file_buf(index);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        char *space = strchr(info->data, ' ');
+        if (!space || !path_in_list(paths, count, space + 1))
+            continue;
+        *space = '\0';
+        int i;
+        for (i = 0; i < num_expired && strcmp(expired[i], info->data); i++);
+        if (i < num_expired)
+            continue;
+        if (num_expired >= max_expired){
+            max_expired *= 2;
+            expired = realloc(expired, max_expired * sizeof(char *));
+        }
+        expired[num_expired++] = strdup(info->data);
+    }
+    clean_file_buf(info);
+    clean_paths(paths, count);
+
+    // drop their lines from the index, then the files themselves
+    char tempfile[15+1];
+    gen_temp_filename(tempfile);
+    FILE *fout = fopen(tempfile, "w");
+    info = init_file_buf(index);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        int i;
+        for (i = 0; i < num_expired; i++)
+            if (!strncmp(info->data, expired[i], strlen(expired[i])) &&
+                info->data[strlen(expired[i])] == ' ')
+                break;
+        if (i == num_expired)
+            fprintf(fout, "%s\n", info->data);
+    }
+    clean_file_buf(info);
+    fclose(fout);
+    move_file(tempfile, index);
+    free(index);
+
+    int i;
+    for (i = 0; i < num_expired; i++){
+        char *commit = commit_filename(project, expired[i]);
+        remove(commit);
+        free(commit);
+        free(expired[i]);
+    }
+    free(expired);
+}
+
+/**
+ * Backup all files marked "A" and "M" in .Commit, as found under root,
+ * into the dest directory. A push does this while its files are still
+ * staged, so the project isn't locked while they are compressed.
+ */
+void backup_commit_files(char *commit, char *root, char *dest){
+    file_buf_t *info = init_file_buf(commit);
+
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (ml->code != 'D'){
+            char *backup_fname;
+            asprintf(&backup_fname, "%s/%s_%d", dest, ml->fname, ml->version);
+            mkpath(backup_fname);
+            char *cmd;
+            asprintf(&cmd, "tar -czf %s -C %s %s", backup_fname, root, ml->fname);
+            system(cmd);
+            free(cmd);
+            free(backup_fname);
         }
+        clean_manifest_line(ml);
     }
-    closedir(proj_dir);
+    clean_file_buf(info);
 }
 
 /**
  * Remove all files marked "D" in .Commit
- * Backup all files marked "A" and "M".
+ * Move the backups of "A" and "M" files made by backup_commit_files
+ * from staged_backups into the backups directory.
  * Save commit file for history.
  */
-void update_repo_from_commit(char *commit, char *project, int manifest_version_num) {
+void update_repo_from_commit(char *commit, char *project, int manifest_version_num, char *staged_backups) {
     // read from commit file
     file_buf_t *info = init_file_buf(commit);
 
@@ -1355,14 +1967,15 @@ void update_repo_from_commit(char *commit, char *project, int manifest_version_n
             free(copy);
 
         } else {
-            // make backup
+            // keep backup
+            char *staged;
             char *backup_fname;
+            asprintf(&staged, "%s/%s_%d", staged_backups, ml->fname, ml->version);
             asprintf(&backup_fname, "backups/%s_%d", ml->fname, ml->version);
             mkpath(backup_fname);
-            char *cmd;
-            asprintf(&cmd, "tar -czf %s %s", backup_fname, ml->fname);
-            system(cmd);
-            free(cmd);
+            if (rename(staged, backup_fname) == -1)
+                move_file(staged, backup_fname);
+            free(staged);
             free(backup_fname);
         }
         clean_manifest_line(ml);
@@ -1370,14 +1983,7 @@ void update_repo_from_commit(char *commit, char *project, int manifest_version_n
     clean_file_buf(info);
 
     // save commit file for history
-    char *commit_backup;
-    asprintf(&commit_backup, "history/%s/.Commit_%d", project, manifest_version_num);
-    mkpath(commit_backup);
-    char *cmd;
-    asprintf(&cmd, "cp %s %s", commit, commit_backup);
-    system(cmd);
-    free(cmd);
-    free(commit_backup);
+    append_history(project, manifest_version_num, commit);
 }
 
 /**********************************************************************************
@@ -1434,15 +2040,48 @@ void generate_update_conflict_files(char *project, char *client_manifest, char *
 
     // skip first line of manifest
     read_file_until(info, ' ');
-    char hexstring[33];
-
-    // go through all lines in client .Manifest
+    char hexstring[HEXDIGEST_MAX+1];
+    stat_index_t *index = load_stat_index(project);
+    sparse_t *sparse = load_sparse(project);
+
+    // pair every client .Manifest line with its server line
+    int count = 0;
+    int max_count = 64;
+    manifest_line_t **ml_clients = malloc(max_count * sizeof(manifest_line_t *));
+    char **server_lines = malloc(max_count * sizeof(char *));
     while (1){
         read_file_until(info, '\n');
         if (info->file_eof)
             break;
-        manifest_line_t *ml_client = parse_manifest_line(info->data);
-        char *server_line = search_file_in_manifest(server_manifest, ml_client->fname);
+        if (count >= max_count){
+            max_count *= 2;
+            ml_clients = realloc(ml_clients, max_count * sizeof(manifest_line_t *));
+            server_lines = realloc(server_lines, max_count * sizeof(char *));
+        }
+        ml_clients[count] = parse_manifest_line(info->data);
+        server_lines[count] = search_file_in_manifest(server_manifest, ml_clients[count]->fname);
+        count++;
+    }
+
+    // hash the files the server changed in parallel before deciding M or C
+    int num_changed = 0;
+    char **changed = malloc((count + 1) * sizeof(char *));
+    int i;
+    for (i = 0; i < count; i++){
+        if (!server_lines[i] || !sparse_match(sparse, ml_clients[i]->fname))
+            continue;
+        manifest_line_t *ml_server = parse_manifest_line(server_lines[i]);
+        if (ml_clients[i]->version != ml_server->version && strcmp(ml_clients[i]->hexdigest, ml_server->hexdigest))
+            changed[num_changed++] = ml_clients[i]->fname;
+        clean_manifest_line(ml_server);
+    }
+    index_hash_files(index, changed, num_changed);
+    free(changed);
+
+    // go through all lines in client .Manifest
+    for (i = 0; i < count; i++){
+        manifest_line_t *ml_client = ml_clients[i];
+        char *server_line = server_lines[i];
 
         // if a file in client .Manifest can't be found in server .Manifest, make it "D" in .Update
         if(!server_line){
@@ -1460,9 +2099,12 @@ void generate_update_conflict_files(char *project, char *client_manifest, char *
             // if the client .Manifest file version and hash are different from the server .Manifest
             if (ml_client->version != ml_server->version && strcmp(ml_client->hexdigest, ml_server->hexdigest)){
 
-                // if the live hash of the client file matches the hash in the client manifest, mark it "M" in .Update
-                md5sum(ml_client->fname, hexstring);
-                if (!strcmp(hexstring, ml_client->hexdigest)){
+                // if the live hash of the client file matches the hash in the client manifest, mark it "M" in .Update.
+                // files outside a sparse checkout aren't on disk, so they can't conflict
+                int in_checkout = sparse_match(sparse, ml_client->fname);
+                if (in_checkout)
+                    index_digest(index, ml_client->fname, hexstring);
+                if (!in_checkout || !strcmp(hexstring, ml_client->hexdigest)){
                     char *entry_line = generate_manifest_line('M', ml_server->hexdigest, ml_server->version, ml_server->fname);
                     write(fout, entry_line, strlen(entry_line));
 
@@ -1488,8 +2130,13 @@ void generate_update_conflict_files(char *project, char *client_manifest, char *
         clean_manifest_line(ml_client);
         free(server_line);
     }
+    free(ml_clients);
+    free(server_lines);
 
     // clean up
+    save_stat_index(index);
+    clean_stat_index(index);
+    clean_sparse(sparse);
     free(update);
     free(conflict);
     close(fout);
@@ -1685,7 +2332,8 @@ void rollback_every_file(char *project, char *version){
     }
     clean_file_buf(info);
 
-    // move tempdir to realdir
+    // move tempdir to realdir. the old files are unlinked, not
+    // overwritten, so snapshots linking them keep the old contents
     char *rm_old;
     asprintf(&rm_old, "rm -rf %s", project);
     system(rm_old);
@@ -1,15 +1,40 @@
 #pragma once
 
 #include <pthread.h>
+#include <netinet/in.h>
 
 #define CHUNK_SIZE 1024
 
+// longest hex digest of any content hash
+#define HEXDIGEST_MAX 64
+
 void seed_rand();
+long online_cores();
+
+extern int agent_sock;
+
+struct sparse_t;
+struct merkle_node_t;
+struct project_tree_t;
 
 typedef struct project_t {
-    pthread_mutex_t lock;
+    // held by commands that change the live project directory and
+    // shared by `history`; a waiting writer keeps new readers out so
+    // it isn't starved. reads of snapshots don't take it. taken with
+    // lock_project, which also locks out other worker processes
+    pthread_rwlock_t lock;
     int sock;
     char *name;
+
+    // hash tree of the newest snapshot read; readers may
+    // build it at the same time
+    pthread_mutex_t tree_lock;
+    struct project_tree_t *tree;
+
+    // connections holding the entry, guarded by its registry stripe.
+    // once `destroy` removed it, the last one to let go frees it
+    int refs;
+    int removed;
     struct project_t *next;
 } project_t;
 
@@ -27,28 +52,58 @@ typedef struct file_buf_t {
 typedef struct manifest_line_t {
     char code;
     int  version;
-    char hexdigest[32+1];
+    char hexdigest[HEXDIGEST_MAX+1];
     char *fname;
 
     struct manifest_line_t *next;
 } manifest_line_t;
 
+/**
+ * Which version of a file a cached parse was made from.
+ */
+typedef struct file_version_t {
+    unsigned long ino;
+    long size;
+    long mtime_sec;
+    long mtime_nsec;
+
+    // when the cache was made
+    long cached_sec;
+    long cached_nsec;
+} file_version_t;
+
 int file_exists_local(char *project, char *fname);
+int get_file_version(char *fname, file_version_t *version);
+int file_version_current(char *fname, file_version_t *version);
 void mkpath(char* file_path);
+void write_line(int fd, char *line);
+void move_file(char *src, char *dst);
 file_buf_t *init_file_buf(char *filename);
 void clean_file_buf(file_buf_t *info);
 
+void set_lost_connection_exits(int exits);
+int connection_lost();
+void ack(int sock);
+void wait_for_ack(int sock);
 void send_int(int sock, int num);
 int recv_int(int sock);
+void send_long(int sock, long num);
+long recv_long(int sock);
 void send_line(int sock, char *msg);
 char *recv_line(int sock);
+char *recv_command(int sock);
+void send_chunk(int sock, char *data, int len);
+int recv_chunk(int sock, char **data);
 void read_file_until(file_buf_t *info, char delim);
 void send_file(char *filename, int sock, int send_filename);
-void recv_file(int sock, char *dest);
-void send_directory(int sock, char *dirname);
-void recv_directory(int sock, char *dirname);
+int recv_file(int sock, char *dest);
+char *generate_directory_tar(char *root, char *dirname);
 void md5sum(char *filename, char *hexstring);
+void md5sum_buf(char *data, int len, char *hexstring);
+void hexlify(unsigned char *bytes, int len, char *hexstring);
 void assert_project_exists_local(char *project);
+void set_nodelay(int sock);
+char *resolve_server(struct sockaddr_in *serv_addr);
 void init_socket_server(int *sock, char *command);
 int server_project_exists(int sock, char *project);
 char *set_create_project(int sock, int should_create);
@@ -60,15 +115,27 @@ char *search_file_in_manifest(char *manifest, char *search);
 char *generate_manifest_line(char code, char *hexdigest, int version, char *fname);
 manifest_line_t *parse_manifest_line(char *line);
 void clean_manifest_line(manifest_line_t *ml);
-int generate_commit_file(char *commit, char *client_manifest, char *server_manifest);
-char* generate_am_tar(char *commitPath);
+int generate_commit_file(char *project, char *commit, char *client_manifest);
+int validate_commit_file(char *commit, struct merkle_node_t *root, int algo,
+                         char **changed, int num_changed, char *results);
+char* generate_am_tar(char *root, char *commitPath);
+char *generate_sparse_tar(char *root, char *project, struct sparse_t *sparse);
 void regenerate_manifest_from_commit(char *client_manifest, char *commit);
+void rebase_manifest(char *manifest, char *commit, char *dest);
+void set_manifest_version(char *manifest, int version);
 int get_manifest_version(char *manifest);
 void regenerate_manifest_from_update(char *manifest, char *update, int server_man_version);
 
-char* gen_commit_filename(char *project);
+char *commit_filename(char *project, char *digest);
+void save_pending_commit(char *project, char *commit);
 void remove_all_commits(char *project);
-void update_repo_from_commit(char *commit, char *project, int manifest_version_num);
+char **commit_paths(char *commit, int *count);
+int path_in_list(char **paths, int count, char *fname);
+void clean_paths(char **paths, int count);
+int commit_conflicts(char *commit, char **paths, int count);
+void remove_conflicting_commits(char *project, char *pushed);
+void backup_commit_files(char *commit, char *root, char *dest);
+void update_repo_from_commit(char *commit, char *project, int manifest_version_num, char *staged_backups);
 char *commit_exists(char *project, char *client_hex);
 
 void generate_update_conflict_files(char *project, char *client_manifest, char *server_manifest);
@@ -0,0 +1,417 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+// ======================================
+// History layout
+// ======================================
+// history/<project>/.History        every pushed .Commit, back to back
+// history/<project>/.History_index  one history_entry_t per version
+// history/<project>/.Pending        paths of the pending .Commit files
+//
+// The log is only ever appended to (or truncated by rollback), and an
+// entry is written to the index after its record is on disk, so the
+// index never points at a partial record.
+
+#define HISTORY_STREAM_SIZE (64 * 1024)
+
+static char *history_file(char *project, char *name){
+    char *path;
+    asprintf(&path, "history/%s/%s", project, name);
+    return path;
+}
+
+/**
+ * Reads the index entry at the given position.
+ */
+static void read_history_entry(int fd, int pos, history_entry_t *entry){
+    pread(fd, entry, sizeof(history_entry_t), (off_t) pos * sizeof(history_entry_t));
+}
+
+/**
+ * Returns the position of the first entry whose version is >= version,
+ * or count if there is none.
+ */
+static int find_history_entry(int fd, int count, int version){
+    int lo = 0;
+    int hi = count;
+    while (lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        history_entry_t entry;
+        read_history_entry(fd, mid, &entry);
+        if (entry.version < version)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Appends a commit file to the log, then records it in the index.
+ */
+static void write_history_record(char *project, int version, char *commit){
+    char *log = history_file(project, ".History");
+    char *index = history_file(project, ".History_index");
+    mkpath(log);
+
+    int fidx = open(index, O_RDWR | O_CREAT, 0644);
+    struct stat st = {0};
+    fstat(fidx, &st);
+    int count = st.st_size / sizeof(history_entry_t);
+
+    // new record starts where the last indexed one ends
+    history_entry_t entry = {0};
+    entry.version = version;
+    if (count > 0){
+        history_entry_t last;
+        read_history_entry(fidx, count - 1, &last);
+        entry.offset = last.offset + last.length;
+    }
+
+    // drop any unindexed tail left by an interrupted append
+    int flog = open(log, O_WRONLY | O_CREAT, 0644);
+    ftruncate(flog, entry.offset);
+    lseek(flog, entry.offset, SEEK_SET);
+
+    int fin = open(commit, O_RDONLY);
+    int eof = 0;
+    while (!eof){
+        int bytes_read = 0;
+        char *buf = read_file_chunk(fin, &bytes_read, &eof);
+        write(flog, buf, bytes_read);
+        entry.length += bytes_read;
+        free(buf);
+    }
+    close(fin);
+    fsync(flog);
+    close(flog);
+
+    pwrite(fidx, &entry, sizeof(history_entry_t), (off_t) count * sizeof(history_entry_t));
+    close(fidx);
+
+    free(log);
+    free(index);
+}
+
+/**
+ * Moves history/<project>/.Commit_N files written by older
+ * servers into the log, the first time the log is used.
+ */
+static void migrate_commit_history(char *project){
+    char *index = history_file(project, ".History_index");
+    int migrated = access(index, F_OK) != -1;
+    free(index);
+    if (migrated)
+        return;
+
+    int i;
+    for (i = 1; i >= 0; i++){
+        char *backup;
+        asprintf(&backup, "history/%s/.Commit_%d", project, i);
+        if (access(backup, F_OK) != -1){
+            write_history_record(project, i, backup);
+            remove(backup);
+        } else
+            i = -10; // done
+        free(backup);
+    }
+}
+
+/**
+ * Opens the project's history index for reading and returns
+ * its number of entries in count. Returns -1 if there is no history.
+ */
+static int open_history_index(char *project, int *count){
+    migrate_commit_history(project);
+
+    char *index = history_file(project, ".History_index");
+    int fd = open(index, O_RDONLY);
+    free(index);
+
+    struct stat st = {0};
+    fstat(fd, &st);
+    *count = fd == -1 ? 0 : st.st_size / sizeof(history_entry_t);
+    return fd;
+}
+
+/**
+ * Reads the record for an index entry. The returned pointer must be freed.
+ */
+static char *read_history_record(int flog, history_entry_t *entry){
+    char *buf = malloc(entry->length + 1);
+    int total = 0;
+    while (total < entry->length){
+        int bytes_read = pread(flog, buf + total, entry->length - total, entry->offset + total);
+        if (bytes_read <= 0)
+            break;
+        total += bytes_read;
+    }
+    buf[total] = '\0';
+    return buf;
+}
+
+/**
+ * Save the .Commit that produced the given version for history.
+ */
+void append_history(char *project, int version, char *commit){
+    migrate_commit_history(project);
+    write_history_record(project, version, commit);
+}
+
+/**
+ * Forget every version newer than the given one.
+ */
+void truncate_history(char *project, int version){
+    int count;
+    int fidx = open_history_index(project, &count);
+    if (fidx == -1)
+        return;
+
+    int pos = find_history_entry(fidx, count, version + 1);
+    if (pos < count){
+        history_entry_t entry;
+        read_history_entry(fidx, pos, &entry);
+
+        char *log = history_file(project, ".History");
+        char *index = history_file(project, ".History_index");
+        truncate(index, (off_t) pos * sizeof(history_entry_t));
+        truncate(log, entry.offset);
+        free(log);
+        free(index);
+    }
+    close(fidx);
+}
+
+/**
+ * Concatenates the .Commit records of versions first_version
+ * through last_version into dest.
+ *
+ * Returns whether every version in the range was found.
+ */
+int read_history(char *project, int first_version, int last_version, char *dest){
+    int fout = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (first_version > last_version){
+        close(fout);
+        return 1;
+    }
+
+    int count;
+    int fidx = open_history_index(project, &count);
+    if (fidx == -1){
+        close(fout);
+        return 0;
+    }
+    char *log = history_file(project, ".History");
+    int flog = open(log, O_RDONLY);
+    free(log);
+
+    int found = 1;
+    int pos = find_history_entry(fidx, count, first_version);
+    int version;
+    for (version = first_version; version <= last_version; version++, pos++){
+        history_entry_t entry;
+        if (pos >= count){
+            found = 0;
+            break;
+        }
+        read_history_entry(fidx, pos, &entry);
+        if (entry.version != version){
+            found = 0;
+            break;
+        }
+        char *record = read_history_record(flog, &entry);
+        write(fout, record, entry.length);
+        free(record);
+    }
+
+    close(flog);
+    close(fidx);
+    close(fout);
+    return found;
+}
+
+/**
+ * Returns the sorted paths changed by the versions after from_version,
+ * up to to_version, or NULL if the history doesn't cover them all.
+ * Free with clean_paths.
+ */
+char **changed_paths_since(char *project, int from_version, int to_version, int *count){
+    if (from_version < 0 || from_version > to_version)
+        return NULL;
+
+    char commits[15+1];
+    gen_temp_filename(commits);
+    char **paths = NULL;
+    if (read_history(project, from_version + 1, to_version, commits))
+        paths = commit_paths(commits, count);
+    remove(commits);
+    return paths;
+}
+
+/**
+ * Returns whether a manifest line names the given path or a file below it.
+ */
+static int history_line_matches(char *line, char *path){
+    // fname is the fourth field: <code> <digest> <version> <fname>
+    char *fname = line;
+    int i;
+    for (i = 0; i < 3 && fname; i++){
+        fname = strchr(fname, ' ');
+        if (fname)
+            fname++;
+    }
+    if (!fname)
+        return 0;
+
+    int len = strlen(path);
+    return !strncmp(fname, path, len) && (fname[len] == '\0' || fname[len] == '/');
+}
+
+/**
+ * Appends the lines of a record that match path (every line if path
+ * is empty) to out. Returns the number of lines appended.
+ */
+static int filter_history_record(char *record, char *path, char **out, int *out_size, int *out_max){
+    int matched = 0;
+    char *line = record;
+    while (*line){
+        char *newline = strchr(line, '\n');
+        int len = newline ? newline - line : strlen(line);
+
+        char saved = line[len];
+        line[len] = '\0';
+        int keep = !*path || history_line_matches(line, path);
+        line[len] = saved;
+
+        if (keep){
+            if (*out_size + len + 1 > *out_max){
+                while (*out_size + len + 1 > *out_max)
+                    *out_max *= 2;
+                *out = realloc(*out, *out_max);
+            }
+            memcpy(*out + *out_size, line, len);
+            (*out)[*out_size + len] = '\n';
+            *out_size += len + 1;
+            matched++;
+        }
+
+        if (!newline)
+            break;
+        line = newline + 1;
+    }
+    return matched;
+}
+
+/**
+ * Whether any line of the record at pos matches path.
+ */
+static int history_record_matches(int fidx, int flog, int pos, char *path){
+    if (!*path)
+        return 1;
+
+    history_entry_t entry;
+    read_history_entry(fidx, pos, &entry);
+    char *record = read_history_record(flog, &entry);
+
+    int out_size = 0;
+    int out_max = CHUNK_SIZE;
+    char *out = malloc(out_max);
+    int matched = filter_history_record(record, path, &out, &out_size, &out_max);
+    free(out);
+    free(record);
+    return matched;
+}
+
+/**
+ * Streams history rows to the client as they are read:
+ *     "<version>\n" followed by that version's .Commit lines
+ *
+ * Rows are versions newer than since (or, if since is negative, the
+ * latest ones), at most limit of them (no limit if limit <= 0), and
+ * only those touching path if path isn't empty.
+ */
+void send_history(int sock, char *project, int since, int limit, char *path){
+    int count;
+    int fidx = open_history_index(project, &count);
+    if (fidx == -1){
+        send_chunk(sock, NULL, 0);
+        return;
+    }
+    char *log = history_file(project, ".History");
+    int flog = open(log, O_RDONLY);
+    free(log);
+
+    // find first row to send
+    int start = 0;
+    if (since >= 0){
+        start = find_history_entry(fidx, count, since + 1);
+    } else if (limit > 0){
+        int matched = 0;
+        start = count;
+        while (start > 0 && matched < limit){
+            start--;
+            matched += history_record_matches(fidx, flog, start, path) > 0;
+        }
+    }
+
+    int out_size = 0;
+    int out_max = HISTORY_STREAM_SIZE;
+    char *out = malloc(out_max);
+
+    int sent = 0;
+    int pos;
+    for (pos = start; pos < count && (limit <= 0 || sent < limit); pos++){
+        history_entry_t entry;
+        read_history_entry(fidx, pos, &entry);
+        char *record = read_history_record(flog, &entry);
+
+        // write version number, then the matching lines after it
+        char *num;
+        asprintf(&num, "%d\n", entry.version);
+        int row_start = out_size;
+        filter_history_record(num, "", &out, &out_size, &out_max);
+        free(num);
+        if (!filter_history_record(record, path, &out, &out_size, &out_max) && *path)
+            out_size = row_start;
+        else
+            sent++;
+        free(record);
+
+        // stream full chunks as we go
+        if (out_size >= HISTORY_STREAM_SIZE){
+            send_chunk(sock, out, out_size);
+            out_size = 0;
+        }
+    }
+    if (out_size > 0)
+        send_chunk(sock, out, out_size);
+    send_chunk(sock, NULL, 0);
+
+    free(out);
+    close(flog);
+    close(fidx);
+}
+
+/**
+ * Receives streamed history rows and writes them to fd.
+ */
+void recv_history(int sock, int fd){
+    while (1){
+        char *data;
+        int len = recv_chunk(sock, &data);
+        if (len == 0)
+            break;
+        write(fd, data, len);
+        free(data);
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "helpers.h"
+
+/**
+ * Fixed-size entry of history/<project>/.History_index,
+ * one per pushed version, in version order.
+ */
+typedef struct history_entry_t {
+    int  version;
+    int  length;
+    long offset;
+} history_entry_t;
+
+void append_history(char *project, int version, char *commit);
+void truncate_history(char *project, int version);
+int read_history(char *project, int from_version, int to_version, char *dest);
+char **changed_paths_since(char *project, int from_version, int to_version, int *count);
+void send_history(int sock, char *project, int since, int limit, char *path);
+void recv_history(int sock, int fd);
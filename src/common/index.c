@@ -0,0 +1,430 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "hashpool.h"
+#include "digest.h"
+#include "sparse.h"
+
+// ======================================
+// .Index format
+// ======================================
+// first line is the name of the content hash, followed by the
+// journal cursor if a monitor was running, then one line per file:
+// <hash> [<journal epoch> <journal offset>]
+// <digest> <mtime_s> <mtime_ns> <ctime_s> <ctime_ns> <size> <inode> <fname>
+
+static unsigned long hash_fname(char *fname){
+    unsigned long hash = 5381;
+    while (*fname)
+        hash = hash * 33 + (unsigned char) *fname++;
+    return hash;
+}
+
+static void insert_index_entry(stat_index_t *index, index_entry_t *entry){
+    // grow the table when it gets full
+    if (index->count >= index->num_buckets){
+        int old_num_buckets = index->num_buckets;
+        index_entry_t **old_buckets = index->buckets;
+        index->num_buckets *= 2;
+        index->buckets = calloc(index->num_buckets, sizeof(index_entry_t *));
+
+        int i;
+        for (i = 0; i < old_num_buckets; i++){
+            index_entry_t *cur = old_buckets[i];
+            while (cur){
+                index_entry_t *next = cur->next;
+                unsigned long b = hash_fname(cur->fname) % index->num_buckets;
+                cur->next = index->buckets[b];
+                index->buckets[b] = cur;
+                cur = next;
+            }
+        }
+        free(old_buckets);
+    }
+
+    unsigned long b = hash_fname(entry->fname) % index->num_buckets;
+    entry->next = index->buckets[b];
+    index->buckets[b] = entry;
+    index->count++;
+}
+
+static void remove_index_entry(stat_index_t *index, char *fname){
+    index_entry_t **link = &index->buckets[hash_fname(fname) % index->num_buckets];
+    while (*link && strcmp((*link)->fname, fname))
+        link = &(*link)->next;
+    if (!*link)
+        return;
+
+    index_entry_t *entry = *link;
+    *link = entry->next;
+    free(entry->fname);
+    free(entry);
+    index->count--;
+    index->dirty = 1;
+}
+
+static void clear_index_entries(stat_index_t *index){
+    int i;
+    for (i = 0; i < index->num_buckets; i++){
+        index_entry_t *entry = index->buckets[i];
+        while (entry){
+            index_entry_t *next = entry->next;
+            free(entry->fname);
+            free(entry);
+            entry = next;
+        }
+        index->buckets[i] = NULL;
+    }
+    index->count = 0;
+}
+
+/**
+ * Parses <project>/.Index as it is on disk, whatever its content hash.
+ */
+static stat_index_t *parse_stat_index(char *project){
+    stat_index_t *index = calloc(1, sizeof(stat_index_t));
+    asprintf(&index->path, "%s/.Index", project);
+    index->num_buckets = 64;
+    index->buckets = calloc(index->num_buckets, sizeof(index_entry_t *));
+    index->algo = -1;
+
+    if (!get_file_version(index->path, &index->version))
+        return index;
+    index->written_sec = index->version.mtime_sec;
+    index->written_nsec = index->version.mtime_nsec;
+
+    file_buf_t *info = init_file_buf(index->path);
+    read_file_until(info, '\n');
+    char algo_name[16] = "";
+    if (!info->file_eof)
+        sscanf(info->data, "%15s %64s %ld", algo_name, index->epoch, &index->offset);
+    index->algo = parse_hash_algo(algo_name);
+
+    while (index->algo != -1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+
+        index_entry_t *entry = calloc(1, sizeof(index_entry_t));
+        entry->fname = calloc(1, strlen(info->data) + 1);
+        int fields = sscanf(info->data, "%64s %ld %ld %ld %ld %ld %lu %s",
+                            entry->hexdigest, &entry->mtime_sec, &entry->mtime_nsec,
+                            &entry->ctime_sec, &entry->ctime_nsec, &entry->size,
+                            &entry->ino, entry->fname);
+        if (fields != 8){
+            free(entry->fname);
+            free(entry);
+            continue;
+        }
+        insert_index_entry(index, entry);
+    }
+    clean_file_buf(info);
+    return index;
+}
+
+// ======================================
+// Warm indexes
+// ======================================
+// The client agent parses the .Index of projects it serves ahead of
+// time. Its forked command processes inherit the parsed copies and
+// take them instead of reading the file again, as long as the file
+// hasn't changed since.
+
+static stat_index_t *warm_indexes = NULL;
+
+static stat_index_t *take_warm_index(char *path){
+    stat_index_t **link = &warm_indexes;
+    while (*link && strcmp((*link)->path, path))
+        link = &(*link)->next_warm;
+    if (!*link)
+        return NULL;
+
+    stat_index_t *index = *link;
+    *link = index->next_warm;
+    index->next_warm = NULL;
+    if (file_version_current(path, &index->version))
+        return index;
+    clean_stat_index(index);
+    return NULL;
+}
+
+/**
+ * Parses a project's .Index and keeps it for later load_stat_index calls.
+ */
+void warm_stat_index(char *project){
+    char *path;
+    asprintf(&path, "%s/.Index", project);
+    stat_index_t *old = take_warm_index(path);
+    if (old)
+        clean_stat_index(old);
+    free(path);
+
+    stat_index_t *index = parse_stat_index(project);
+    if (index->algo == -1){
+        clean_stat_index(index);
+        return;
+    }
+    index->next_warm = warm_indexes;
+    warm_indexes = index;
+}
+
+/**
+ * Loads <project>/.Index, or an empty index if there is none.
+ * The returned pointer must be passed to clean_stat_index.
+ */
+stat_index_t *load_stat_index(char *project){
+    char *path;
+    asprintf(&path, "%s/.Index", project);
+    stat_index_t *index = take_warm_index(path);
+    free(path);
+    if (!index)
+        index = parse_stat_index(project);
+
+    // digests of another content hash are useless; start over
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
+    int algo = get_manifest_hash(manifest);
+    free(manifest);
+    if (index->algo != algo){
+        index->dirty = index->algo != -1 || access(index->path, F_OK) != -1;
+        index->algo = algo;
+        index->epoch[0] = '\0';
+        clear_index_entries(index);
+    }
+
+    // ask the monitor what changed since the cursor
+    index->journal = read_journal(project, index->epoch[0] ? index->epoch : NULL, index->offset);
+    if (index->journal && (strcmp(index->journal->epoch, index->epoch) || index->journal->offset != index->offset))
+        index->dirty = 1;
+
+    // files that changed since the cursor have to be checked again
+    if (index->journal && index->journal->trusted){
+        int i;
+        for (i = 0; i < index->journal->count; i++)
+            remove_index_entry(index, index->journal->paths[i]);
+    }
+    return index;
+}
+
+/**
+ * Writes the index back if anything changed. The file is replaced
+ * atomically so a crashed client never leaves a torn index behind.
+ */
+void save_stat_index(stat_index_t *index){
+    if (!index->dirty)
+        return;
+
+    char *tempfile;
+    asprintf(&tempfile, "%s.tmp", index->path);
+    int fout = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    // the cursor only moves if every entry is known to be current
+    journal_t *journal = index->journal;
+    if (journal && (journal->trusted || index->checked_all)){
+        char *header;
+        asprintf(&header, "%s %s %ld", hash_algo_name(index->algo), journal->epoch, journal->offset);
+        write_line(fout, header);
+        free(header);
+    } else {
+        write_line(fout, hash_algo_name(index->algo));
+    }
+
+    int i;
+    for (i = 0; i < index->num_buckets; i++){
+        index_entry_t *entry;
+        for (entry = index->buckets[i]; entry; entry = entry->next){
+            char *line;
+            asprintf(&line, "%s %ld %ld %ld %ld %ld %lu %s",
+                     entry->hexdigest, entry->mtime_sec, entry->mtime_nsec,
+                     entry->ctime_sec, entry->ctime_nsec, entry->size,
+                     entry->ino, entry->fname);
+            write_line(fout, line);
+            free(line);
+        }
+    }
+    close(fout);
+    rename(tempfile, index->path);
+    free(tempfile);
+    index->dirty = 0;
+}
+
+void clean_stat_index(stat_index_t *index){
+    clear_index_entries(index);
+    free(index->buckets);
+    free(index->path);
+    if (index->journal)
+        clean_journal(index->journal);
+    free(index);
+}
+
+index_entry_t *find_index_entry(stat_index_t *index, char *fname){
+    index_entry_t *entry = index->buckets[hash_fname(fname) % index->num_buckets];
+    while (entry && strcmp(entry->fname, fname))
+        entry = entry->next;
+    return entry;
+}
+
+/**
+ * An entry the monitor has seen no change to since the index's
+ * cursor; its digest is current without looking at the file.
+ */
+static int index_entry_unchanged(stat_index_t *index, index_entry_t *entry){
+    return entry && index->journal && index->journal->trusted;
+}
+
+/**
+ * Records the digest of a file along with the stat data it was computed from.
+ */
+void update_index_entry(stat_index_t *index, char *fname, struct stat *st, char *hexdigest){
+    index_entry_t *entry = find_index_entry(index, fname);
+    if (!entry){
+        entry = calloc(1, sizeof(index_entry_t));
+        entry->fname = strdup(fname);
+        insert_index_entry(index, entry);
+    }
+    strcpy(entry->hexdigest, hexdigest);
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    entry->ctime_sec = st->st_ctim.tv_sec;
+    entry->ctime_nsec = st->st_ctim.tv_nsec;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->hashed = 1;
+    index->dirty = 1;
+}
+
+/**
+ * Whether a cached digest can be trusted for a file with the given stat data.
+ *
+ * Timestamps only have the filesystem's granularity, so a file written
+ * in the same tick as the index could change again without its mtime
+ * moving. Such "racy" entries (mtime not older than the index) are
+ * only trusted if they were hashed by this process.
+ */
+int index_entry_fresh(stat_index_t *index, index_entry_t *entry, struct stat *st){
+    if (!entry)
+        return 0;
+    if (entry->mtime_sec != st->st_mtim.tv_sec || entry->mtime_nsec != st->st_mtim.tv_nsec ||
+            entry->ctime_sec != st->st_ctim.tv_sec || entry->ctime_nsec != st->st_ctim.tv_nsec ||
+            entry->size != st->st_size || entry->ino != st->st_ino)
+        return 0;
+
+    if (entry->hashed)
+        return 1;
+    return entry->mtime_sec < index->written_sec ||
+           (entry->mtime_sec == index->written_sec && entry->mtime_nsec < index->written_nsec);
+}
+
+/**
+ * Computes the digest of a file, reusing the cached digest
+ * if its stat data hasn't changed.
+ */
+void index_digest(stat_index_t *index, char *fname, char *hexstring){
+    index_entry_t *entry = find_index_entry(index, fname);
+    if (index_entry_unchanged(index, entry)){
+        strcpy(hexstring, entry->hexdigest);
+        return;
+    }
+
+    hash_job_t job = {0};
+    job.fname = fname;
+
+    struct stat st = {0};
+    if (stat(fname, &st) == -1){
+        hash_files(&job, 1, index->algo);
+        strcpy(hexstring, job.hexdigest);
+        return;
+    }
+
+    if (index_entry_fresh(index, entry, &st)){
+        strcpy(hexstring, entry->hexdigest);
+        return;
+    }
+
+    job.size = st.st_size;
+    hash_files(&job, 1, index->algo);
+    strcpy(hexstring, job.hexdigest);
+    update_index_entry(index, fname, &st, hexstring);
+}
+
+/**
+ * Brings the cached digests of the given files up to date, hashing
+ * every file whose stat data changed in parallel. Later index_digest
+ * calls for these files are answered from the index.
+ */
+void index_hash_files(stat_index_t *index, char **fnames, int count){
+    hash_job_t *jobs = calloc(count, sizeof(hash_job_t));
+    struct stat *stats = calloc(count, sizeof(struct stat));
+
+    // only files that changed since they were last hashed
+    int num_jobs = 0;
+    int i;
+    for (i = 0; i < count; i++){
+        index_entry_t *entry = find_index_entry(index, fnames[i]);
+        if (index_entry_unchanged(index, entry))
+            continue;
+
+        // files that are gone keep no entry
+        if (stat(fnames[i], &stats[num_jobs]) == -1){
+            remove_index_entry(index, fnames[i]);
+            continue;
+        }
+        if (index_entry_fresh(index, entry, &stats[num_jobs]))
+            continue;
+        jobs[num_jobs].fname = fnames[i];
+        jobs[num_jobs].size = stats[num_jobs].st_size;
+        num_jobs++;
+    }
+
+    hash_files(jobs, num_jobs, index->algo);
+    for (i = 0; i < num_jobs; i++)
+        update_index_entry(index, jobs[i].fname, &stats[i], jobs[i].hexdigest);
+
+    free(stats);
+    free(jobs);
+}
+
+/**
+ * Hashes every file of a manifest that is still tracked (not coded "D")
+ * and part of the checkout.
+ */
+void index_hash_manifest(stat_index_t *index, char *manifest, sparse_t *sparse){
+    int count = 0;
+    int max_count = 64;
+    char **fnames = malloc(max_count * sizeof(char *));
+
+    file_buf_t *info = init_file_buf(manifest);
+    read_file_until(info, '\n');
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (ml->code != 'D' && sparse_match(sparse, ml->fname)){
+            if (count >= max_count){
+                max_count *= 2;
+                fnames = realloc(fnames, max_count * sizeof(char *));
+            }
+            fnames[count++] = strdup(ml->fname);
+        }
+        clean_manifest_line(ml);
+    }
+    clean_file_buf(info);
+
+    index_hash_files(index, fnames, count);
+    index->checked_all = 1;
+
+    int i;
+    for (i = 0; i < count; i++)
+        free(fnames[i]);
+    free(fnames);
+}
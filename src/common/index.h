@@ -0,0 +1,72 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include "helpers.h"
+#include "journal.h"
+
+/**
+ * Cached stat data and digest of one tracked file.
+ */
+typedef struct index_entry_t {
+    char *fname;
+    char hexdigest[HEXDIGEST_MAX+1];
+
+    long mtime_sec;
+    long mtime_nsec;
+    long ctime_sec;
+    long ctime_nsec;
+    long size;
+    unsigned long ino;
+
+    // digest was computed by this process, so it isn't racy
+    int hashed;
+
+    struct index_entry_t *next;
+} index_entry_t;
+
+/**
+ * Client-side stat cache stored next to the .Manifest as <project>/.Index.
+ * A file whose stat data is unchanged since it was last hashed is not
+ * read again. Digests use the project's content hash.
+ */
+typedef struct stat_index_t {
+    char *path;
+    int algo;
+    index_entry_t **buckets;
+    int num_buckets;
+    int count;
+    int dirty;
+
+    // when the index was last written; entries modified at or after
+    // this time are "racy" and always re-hashed
+    long written_sec;
+    long written_nsec;
+
+    // changes logged by `WTF monitor`, if it is running. When trusted,
+    // entries not logged since the index's cursor aren't even stat-ed
+    struct journal_t *journal;
+
+    // every tracked file was checked, so the journal cursor
+    // may move even if the journal wasn't trusted
+    int checked_all;
+
+    // journal cursor the index was written with
+    char epoch[JOURNAL_EPOCH_MAX+1];
+    long offset;
+
+    // the .Index this was parsed from, and the next index kept warm
+    file_version_t version;
+    struct stat_index_t *next_warm;
+} stat_index_t;
+
+stat_index_t *load_stat_index(char *project);
+void warm_stat_index(char *project);
+void save_stat_index(stat_index_t *index);
+void clean_stat_index(stat_index_t *index);
+index_entry_t *find_index_entry(stat_index_t *index, char *fname);
+void update_index_entry(stat_index_t *index, char *fname, struct stat *st, char *hexdigest);
+int index_entry_fresh(stat_index_t *index, index_entry_t *entry, struct stat *st);
+void index_digest(stat_index_t *index, char *fname, char *hexstring);
+void index_hash_files(stat_index_t *index, char **fnames, int count);
+void index_hash_manifest(stat_index_t *index, char *manifest, struct sparse_t *sparse);
@@ -0,0 +1,403 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "journal.h"
+
+// ======================================
+// .Journal format
+// ======================================
+// `WTF monitor <project>` watches the working tree with inotify and
+// appends the path of every file that changes to <project>/.Journal:
+//
+// <epoch>
+// <fname>
+// <fname>
+// ...
+//
+// The epoch names one run of the monitor. Clients remember an
+// (epoch, offset) cursor in their .Index; every tracked file not
+// logged after the cursor is known to be unchanged, so it doesn't
+// need to be stat-ed. A new epoch (monitor restart, lost events,
+// moved directories, or a full journal) sends clients back to
+// checking every file once.
+//
+// The monitor holds an exclusive flock on <project>/.Monitor for as
+// long as it runs; without it the journal is ignored.
+
+#define JOURNAL_READ_SIZE (64 * 1024)
+#define MONITOR_EVENTS (IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/**
+ * Whether a monitor holds the project's .Monitor lock.
+ */
+int monitor_running(char *project){
+    char *lock_path;
+    asprintf(&lock_path, "%s/.Monitor", project);
+    int fd = open(lock_path, O_RDONLY);
+    free(lock_path);
+    if (fd == -1)
+        return 0;
+    int running = flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+    close(fd);
+    return running;
+}
+
+void clean_journal(journal_t *journal){
+    int i;
+    for (i = 0; i < journal->count; i++)
+        free(journal->paths[i]);
+    free(journal->paths);
+    free(journal);
+}
+
+/**
+ * Reads the paths logged since the given cursor. Returns NULL if no
+ * monitor is running or it didn't catch up in time.
+ *
+ * Before reading, a cookie file is created in the project and the
+ * journal is read until the monitor logs it. inotify delivers events
+ * in order, so every change made before the call is in the journal
+ * by then. The returned offset is just past the cookie.
+ */
+journal_t *read_journal(char *project, char *epoch, long offset){
+    if (!monitor_running(project))
+        return NULL;
+
+    char *journal_path;
+    asprintf(&journal_path, "%s/.Journal", project);
+    int fd = open(journal_path, O_RDONLY);
+    free(journal_path);
+    if (fd == -1)
+        return NULL;
+
+    // first line is the epoch
+    char header[JOURNAL_EPOCH_MAX+2];
+    int header_size = pread(fd, header, sizeof(header) - 1, 0);
+    char *newline = header_size > 0 ? memchr(header, '\n', header_size) : NULL;
+    if (!newline){
+        close(fd);
+        return NULL;
+    }
+    *newline = '\0';
+
+    journal_t *journal = calloc(1, sizeof(journal_t));
+    strcpy(journal->epoch, header);
+    long start = newline + 1 - header;
+    journal->trusted = epoch && !strcmp(epoch, journal->epoch) && offset >= start;
+    if (journal->trusted)
+        start = offset;
+
+    char *cookie;
+    asprintf(&cookie, "%s/.Cookie.%d", project, getpid());
+    char *cookie_prefix;
+    asprintf(&cookie_prefix, "%s/.Cookie.", project);
+    close(open(cookie, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+    int max_count = 64;
+    journal->paths = malloc(max_count * sizeof(char *));
+    char *buf = malloc(JOURNAL_READ_SIZE);
+    int used = 0;
+    long pos = start;
+    int found = 0;
+    int waited = 0;
+    lseek(fd, start, SEEK_SET);
+    while (!found && waited < JOURNAL_SYNC_TIMEOUT_MS && used < JOURNAL_READ_SIZE){
+        int bytes_read = read(fd, buf + used, JOURNAL_READ_SIZE - used);
+        if (bytes_read <= 0){
+            usleep(1000);
+            waited++;
+            continue;
+        }
+        used += bytes_read;
+
+        // only whole lines; the monitor may be mid-write
+        char *line = buf;
+        char *end;
+        while (!found && (end = memchr(line, '\n', buf + used - line))){
+            *end = '\0';
+            if (!strcmp(line, cookie)){
+                found = 1;
+            } else if (journal->trusted && strncmp(line, cookie_prefix, strlen(cookie_prefix))){
+                if (journal->count >= max_count){
+                    max_count *= 2;
+                    journal->paths = realloc(journal->paths, max_count * sizeof(char *));
+                }
+                journal->paths[journal->count++] = strdup(line);
+            }
+            line = end + 1;
+        }
+        pos += line - buf;
+        used -= line - buf;
+        memmove(buf, line, used);
+    }
+    journal->offset = pos;
+
+    remove(cookie);
+    free(cookie);
+    free(cookie_prefix);
+    free(buf);
+    close(fd);
+
+    if (!found){
+        clean_journal(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+/****************************************************************
+ *  MONITOR
+ ***************************************************************/
+
+typedef struct monitor_t {
+    char *project;
+    int inotify_fd;
+    int journal_fd;
+    long journal_size;
+
+    // watched directory of each watch descriptor
+    char **watches;
+    int num_watches;
+
+    // last path logged, so a burst of writes is logged once
+    char *last;
+} monitor_t;
+
+static volatile sig_atomic_t monitor_stop = 0;
+
+static void stop_monitor(int sig){
+    monitor_stop = 1;
+}
+
+static void log_path(monitor_t *m, char *path){
+    if (m->last && !strcmp(m->last, path))
+        return;
+    free(m->last);
+    m->last = strdup(path);
+
+    char *line;
+    int len = asprintf(&line, "%s\n", path);
+    write(m->journal_fd, line, len);
+    m->journal_size += len;
+    free(line);
+}
+
+/**
+ * Watches a directory and everything below it. With log_files, the
+ * files found are logged too, since they may have been written
+ * before the watch existed.
+ */
+static void watch_directory(monitor_t *m, char *dir, int log_files){
+    int wd = inotify_add_watch(m->inotify_fd, dir, MONITOR_EVENTS | IN_ONLYDIR);
+    if (wd == -1)
+        return;
+    if (wd >= m->num_watches){
+        int num_watches = wd * 2 + 1;
+        m->watches = realloc(m->watches, num_watches * sizeof(char *));
+        memset(m->watches + m->num_watches, 0, (num_watches - m->num_watches) * sizeof(char *));
+        m->num_watches = num_watches;
+    }
+    free(m->watches[wd]);
+    m->watches[wd] = strdup(dir);
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d))){
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        char *path;
+        asprintf(&path, "%s/%s", dir, entry->d_name);
+
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN){
+            struct stat st = {0};
+            is_dir = lstat(path, &st) != -1 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+            watch_directory(m, path, log_files);
+        else if (log_files)
+            log_path(m, path);
+        free(path);
+    }
+    closedir(d);
+}
+
+/**
+ * (Re)builds every watch, then publishes an empty journal with a new
+ * epoch. Watches come first so nothing changes unseen after a client
+ * picks up the new epoch.
+ */
+static void start_journal(monitor_t *m){
+    int i;
+    for (i = 0; i < m->num_watches; i++){
+        if (m->watches[i]){
+            inotify_rm_watch(m->inotify_fd, i);
+            free(m->watches[i]);
+            m->watches[i] = NULL;
+        }
+    }
+    watch_directory(m, m->project, 0);
+
+    char epoch[JOURNAL_EPOCH_MAX+1];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(epoch, sizeof(epoch), "%d.%ld.%ld", getpid(), (long) ts.tv_sec, ts.tv_nsec);
+
+    char *journal_path;
+    char *tempfile;
+    asprintf(&journal_path, "%s/.Journal", m->project);
+    asprintf(&tempfile, "%s/.Journal.tmp", m->project);
+    int fd = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_line(fd, epoch);
+    close(fd);
+    rename(tempfile, journal_path);
+
+    if (m->journal_fd != -1)
+        close(m->journal_fd);
+    m->journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+    m->journal_size = strlen(epoch) + 1;
+    free(m->last);
+    m->last = NULL;
+
+    free(journal_path);
+    free(tempfile);
+}
+
+/**
+ * Bookkeeping files in the project root that are never tracked.
+ * Logging the journal's own writes would never end.
+ */
+static int untracked_file(char *name){
+    return !strcmp(name, ".Journal") || !strcmp(name, ".Journal.tmp") ||
+           !strcmp(name, ".Index") || !strcmp(name, ".Index.tmp") ||
+           !strcmp(name, ".Monitor");
+}
+
+/**
+ * Logs what one event changed. Returns whether the journal has
+ * to start over.
+ */
+static int handle_event(monitor_t *m, struct inotify_event *event){
+    if (event->mask & IN_Q_OVERFLOW)
+        return 1;
+    if (event->wd < 0 || event->wd >= m->num_watches || !m->watches[event->wd])
+        return 0;
+    if (event->mask & IN_IGNORED){
+        free(m->watches[event->wd]);
+        m->watches[event->wd] = NULL;
+        return 0;
+    }
+    if (!event->len)
+        return 0;
+
+    char *dir = m->watches[event->wd];
+    if (!strcmp(dir, m->project)){
+        if (untracked_file(event->name))
+            return 0;
+        // cookies only matter when they appear
+        if (!strncmp(event->name, ".Cookie.", strlen(".Cookie.")) && !(event->mask & IN_CREATE))
+            return 0;
+    }
+
+    char *path;
+    asprintf(&path, "%s/%s", dir, event->name);
+    int restart = 0;
+    if (event->mask & IN_ISDIR){
+        // watches below a moved directory have stale paths
+        if (event->mask & IN_MOVED_FROM)
+            restart = 1;
+        else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            watch_directory(m, path, 1);
+    } else {
+        log_path(m, path);
+    }
+    free(path);
+    return restart;
+}
+
+/**
+ * Keeps the project's .Journal until interrupted.
+ */
+void run_monitor(char *project){
+
+    // only one monitor per project
+    char *lock_path;
+    asprintf(&lock_path, "%s/.Monitor", project);
+    int lock_fd = open(lock_path, O_WRONLY | O_CREAT, 0644);
+    free(lock_path);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX | LOCK_NB) == -1){
+        puts("A monitor is already running for this project");
+        exit(EXIT_FAILURE);
+    }
+
+    monitor_t m = {0};
+    m.project = project;
+    m.journal_fd = -1;
+    m.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (m.inotify_fd == -1){
+        puts("Couldn't start watching the project");
+        exit(EXIT_FAILURE);
+    }
+    start_journal(&m);
+
+    // stop cleanly on ctrl-c or kill; no SA_RESTART so read returns
+    struct sigaction sa = {0};
+    sa.sa_handler = stop_monitor;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Monitoring %s\n", project);
+    fflush(stdout);
+
+    char *events = malloc(JOURNAL_READ_SIZE);
+    while (!monitor_stop){
+        int len = read(m.inotify_fd, events, JOURNAL_READ_SIZE);
+        if (len <= 0){
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        int restart = 0;
+        char *p = events;
+        while (p < events + len){
+            struct inotify_event *event = (struct inotify_event *) p;
+            restart |= handle_event(&m, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (restart || m.journal_size > JOURNAL_MAX_SIZE)
+            start_journal(&m);
+    }
+    free(events);
+
+    // nobody may trust the journal once the monitor is gone
+    char *journal_path;
+    asprintf(&journal_path, "%s/.Journal", project);
+    remove(journal_path);
+    free(journal_path);
+
+    int i;
+    for (i = 0; i < m.num_watches; i++)
+        free(m.watches[i]);
+    free(m.watches);
+    free(m.last);
+    close(m.journal_fd);
+    close(m.inotify_fd);
+    close(lock_fd);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "helpers.h"
+
+// monitor start id written as the first line of a .Journal
+#define JOURNAL_EPOCH_MAX 64
+
+// the monitor starts a fresh journal past this size
+#define JOURNAL_MAX_SIZE (64 * 1024 * 1024)
+
+// how long a client waits for the monitor to catch up
+#define JOURNAL_SYNC_TIMEOUT_MS 1000
+
+/**
+ * Paths the monitor saw change since a cursor (epoch + offset)
+ * into the project's .Journal.
+ */
+typedef struct journal_t {
+    char epoch[JOURNAL_EPOCH_MAX+1];
+    long offset;
+
+    // paths cover every change since the cursor that was asked for;
+    // otherwise the journal only provides a new cursor
+    int trusted;
+
+    char **paths;
+    int count;
+} journal_t;
+
+int monitor_running(char *project);
+journal_t *read_journal(char *project, char *epoch, long offset);
+void clean_journal(journal_t *journal);
+void run_monitor(char *project);
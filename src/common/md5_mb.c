@@ -0,0 +1,253 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <immintrin.h>
+#include <openssl/md5.h>
+
+#include "md5_mb.h"
+
+// ======================================
+// Multi-buffer MD5
+// ======================================
+// MD5 is a serial chain within one message, so a single small file
+// can't use SIMD. Eight independent messages can: lane i of every
+// AVX2 register holds the state of message i, and each block step
+// runs the 64 MD5 rounds for all eight at once. Lanes whose message
+// has no more blocks keep their state while the others finish.
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+/**
+ * Whether this CPU can run the AVX2 lanes.
+ */
+int md5_mb_supported(){
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+/**
+ * Builds the padded final block(s) of a message into tail (128 bytes)
+ * and returns how many of them there are (1 or 2).
+ */
+static int md5_pad_tail(unsigned char *data, size_t len, unsigned char *tail){
+    size_t full = len / 64 * 64;
+    size_t rest = len - full;
+
+    memset(tail, 0, 128);
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+
+    int blocks = rest + 1 + 8 <= 64 ? 1 : 2;
+    uint64_t bits = (uint64_t) len * 8;
+    memcpy(tail + blocks * 64 - 8, &bits, 8);
+    return blocks;
+}
+
+#define MD5_ROTL(x, r) _mm256_or_si256(_mm256_slli_epi32((x), (r)), _mm256_srli_epi32((x), 32 - (r)))
+#define MD5_ADD(x, y)  _mm256_add_epi32((x), (y))
+
+#define MD5_F(b, c, d) _mm256_xor_si256((d), _mm256_and_si256((b), _mm256_xor_si256((c), (d))))
+#define MD5_G(b, c, d) _mm256_xor_si256((c), _mm256_and_si256((d), _mm256_xor_si256((b), (c))))
+#define MD5_H(b, c, d) _mm256_xor_si256((b), _mm256_xor_si256((c), (d)))
+#define MD5_I(b, c, d) _mm256_xor_si256((c), _mm256_or_si256((b), _mm256_xor_si256((d), _mm256_set1_epi32(-1))))
+
+// a = b + ((a + F(b, c, d) + w[g] + k[i]) <<< r[i])
+#define MD5_STEP(F, a, b, c, d, w, g, i) \
+    a = MD5_ADD(b, MD5_ROTL(MD5_ADD(MD5_ADD(MD5_ADD(a, F(b, c, d)), w[g]), \
+                                     _mm256_set1_epi32(md5_k[i])), md5_r[i]))
+
+#define MD5_ROUND(F, a, b, c, d, w, i, g0, g1, g2, g3) \
+    MD5_STEP(F, a, b, c, d, w, g0, i);     \
+    MD5_STEP(F, d, a, b, c, w, g1, i + 1); \
+    MD5_STEP(F, c, d, a, b, w, g2, i + 2); \
+    MD5_STEP(F, b, c, d, a, w, g3, i + 3)
+
+#define MD5_ROUND1(a, b, c, d, w)                       \
+    MD5_ROUND(MD5_F, a, b, c, d, w,  0,  0,  1,  2,  3); \
+    MD5_ROUND(MD5_F, a, b, c, d, w,  4,  4,  5,  6,  7); \
+    MD5_ROUND(MD5_F, a, b, c, d, w,  8,  8,  9, 10, 11); \
+    MD5_ROUND(MD5_F, a, b, c, d, w, 12, 12, 13, 14, 15)
+
+#define MD5_ROUND2(a, b, c, d, w)                       \
+    MD5_ROUND(MD5_G, a, b, c, d, w, 16,  1,  6, 11,  0); \
+    MD5_ROUND(MD5_G, a, b, c, d, w, 20,  5, 10, 15,  4); \
+    MD5_ROUND(MD5_G, a, b, c, d, w, 24,  9, 14,  3,  8); \
+    MD5_ROUND(MD5_G, a, b, c, d, w, 28, 13,  2,  7, 12)
+
+#define MD5_ROUND3(a, b, c, d, w)                       \
+    MD5_ROUND(MD5_H, a, b, c, d, w, 32,  5,  8, 11, 14); \
+    MD5_ROUND(MD5_H, a, b, c, d, w, 36,  1,  4,  7, 10); \
+    MD5_ROUND(MD5_H, a, b, c, d, w, 40, 13,  0,  3,  6); \
+    MD5_ROUND(MD5_H, a, b, c, d, w, 44,  9, 12, 15,  2)
+
+#define MD5_ROUND4(a, b, c, d, w)                       \
+    MD5_ROUND(MD5_I, a, b, c, d, w, 48,  0,  7, 14,  5); \
+    MD5_ROUND(MD5_I, a, b, c, d, w, 52, 12,  3, 10,  1); \
+    MD5_ROUND(MD5_I, a, b, c, d, w, 56,  8, 15,  6, 13); \
+    MD5_ROUND(MD5_I, a, b, c, d, w, 60,  4, 11,  2,  9)
+
+/**
+ * Loads words first..first+7 of every lane's block and transposes them,
+ * so w[i] holds word first+i of all eight lanes.
+ */
+__attribute__((target("avx2")))
+static void md5_mb_transpose(uint32_t **src, int first, __m256i *w){
+    __m256i r[MD5_MB_LANES];
+    int lane;
+    for (lane = 0; lane < MD5_MB_LANES; lane++)
+        r[lane] = _mm256_loadu_si256((__m256i *) (src[lane] + first));
+
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    w[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    w[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    w[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    w[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    w[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    w[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    w[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    w[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2")))
+static void md5_mb_avx2_group(unsigned char **data, size_t *lens, int count, unsigned char (*out)[16]){
+    unsigned char tails[MD5_MB_LANES][128];
+    long full_blocks[MD5_MB_LANES] = {0};
+    long total_blocks[MD5_MB_LANES] = {0};
+    long max_blocks = 0;
+
+    int lane;
+    for (lane = 0; lane < count; lane++){
+        full_blocks[lane] = lens[lane] / 64;
+        total_blocks[lane] = full_blocks[lane] + md5_pad_tail(data[lane], lens[lane], tails[lane]);
+        if (total_blocks[lane] > max_blocks)
+            max_blocks = total_blocks[lane];
+    }
+
+    __m256i a = _mm256_set1_epi32(0x67452301);
+    __m256i b = _mm256_set1_epi32(0xefcdab89);
+    __m256i c = _mm256_set1_epi32(0x98badcfe);
+    __m256i d = _mm256_set1_epi32(0x10325476);
+
+    long block;
+    for (block = 0; block < max_blocks; block++){
+        // where each lane reads this block from
+        uint32_t *src[MD5_MB_LANES];
+        int active[MD5_MB_LANES];
+        for (lane = 0; lane < MD5_MB_LANES; lane++){
+            active[lane] = lane < count && block < total_blocks[lane];
+            if (!active[lane])
+                src[lane] = (uint32_t *) tails[0];
+            else if (block < full_blocks[lane])
+                src[lane] = (uint32_t *) (data[lane] + block * 64);
+            else
+                src[lane] = (uint32_t *) (tails[lane] + (block - full_blocks[lane]) * 64);
+        }
+
+        __m256i w[16];
+        md5_mb_transpose(src, 0, w);
+        md5_mb_transpose(src, 8, w + 8);
+
+        __m256i aa = a, bb = b, cc = c, dd = d;
+        MD5_ROUND1(aa, bb, cc, dd, w);
+        MD5_ROUND2(aa, bb, cc, dd, w);
+        MD5_ROUND3(aa, bb, cc, dd, w);
+        MD5_ROUND4(aa, bb, cc, dd, w);
+
+        // only lanes that had this block take the new state
+        __m256i mask = _mm256_setr_epi32(
+            -active[0], -active[1], -active[2], -active[3],
+            -active[4], -active[5], -active[6], -active[7]);
+        a = _mm256_blendv_epi8(a, _mm256_add_epi32(a, aa), mask);
+        b = _mm256_blendv_epi8(b, _mm256_add_epi32(b, bb), mask);
+        c = _mm256_blendv_epi8(c, _mm256_add_epi32(c, cc), mask);
+        d = _mm256_blendv_epi8(d, _mm256_add_epi32(d, dd), mask);
+    }
+
+    uint32_t sa[MD5_MB_LANES], sb[MD5_MB_LANES], sc[MD5_MB_LANES], sd[MD5_MB_LANES];
+    _mm256_storeu_si256((__m256i *) sa, a);
+    _mm256_storeu_si256((__m256i *) sb, b);
+    _mm256_storeu_si256((__m256i *) sc, c);
+    _mm256_storeu_si256((__m256i *) sd, d);
+    for (lane = 0; lane < count; lane++){
+        memcpy(out[lane], &sa[lane], 4);
+        memcpy(out[lane] + 4, &sb[lane], 4);
+        memcpy(out[lane] + 8, &sc[lane], 4);
+        memcpy(out[lane] + 12, &sd[lane], 4);
+    }
+}
+
+/**
+ * Hashes count buffers one at a time.
+ */
+void md5_mb_scalar(unsigned char **data, size_t *lens, int count, char (*hexdigests)[HEXDIGEST_MAX+1]){
+    int i;
+    for (i = 0; i < count; i++){
+        unsigned char out[MD5_DIGEST_LENGTH];
+        MD5(data[i], lens[i], out);
+        hexlify(out, MD5_DIGEST_LENGTH, hexdigests[i]);
+    }
+}
+
+/**
+ * Hashes count buffers, eight at a time on CPUs with AVX2.
+ * Buffers of very different lengths waste lanes, so callers
+ * should group buffers of similar size.
+ */
+void md5_mb(unsigned char **data, size_t *lens, int count, char (*hexdigests)[HEXDIGEST_MAX+1]){
+    static int supported = -1;
+    if (supported == -1)
+        supported = md5_mb_supported();
+    if (!supported){
+        md5_mb_scalar(data, lens, count, hexdigests);
+        return;
+    }
+
+    int first;
+    for (first = 0; first < count; first += MD5_MB_LANES){
+        int lanes = count - first < MD5_MB_LANES ? count - first : MD5_MB_LANES;
+        unsigned char out[MD5_MB_LANES][16];
+        md5_mb_avx2_group(data + first, lens + first, lanes, out);
+
+        int lane;
+        for (lane = 0; lane < lanes; lane++)
+            hexlify(out[lane], 16, hexdigests[first + lane]);
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "helpers.h"
+
+// number of buffers hashed side by side by one AVX2 pass
+#define MD5_MB_LANES 8
+
+// files up to this size are read whole and hashed in lanes
+#define MD5_MB_MAX_SIZE (16 * 1024)
+
+int md5_mb_supported();
+void md5_mb(unsigned char **data, size_t *lens, int count, char (*hexdigests)[HEXDIGEST_MAX+1]);
+void md5_mb_scalar(unsigned char **data, size_t *lens, int count, char (*hexdigests)[HEXDIGEST_MAX+1]);
@@ -0,0 +1,467 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/md5.h>
+
+#include "merkle.h"
+
+/**********************************************************************************
+                                  TREE CONSTRUCTION
+***********************************************************************************/
+
+static int compare_manifest_lines(const void *a, const void *b){
+    manifest_line_t *ml_a = *((manifest_line_t **) a);
+    manifest_line_t *ml_b = *((manifest_line_t **) b);
+    return strcmp(ml_a->fname, ml_b->fname);
+}
+
+static merkle_node_t *new_merkle_node(char *path, int is_dir){
+    merkle_node_t *node = calloc(1, sizeof(merkle_node_t));
+    node->path = strdup(path);
+    node->is_dir = is_dir;
+
+    // name points into path after the last slash
+    char *slash = strrchr(node->path, '/');
+    node->name = slash ? slash + 1 : node->path;
+    return node;
+}
+
+static void append_merkle_child(merkle_node_t *parent, merkle_node_t *child){
+    if (!parent->children)
+        parent->children = child;
+    else
+        parent->last_child->next = child;
+    parent->last_child = child;
+}
+
+/**
+ * Computes the hash of every node below (and including) the given node.
+ * Leaves hash "<digest> <version> <fname>". Directories hash one
+ * "<name> <d|f> <hash>" line per child, in tree order.
+ */
+static void hash_merkle_node(merkle_node_t *node){
+    if (!node->is_dir){
+        char *buf;
+        int len = asprintf(&buf, "%s %d %s",
+                           node->ml->hexdigest, node->ml->version, node->ml->fname);
+        md5sum_buf(buf, len, node->hexdigest);
+        free(buf);
+        return;
+    }
+
+    MD5_CTX c;
+    unsigned char out[MD5_DIGEST_LENGTH];
+    MD5_Init(&c);
+
+    merkle_node_t *child;
+    for (child = node->children; child; child = child->next){
+        hash_merkle_node(child);
+
+        char *buf;
+        int len = asprintf(&buf, "%s %c %s\n",
+                           child->name, child->is_dir ? 'd' : 'f', child->hexdigest);
+        MD5_Update(&c, buf, len);
+        free(buf);
+    }
+    MD5_Final(out, &c);
+    hexlify(out, MD5_DIGEST_LENGTH, node->hexdigest);
+}
+
+/**
+ * Lines are sorted by filename first: every path sharing a directory
+ * prefix is then contiguous, so the tree is built with a single pass
+ * over a stack of open directories.
+ */
+static merkle_node_t *parse_merkle_tree(char *manifest, int skip_added){
+
+    // read all file lines of the manifest
+    int line_count = 0;
+    int max_line_count = 64;
+    manifest_line_t **lines = malloc(max_line_count * sizeof(manifest_line_t *));
+
+    file_buf_t *info = init_file_buf(manifest);
+    if (info->fd != -1){
+        // skip first line of manifest
+        read_file_until(info, '\n');
+        while (1){
+            read_file_until(info, '\n');
+            if (info->file_eof)
+                break;
+            manifest_line_t *ml = parse_manifest_line(info->data);
+            if (skip_added && ml->code == 'A'){
+                clean_manifest_line(ml);
+                continue;
+            }
+            if (line_count >= max_line_count){
+                max_line_count *= 2;
+                lines = realloc(lines, max_line_count * sizeof(manifest_line_t *));
+            }
+            lines[line_count++] = ml;
+        }
+    }
+    clean_file_buf(info);
+    qsort(lines, line_count, sizeof(manifest_line_t *), compare_manifest_lines);
+
+    // stack of currently open directories, root at depth 0
+    int max_depth = 16;
+    merkle_node_t **stack = malloc(max_depth * sizeof(merkle_node_t *));
+    merkle_node_t *root = new_merkle_node("", 1);
+    stack[0] = root;
+    int depth = 0;
+
+    int i;
+    for (i = 0; i < line_count; i++){
+        char *fname = lines[i]->fname;
+        char *start = fname;
+        char *slash;
+        int level = 0;
+
+        // walk the directory components, reusing open ones
+        while ((slash = strchr(start, '/'))){
+            level++;
+            int name_len = slash - start;
+            if (level <= depth &&
+                    strlen(stack[level]->name) == name_len &&
+                    !strncmp(stack[level]->name, start, name_len)){
+                start = slash + 1;
+                continue;
+            }
+
+            // close the directories below and open a new one
+            *slash = '\0';
+            merkle_node_t *dir = new_merkle_node(fname, 1);
+            *slash = '/';
+            append_merkle_child(stack[level-1], dir);
+
+            if (level >= max_depth){
+                max_depth *= 2;
+                stack = realloc(stack, max_depth * sizeof(merkle_node_t *));
+            }
+            stack[level] = dir;
+            depth = level;
+            start = slash + 1;
+        }
+        depth = level;
+
+        merkle_node_t *leaf = new_merkle_node(fname, 0);
+        leaf->ml = lines[i];
+        append_merkle_child(stack[depth], leaf);
+    }
+    hash_merkle_node(root);
+
+    free(stack);
+    free(lines);
+    return root;
+}
+
+/**
+ * Frees a tree and the manifest lines held by its leaves.
+ */
+void clean_merkle_tree(merkle_node_t *node){
+    while (node){
+        merkle_node_t *next = node->next;
+        clean_merkle_tree(node->children);
+        if (node->ml)
+            clean_manifest_line(node->ml);
+        free(node->path);
+        free(node);
+        node = next;
+    }
+}
+
+// ======================================
+// Warm trees
+// ======================================
+// Trees the client agent built ahead of time. Its forked command
+// processes inherit them and take one instead of parsing the manifest
+// again, as long as the manifest hasn't changed since.
+
+typedef struct warm_tree_t {
+    char *manifest;
+    int skip_added;
+    file_version_t version;
+    merkle_node_t *root;
+
+    struct warm_tree_t *next;
+} warm_tree_t;
+
+static warm_tree_t *warm_trees = NULL;
+
+static merkle_node_t *take_warm_tree(char *manifest, int skip_added){
+    warm_tree_t **link = &warm_trees;
+    while (*link && (strcmp((*link)->manifest, manifest) || (*link)->skip_added != skip_added))
+        link = &(*link)->next;
+    if (!*link)
+        return NULL;
+
+    warm_tree_t *warm = *link;
+    *link = warm->next;
+    merkle_node_t *root = warm->root;
+    if (!file_version_current(manifest, &warm->version)){
+        clean_merkle_tree(root);
+        root = NULL;
+    }
+    free(warm->manifest);
+    free(warm);
+    return root;
+}
+
+/**
+ * Builds a tree of a manifest and keeps it for a later build_merkle_tree.
+ */
+void warm_merkle_tree(char *manifest, int skip_added){
+    merkle_node_t *old = take_warm_tree(manifest, skip_added);
+    if (old)
+        clean_merkle_tree(old);
+
+    warm_tree_t *warm = calloc(1, sizeof(warm_tree_t));
+    if (!get_file_version(manifest, &warm->version)){
+        free(warm);
+        return;
+    }
+    warm->manifest = strdup(manifest);
+    warm->skip_added = skip_added;
+    warm->root = parse_merkle_tree(manifest, skip_added);
+    warm->next = warm_trees;
+    warm_trees = warm;
+}
+
+/**
+ * Builds a hash tree from the file lines of a manifest. Files marked
+ * "A" are skipped if skip_added is set, which gives the client's view
+ * of what the server had at its last sync.
+ *
+ * The returned tree must be passed to clean_merkle_tree.
+ */
+merkle_node_t *build_merkle_tree(char *manifest, int skip_added){
+    merkle_node_t *root = take_warm_tree(manifest, skip_added);
+    return root ? root : parse_merkle_tree(manifest, skip_added);
+}
+
+/**
+ * Finds the node with the given path ("" is the root).
+ * Returns NULL if there is no such node.
+ */
+merkle_node_t *find_merkle_node(merkle_node_t *root, char *path){
+    merkle_node_t *cur = root;
+    while (cur && strcmp(cur->path, path)){
+        merkle_node_t *child = cur->children;
+        while (child){
+            int len = strlen(child->path);
+            if (!strncmp(child->path, path, len) && (path[len] == '\0' || path[len] == '/'))
+                break;
+            child = child->next;
+        }
+        cur = child;
+    }
+    return cur;
+}
+
+/**********************************************************************************
+                                  TREE COMPARISON
+***********************************************************************************/
+
+// ======================================
+// Tree comparison protocol
+// ======================================
+// 1. server sends the first line of its manifest
+// 2. client sends a request file with one "<hash> <path>" line per
+//    directory it wants to compare, starting with the root
+// 3. server answers each request line with either
+//        "= <path>"                   if the hashes match, or one line
+//        "d <hash> <path>"            per child directory and
+//        "f <hash> <manifest line>"   per child file
+// 4. client copies its own lines for every matching subtree and asks
+//    again for differing child directories; an empty request ends it
+
+/**
+ * Writes the response line for a single node.
+ */
+static void write_merkle_entry(int fd, merkle_node_t *node){
+    char *entry;
+    if (node->is_dir){
+        asprintf(&entry, "d %s %s\n", node->hexdigest, node->path);
+    } else {
+        manifest_line_t *ml = node->ml;
+        asprintf(&entry, "f %s %c %s %d %s\n",
+                 node->hexdigest, ml->code, ml->hexdigest, ml->version, ml->fname);
+    }
+    write(fd, entry, strlen(entry));
+    free(entry);
+}
+
+/**
+ * Writes every file below the given node as a manifest line.
+ */
+static void write_merkle_leaves(int fd, merkle_node_t *node){
+    if (!node->is_dir){
+        char *line = generate_manifest_line(
+            '-', node->ml->hexdigest, node->ml->version, node->ml->fname);
+        write(fd, line, strlen(line));
+        free(line);
+        return;
+    }
+
+    merkle_node_t *child;
+    for (child = node->children; child; child = child->next)
+        write_merkle_leaves(fd, child);
+}
+
+/**
+ * Server side of the tree comparison. Only the children of
+ * directories whose hashes differ from the client's are sent.
+ */
+void send_merkle_diff(int sock, merkle_node_t *root, char *manifest){
+
+    // send manifest header
+    file_buf_t *info = init_file_buf(manifest);
+    read_file_until(info, '\n');
+    send_line(sock, info->data);
+    clean_file_buf(info);
+
+    while (1){
+        // receive next batch of directories to compare
+        char request[15+1];
+        gen_temp_filename(request);
+        recv_file(sock, request);
+
+        struct stat st = {0};
+        stat(request, &st);
+        if (st.st_size == 0){
+            remove(request);
+            break;
+        }
+
+        char response[15+1];
+        gen_temp_filename(response);
+        int fout = open(response, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        info = init_file_buf(request);
+        while (1){
+            read_file_until(info, '\n');
+            if (info->file_eof)
+                break;
+
+            // split "<hash> <path>"
+            char *path = strchr(info->data, ' ');
+            if (!path)
+                continue;
+            *path++ = '\0';
+
+            merkle_node_t *node = find_merkle_node(root, path);
+            if (!node)
+                continue;
+
+            if (!strcmp(node->hexdigest, info->data)){
+                char *same;
+                asprintf(&same, "= %s\n", path);
+                write(fout, same, strlen(same));
+                free(same);
+            } else if (!node->is_dir){
+                write_merkle_entry(fout, node);
+            } else {
+                merkle_node_t *child;
+                for (child = node->children; child; child = child->next)
+                    write_merkle_entry(fout, child);
+            }
+        }
+        clean_file_buf(info);
+        close(fout);
+
+        send_file(response, sock, 0);
+        remove(response);
+        remove(request);
+    }
+}
+
+/**
+ * Appends a "<hash> <path>" request line for the given path.
+ */
+static void write_merkle_request(int fd, merkle_node_t *node, char *path){
+    char *req;
+    asprintf(&req, "%s %s\n", node ? node->hexdigest : "-", path);
+    write(fd, req, strlen(req));
+    free(req);
+}
+
+/**
+ * Client side of the tree comparison. Rebuilds the server's manifest
+ * into dest from the subtrees the server sent and the client's own
+ * lines for every subtree that matched.
+ */
+void recv_merkle_diff(int sock, char *client_manifest, char *dest){
+
+    // client's view of the server manifest at its last sync
+    merkle_node_t *root = build_merkle_tree(client_manifest, 1);
+
+    int fout = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *header = recv_line(sock);
+    write_line(fout, header);
+    free(header);
+
+    // first request is the root itself
+    char request[15+1];
+    gen_temp_filename(request);
+    int freq = open(request, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_merkle_request(freq, root, "");
+    close(freq);
+
+    while (1){
+        struct stat st = {0};
+        stat(request, &st);
+        send_file(request, sock, 0);
+        if (st.st_size == 0)
+            break;
+
+        char response[15+1];
+        gen_temp_filename(response);
+        recv_file(sock, response);
+
+        freq = open(request, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        file_buf_t *info = init_file_buf(response);
+        while (1){
+            read_file_until(info, '\n');
+            if (info->file_eof)
+                break;
+
+            char type = info->data[0];
+            if (type == '='){
+                merkle_node_t *node = find_merkle_node(root, info->data + 2);
+                if (node)
+                    write_merkle_leaves(fout, node);
+                continue;
+            }
+
+            // split "<type> <hash> <rest>"
+            char *hash = info->data + 2;
+            char *rest = strchr(hash, ' ');
+            if (!rest)
+                continue;
+            *rest++ = '\0';
+
+            if (type == 'f'){
+                write_line(fout, rest);
+            } else if (type == 'd'){
+                merkle_node_t *node = find_merkle_node(root, rest);
+                if (node && node->is_dir && !strcmp(node->hexdigest, hash))
+                    write_merkle_leaves(fout, node);
+                else
+                    write_merkle_request(freq, node && node->is_dir ? node : NULL, rest);
+            }
+        }
+        clean_file_buf(info);
+        close(freq);
+        remove(response);
+    }
+
+    remove(request);
+    close(fout);
+    clean_merkle_tree(root);
+}
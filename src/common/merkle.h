@@ -0,0 +1,32 @@
+#pragma once
+
+#include "helpers.h"
+
+/**
+ * Directory-structured hash tree over the lines of a .Manifest.
+ *
+ * Every file line becomes a leaf whose hash covers its digest, version
+ * and filename. Every directory node hashes the (name, type, hash) of
+ * its children, so two manifests with equal root hashes list exactly
+ * the same files, and a differing subtree can be found top-down
+ * without looking at any of the equal ones.
+ */
+typedef struct merkle_node_t {
+    char *name;
+    char *path;
+    int  is_dir;
+    char hexdigest[32+1];
+    manifest_line_t *ml;
+
+    struct merkle_node_t *children;
+    struct merkle_node_t *last_child;
+    struct merkle_node_t *next;
+} merkle_node_t;
+
+merkle_node_t *build_merkle_tree(char *manifest, int skip_added);
+void warm_merkle_tree(char *manifest, int skip_added);
+void clean_merkle_tree(merkle_node_t *node);
+merkle_node_t *find_merkle_node(merkle_node_t *root, char *path);
+
+void send_merkle_diff(int sock, merkle_node_t *root, char *manifest);
+void recv_merkle_diff(int sock, char *client_manifest, char *dest);
@@ -0,0 +1,187 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sparse.h"
+
+/**
+ * Turns a pattern into the path prefix it covers:
+ * "./dir/..." and "dir/" both become "dir".
+ */
+static char *sparse_prefix(char *pattern){
+    while (!strncmp(pattern, "./", 2))
+        pattern += 2;
+    char *prefix = strdup(pattern);
+    int len = strlen(prefix);
+    if (len >= 3 && !strcmp(prefix + len - 3, "..."))
+        prefix[len -= 3] = '\0';
+    while (len > 0 && prefix[len-1] == '/')
+        prefix[--len] = '\0';
+    return prefix;
+}
+
+/**
+ * Limits a project to the given patterns. Returns NULL, meaning the
+ * whole project, if there are none or one of them covers everything.
+ */
+sparse_t *init_sparse(char *project, char **patterns, int count){
+    if (count <= 0)
+        return NULL;
+
+    sparse_t *sparse = malloc(sizeof(sparse_t));
+    sparse->project = strdup(project);
+    sparse->prefixes = malloc(count * sizeof(char *));
+    sparse->count = 0;
+    int i;
+    for (i = 0; i < count; i++){
+        char *prefix = sparse_prefix(patterns[i]);
+        if (!*prefix){
+            free(prefix);
+            clean_sparse(sparse);
+            return NULL;
+        }
+        sparse->prefixes[sparse->count++] = prefix;
+    }
+    return sparse;
+}
+
+/**
+ * Reads the project's .Sparse. Returns NULL if it has none.
+ */
+sparse_t *load_sparse(char *project){
+    char *path;
+    asprintf(&path, "%s/%s", project, SPARSE_FILE);
+    if (access(path, F_OK) == -1){
+        free(path);
+        return NULL;
+    }
+
+    int count = 0;
+    int max_count = 8;
+    char **patterns = malloc(max_count * sizeof(char *));
+    file_buf_t *info = init_file_buf(path);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        if (!*info->data)
+            continue;
+        if (count >= max_count){
+            max_count *= 2;
+            patterns = realloc(patterns, max_count * sizeof(char *));
+        }
+        patterns[count++] = strdup(info->data);
+    }
+    clean_file_buf(info);
+    free(path);
+
+    sparse_t *sparse = init_sparse(project, patterns, count);
+    int i;
+    for (i = 0; i < count; i++)
+        free(patterns[i]);
+    free(patterns);
+    return sparse;
+}
+
+/**
+ * Writes the patterns to the project's .Sparse, as "<prefix>/..." lines.
+ */
+void save_sparse(sparse_t *sparse){
+    if (!sparse)
+        return;
+    char *path;
+    asprintf(&path, "%s/%s", sparse->project, SPARSE_FILE);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int i;
+    for (i = 0; i < sparse->count; i++){
+        char *line;
+        asprintf(&line, "%s/...", sparse->prefixes[i]);
+        write_line(fd, line);
+        free(line);
+    }
+    close(fd);
+    free(path);
+}
+
+void clean_sparse(sparse_t *sparse){
+    if (!sparse)
+        return;
+    int i;
+    for (i = 0; i < sparse->count; i++)
+        free(sparse->prefixes[i]);
+    free(sparse->prefixes);
+    free(sparse->project);
+    free(sparse);
+}
+
+/**
+ * Whether a manifest path ("<project>/<path>") is part of the
+ * checkout. Everything is when sparse is NULL.
+ */
+int sparse_match(sparse_t *sparse, char *fname){
+    if (!sparse)
+        return 1;
+
+    int project_len = strlen(sparse->project);
+    if (strncmp(fname, sparse->project, project_len) || fname[project_len] != '/')
+        return 0;
+    char *path = fname + project_len + 1;
+
+    int i;
+    for (i = 0; i < sparse->count; i++){
+        int len = strlen(sparse->prefixes[i]);
+        if (!strncmp(path, sparse->prefixes[i], len) && (path[len] == '\0' || path[len] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Sends the pattern count and then each prefix; 0 for the whole project.
+ */
+void send_sparse(int sock, sparse_t *sparse){
+    send_int(sock, sparse ? sparse->count : 0);
+    int i;
+    for (i = 0; sparse && i < sparse->count; i++)
+        send_line(sock, sparse->prefixes[i]);
+}
+
+sparse_t *recv_sparse(int sock, char *project){
+    int count = recv_int(sock);
+    char **patterns = malloc((count > 0 ? count : 1) * sizeof(char *));
+    int i;
+    for (i = 0; i < count; i++)
+        patterns[i] = recv_line(sock);
+
+    sparse_t *sparse = init_sparse(project, patterns, count);
+    for (i = 0; i < count; i++)
+        free(patterns[i]);
+    free(patterns);
+    return sparse;
+}
+
+/**
+ * Copies the lines of a manifest-format listing (.Update, .Commit)
+ * that are part of the checkout to dest.
+ */
+void filter_sparse_listing(sparse_t *sparse, char *listing, char *dest){
+    file_buf_t *info = init_file_buf(listing);
+    int fout = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (sparse_match(sparse, ml->fname))
+            write_line(fout, info->data);
+        clean_manifest_line(ml);
+    }
+    close(fout);
+    clean_file_buf(info);
+}
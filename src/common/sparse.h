@@ -0,0 +1,28 @@
+#pragma once
+
+#include "helpers.h"
+
+// patterns of a sparse checkout, one per line, kept next to the .Manifest
+#define SPARSE_FILE ".Sparse"
+
+/**
+ * Paths a sparse checkout is limited to. Patterns are relative to the
+ * project: "dir/..." (or "dir", "dir/") covers everything below dir and
+ * a file path covers just that file. Manifest entries outside them are
+ * never transferred, hashed or compared, but stay in the .Manifest so
+ * versions keep matching the server's.
+ */
+typedef struct sparse_t {
+    char *project;
+    char **prefixes;
+    int count;
+} sparse_t;
+
+sparse_t *init_sparse(char *project, char **patterns, int count);
+sparse_t *load_sparse(char *project);
+void save_sparse(sparse_t *sparse);
+void clean_sparse(sparse_t *sparse);
+int sparse_match(sparse_t *sparse, char *fname);
+void send_sparse(int sock, sparse_t *sparse);
+sparse_t *recv_sparse(int sock, char *project);
+void filter_sparse_listing(sparse_t *sparse, char *listing, char *dest);
@@ -0,0 +1,284 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "sync.h"
+#include "history.h"
+
+/**********************************************************************************
+                                  DELTA HELPERS
+***********************************************************************************/
+
+typedef struct delta_entry_t {
+    manifest_line_t *ml;
+    int seq;
+} delta_entry_t;
+
+/**
+ * Orders entries by filename, then by the order they were read in.
+ */
+static int compare_delta_entries(const void *a, const void *b){
+    delta_entry_t *da = (delta_entry_t *) a;
+    delta_entry_t *db = (delta_entry_t *) b;
+    int cmp = strcmp(da->ml->fname, db->ml->fname);
+    return cmp ? cmp : da->seq - db->seq;
+}
+
+/**
+ * Reads every line of a file as a manifest line into a growable array.
+ * If skip_header is set, the first line is ignored.
+ */
+static void read_delta_entries(char *fname, int skip_header, int skip_added,
+                               delta_entry_t **entries, int *count, int *max_count){
+    file_buf_t *info = init_file_buf(fname);
+    if (info->fd == -1){
+        clean_file_buf(info);
+        return;
+    }
+    if (skip_header)
+        read_file_until(info, '\n');
+    while (1){
+        read_file_until(info, '\n');
+        if (info->file_eof)
+            break;
+        manifest_line_t *ml = parse_manifest_line(info->data);
+        if (skip_added && ml->code == 'A'){
+            clean_manifest_line(ml);
+            continue;
+        }
+        if (*count >= *max_count){
+            *max_count *= 2;
+            *entries = realloc(*entries, *max_count * sizeof(delta_entry_t));
+        }
+        (*entries)[*count].ml = ml;
+        (*entries)[*count].seq = *count;
+        (*count)++;
+    }
+    clean_file_buf(info);
+}
+
+/**
+ * Collapses the .Commit records that took a project from from_version to
+ * to_version into one delta with a single line per changed file:
+ *     "- <digest> <version> <fname>" if the file exists at to_version
+ *     "D <digest> <version> <fname>" if it was deleted
+ *
+ * Returns the name of the delta file, or NULL if the history doesn't
+ * cover the range. The returned pointer must be freed.
+ */
+char *generate_manifest_delta(char *project, int from_version, int to_version){
+    if (from_version < 0 || from_version > to_version)
+        return NULL;
+
+    // gather every commit line in version order
+    char commits[15+1];
+    gen_temp_filename(commits);
+    if (!read_history(project, from_version + 1, to_version, commits)){
+        remove(commits);
+        return NULL;
+    }
+
+    int count = 0;
+    int max_count = 64;
+    delta_entry_t *entries = malloc(max_count * sizeof(delta_entry_t));
+    read_delta_entries(commits, 0, 0, &entries, &count, &max_count);
+    remove(commits);
+
+    // the last change to each file wins
+    qsort(entries, count, sizeof(delta_entry_t), compare_delta_entries);
+
+    char tempfile[15+1];
+    gen_temp_filename(tempfile);
+    int fout = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int i;
+    for (i = 0; i < count; i++){
+        manifest_line_t *ml = entries[i].ml;
+        if (i + 1 == count || strcmp(ml->fname, entries[i+1].ml->fname)){
+            char *line = generate_manifest_line(
+                ml->code == 'D' ? 'D' : '-', ml->hexdigest, ml->version, ml->fname);
+            write(fout, line, strlen(line));
+            free(line);
+        }
+        clean_manifest_line(ml);
+    }
+    close(fout);
+    free(entries);
+    return strdup(tempfile);
+}
+
+/**
+ * Rebuilds a server manifest into dest by applying a delta to the
+ * client's view of the server at its last sync (all lines not marked "A").
+ * A NULL delta writes that view unchanged.
+ */
+void apply_manifest_delta(char *client_manifest, char *delta, char *header, char *dest){
+
+    int base_count = 0;
+    int max_base_count = 64;
+    delta_entry_t *base = malloc(max_base_count * sizeof(delta_entry_t));
+    read_delta_entries(client_manifest, 1, 1, &base, &base_count, &max_base_count);
+    qsort(base, base_count, sizeof(delta_entry_t), compare_delta_entries);
+
+    int delta_count = 0;
+    int max_delta_count = 64;
+    delta_entry_t *changes = malloc(max_delta_count * sizeof(delta_entry_t));
+    if (delta)
+        read_delta_entries(delta, 0, 0, &changes, &delta_count, &max_delta_count);
+
+    int fout = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_line(fout, header);
+
+    // merge the two sorted lists; changed files replace base lines
+    int b = 0;
+    int d = 0;
+    while (b < base_count || d < delta_count){
+        int cmp;
+        if (b == base_count)
+            cmp = 1;
+        else if (d == delta_count)
+            cmp = -1;
+        else
+            cmp = strcmp(base[b].ml->fname, changes[d].ml->fname);
+
+        // "D" only means deleted in the delta; locally it's still on the server
+        manifest_line_t *ml;
+        int deleted = 0;
+        if (cmp < 0){
+            ml = base[b++].ml;
+        } else {
+            if (cmp == 0)
+                clean_manifest_line(base[b++].ml);
+            ml = changes[d++].ml;
+            deleted = ml->code == 'D';
+        }
+
+        if (!deleted){
+            char *line = generate_manifest_line('-', ml->hexdigest, ml->version, ml->fname);
+            write(fout, line, strlen(line));
+            free(line);
+        }
+        clean_manifest_line(ml);
+    }
+    close(fout);
+    free(base);
+    free(changes);
+}
+
+/**********************************************************************************
+                                  MANIFEST SYNC
+***********************************************************************************/
+
+// ======================================
+// Manifest sync protocol
+// ======================================
+// 1. client sends the version of its .Manifest (-1 if it has none)
+//    and the root hash of its view of the server at its last sync
+// 2. server replies with one of the SYNC_* modes:
+//    - SYNC_NOT_MODIFIED: version and hash match, nothing else is sent
+//    - SYNC_DELTA: the server's history covers the client's version.
+//      It sends its manifest header, root hash and the collapsed delta.
+//      The client applies the delta and replies whether the result
+//      hashes to the same root; if not, continue as SYNC_TREE.
+//    - SYNC_TREE: compare hash trees top-down
+
+#define SYNC_NOT_MODIFIED 0
+#define SYNC_DELTA        1
+#define SYNC_TREE         2
+
+/**
+ * Server side of a manifest sync, for the given copy of the
+ * project's .Manifest and its hash tree.
+ */
+void send_manifest_sync(int sock, char *project, char *manifest, merkle_node_t *root){
+    int version = get_manifest_version(manifest);
+
+    int client_version = recv_int(sock);
+    char *client_hash = recv_line(sock);
+
+    // conditional fetch: client is already up to date
+    if (client_version == version && !strcmp(client_hash, root->hexdigest)){
+        printf("The .Manifest of %s is not modified\n", project);
+        send_int(sock, SYNC_NOT_MODIFIED);
+        free(client_hash);
+        return;
+    }
+    free(client_hash);
+
+    char *delta = generate_manifest_delta(project, client_version, version);
+    send_int(sock, delta ? SYNC_DELTA : SYNC_TREE);
+
+    int synced = 0;
+    if (delta){
+        printf("Sending the changes to %s since version %d\n", project, client_version);
+        file_buf_t *info = init_file_buf(manifest);
+        read_file_until(info, '\n');
+        send_line(sock, info->data);
+        clean_file_buf(info);
+
+        send_line(sock, root->hexdigest);
+        send_file(delta, sock, 0);
+        remove(delta);
+        free(delta);
+        synced = recv_int(sock);
+    }
+
+    if (!synced){
+        printf("Sending the hash tree of %s\n", project);
+        send_merkle_diff(sock, root, manifest);
+    }
+}
+
+/**
+ * Client side of a manifest sync. Rebuilds the server's
+ * current manifest into dest.
+ */
+void recv_manifest_sync(int sock, char *client_manifest, char *dest){
+    int exists = access(client_manifest, F_OK) != -1;
+    int version = exists ? get_manifest_version(client_manifest) : -1;
+
+    merkle_node_t *base = build_merkle_tree(client_manifest, 1);
+    send_int(sock, version);
+    send_line(sock, base->hexdigest);
+    clean_merkle_tree(base);
+
+    int mode = recv_int(sock);
+    if (mode == SYNC_NOT_MODIFIED){
+        // server manifest is our own view of it
+        file_buf_t *info = init_file_buf(client_manifest);
+        read_file_until(info, '\n');
+        apply_manifest_delta(client_manifest, NULL, info->data, dest);
+        clean_file_buf(info);
+        return;
+    }
+
+    int synced = 0;
+    if (mode == SYNC_DELTA){
+        char *header = recv_line(sock);
+        char *root_hash = recv_line(sock);
+
+        char delta[15+1];
+        gen_temp_filename(delta);
+        recv_file(sock, delta);
+        apply_manifest_delta(client_manifest, delta, header, dest);
+        remove(delta);
+
+        // verify the rebuilt manifest matches the server's
+        merkle_node_t *root = build_merkle_tree(dest, 0);
+        synced = !strcmp(root->hexdigest, root_hash);
+        clean_merkle_tree(root);
+        send_int(sock, synced);
+
+        free(header);
+        free(root_hash);
+    }
+
+    if (!synced)
+        recv_merkle_diff(sock, client_manifest, dest);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "helpers.h"
+#include "merkle.h"
+
+char *generate_manifest_delta(char *project, int from_version, int to_version);
+void apply_manifest_delta(char *client_manifest, char *delta, char *header, char *dest);
+
+void send_manifest_sync(int sock, char *project, char *manifest, merkle_node_t *root);
+void recv_manifest_sync(int sock, char *client_manifest, char *dest);
@@ -0,0 +1,400 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "transfer.h"
+#include "digest.h"
+
+// ======================================
+// Resumable transfers
+// ======================================
+// Large archives (checkout, upgrade, push) are sent with a transfer id.
+// The sender keeps the data staged under that id until the receiver
+// says it is done with it. The receiver writes what arrives to a .part
+// file, flushing it every TRANSFER_SYNC_BYTES and recording how much is
+// durable. After a dropped connection, the next attempt sends the id
+// and that offset, and only the rest is sent again:
+//
+//     receiver: <id or "-">, <durable offset>
+//     sender:   <id>, <offset it starts from>, <total size>,
+//               bytes [offset, total), xxh64 of all bytes
+//
+// A sender that no longer has the id answers with a new one and offset
+// 0, and the receiver drops its partial data.
+
+/**
+ * Ids and names come from the other side and end up in paths.
+ */
+static int valid_transfer_id(char *id){
+    if (!*id || strlen(id) > TRANSFER_ID_MAX)
+        return 0;
+    for (; *id; id++){
+        if (!((*id >= '0' && *id <= '9') || (*id >= 'a' && *id <= 'z') || (*id >= 'A' && *id <= 'Z')))
+            return 0;
+    }
+    return 1;
+}
+
+static char *transfer_path(char *id, char *suffix){
+    char *path;
+    asprintf(&path, "%s/%s%s", TRANSFER_DIR, id, suffix);
+    return path;
+}
+
+static void save_transfer(transfer_t *transfer){
+    char *temp;
+    asprintf(&temp, "%s.tmp", transfer->record);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dprintf(fd, "%s %s %ld\n", *transfer->id ? transfer->id : "-", transfer->key, transfer->durable);
+    fdatasync(fd);
+    close(fd);
+    rename(temp, transfer->record);
+    free(temp);
+}
+
+/**
+ * Points the transfer at a (new) sender id, dropping data kept for another.
+ */
+static void set_transfer_id(transfer_t *transfer, char *id){
+    if (transfer->part && strcmp(transfer->id, id))
+        remove(transfer->part);
+    free(transfer->part);
+    snprintf(transfer->id, sizeof(transfer->id), "%s", id);
+
+    // under the transfer's name too, so senders picking the same
+    // id for different requests can't write into each other's data
+    char *part_id;
+    asprintf(&part_id, "%s.%s", transfer->name, id);
+    transfer->part = transfer_path(part_id, ".part");
+    free(part_id);
+}
+
+/**
+ * Picks up the transfer recorded under name, if it was for the same
+ * request (key). Otherwise starts a new one.
+ */
+transfer_t *load_transfer(char *name, char *key){
+    mkdir(TRANSFER_DIR, 0755);
+    expire_transfers();
+
+    transfer_t *transfer = calloc(1, sizeof(transfer_t));
+    snprintf(transfer->key, sizeof(transfer->key), "%s", key);
+
+    // names like "checkout.<project>" become file names
+    transfer->name = strdup(name);
+    char *c;
+    for (c = transfer->name; *c; c++){
+        if (*c == '/')
+            *c = '_';
+    }
+    transfer->record = transfer_path(transfer->name, ".transfer");
+
+    FILE *fp = fopen(transfer->record, "r");
+    if (!fp)
+        return transfer;
+    char id[TRANSFER_ID_MAX+1];
+    char old_key[HEXDIGEST_MAX+1];
+    long durable;
+    int fields = fscanf(fp, "%64s %64s %ld", id, old_key, &durable);
+    fclose(fp);
+    if (fields != 3 || !valid_transfer_id(id))
+        return transfer;
+
+    set_transfer_id(transfer, id);
+    if (strcmp(old_key, key)){
+        remove(transfer->part);
+        return transfer;
+    }
+    transfer->durable = durable;
+    return transfer;
+}
+
+/**
+ * Receives the data of a transfer into its .part file, resuming after
+ * the durable bytes of an earlier attempt.
+ *
+ * Returns 1 once all of it is on disk and matches the sender's checksum,
+ * 0 if it didn't match (the partial data is dropped) and -1 if the
+ * connection was lost (what is durable is kept for the next attempt).
+ */
+int recv_transfer(int sock, transfer_t *transfer){
+    send_line(sock, *transfer->id ? transfer->id : "-");
+    send_long(sock, transfer->durable);
+
+    char *id = recv_line(sock);
+    long offset = recv_long(sock);
+    long total = recv_long(sock);
+    if (!valid_transfer_id(id)){
+        free(id);
+        return -1;
+    }
+    set_transfer_id(transfer, id);
+    free(id);
+
+    int fd = open(transfer->part, O_RDWR | O_CREAT, 0644);
+    ftruncate(fd, offset);
+    if (offset)
+        printf("Resuming transfer at %ld of %ld bytes\n", offset, total);
+
+    // the checksum covers the bytes we already have too
+    digest_ctx_t ctx;
+    digest_init(&ctx, HASH_XXH64);
+    char *data = malloc(TRANSFER_READ_SIZE);
+    long have = 0;
+    while (have < offset){
+        int want = offset - have < TRANSFER_READ_SIZE ? offset - have : TRANSFER_READ_SIZE;
+        int bytes = read(fd, data, want);
+        if (bytes <= 0)
+            break;
+        digest_update(&ctx, data, bytes);
+        have += bytes;
+    }
+
+    long received = offset;
+    long synced = offset;
+    while (received < total){
+        // stop at the next flush so resume offsets are whole TRANSFER_SYNC_BYTES
+        long want = total - received < TRANSFER_READ_SIZE ? total - received : TRANSFER_READ_SIZE;
+        if (want > synced + TRANSFER_SYNC_BYTES - received)
+            want = synced + TRANSFER_SYNC_BYTES - received;
+        int bytes = recv(sock, data, want, 0);
+        if (bytes <= 0){
+            puts("Connection lost while receiving transfer");
+            free(data);
+            close(fd);
+            return -1;
+        }
+        write(fd, data, bytes);
+        digest_update(&ctx, data, bytes);
+        received += bytes;
+
+        if (received - synced >= TRANSFER_SYNC_BYTES){
+            fdatasync(fd);
+            synced = received;
+            transfer->durable = synced;
+            save_transfer(transfer);
+        }
+    }
+    free(data);
+
+    // check the sender's checksum, then ACK the data received
+    char hexstring[HEXDIGEST_MAX+1];
+    digest_final(&ctx, hexstring);
+    char *checksum = recv_line(sock);
+    int verified = !strcmp(checksum, hexstring);
+    free(checksum);
+    ack(sock);
+
+    if (verified){
+        fdatasync(fd);
+        transfer->durable = total;
+    } else {
+        puts("Received transfer doesn't match the sender's checksum");
+        ftruncate(fd, 0);
+        transfer->durable = 0;
+    }
+    close(fd);
+    save_transfer(transfer);
+    return verified;
+}
+
+/**
+ * Drops the received data and its record once the operation using it
+ * is over.
+ */
+void finish_transfer(transfer_t *transfer){
+    if (transfer->part)
+        remove(transfer->part);
+    remove(transfer->record);
+}
+
+void clean_transfer(transfer_t *transfer){
+    free(transfer->name);
+    free(transfer->record);
+    free(transfer->part);
+    free(transfer);
+}
+
+/**
+ * Sender side: the id and offset the receiver would like to resume from.
+ * The returned id must be freed.
+ */
+char *recv_transfer_request(int sock, long *offset){
+    char *id = recv_line(sock);
+    *offset = recv_long(sock);
+    return id;
+}
+
+/**
+ * Sends the data staged at path from offset on (from the start if the
+ * offset is out of range). Returns whether all of it was sent.
+ */
+int send_transfer(int sock, char *id, char *path, long offset){
+    struct stat st = {0};
+    stat(path, &st);
+    long total = st.st_size;
+    if (offset < 0 || offset > total)
+        offset = 0;
+
+    send_line(sock, id);
+    send_long(sock, offset);
+    send_long(sock, total);
+
+    digest_ctx_t ctx;
+    digest_init(&ctx, HASH_XXH64);
+    char *data = malloc(TRANSFER_READ_SIZE);
+    int fd = open(path, O_RDONLY);
+    long sent = 0;
+    int ok = 1;
+    while (ok && sent < total){
+        int bytes = read(fd, data, TRANSFER_READ_SIZE);
+        if (bytes <= 0)
+            break;
+        digest_update(&ctx, data, bytes);
+
+        // bytes the receiver has are only hashed
+        int skip = sent < offset ? (offset - sent < bytes ? offset - sent : bytes) : 0;
+        int written = skip;
+        while (written < bytes){
+            int out = write(sock, data + written, bytes - written);
+            if (out <= 0){
+                ok = 0;
+                break;
+            }
+            written += out;
+        }
+        sent += bytes;
+    }
+    close(fd);
+    free(data);
+    if (!ok || sent < total){
+        puts("Connection lost while sending transfer");
+        return 0;
+    }
+
+    char checksum[HEXDIGEST_MAX+1];
+    digest_final(&ctx, checksum);
+    send_line(sock, checksum);
+    wait_for_ack(sock);
+    return 1;
+}
+
+/**
+ * Computes the checksum send_transfer sends along with the data at path.
+ */
+void transfer_checksum(char *path, char *hexstring){
+    digest_ctx_t ctx;
+    digest_init(&ctx, HASH_XXH64);
+    char *data = malloc(TRANSFER_READ_SIZE);
+    int fd = open(path, O_RDONLY);
+    int bytes;
+    while ((bytes = read(fd, data, TRANSFER_READ_SIZE)) > 0)
+        digest_update(&ctx, data, bytes);
+    close(fd);
+    free(data);
+    digest_final(&ctx, hexstring);
+}
+
+/**
+ * Like send_transfer, for data already open as fd whose checksum is
+ * known. The bytes go from the file to the socket with sendfile,
+ * without being copied through the process or hashed again. The
+ * caller closes fd.
+ */
+int send_transfer_file(int sock, char *id, int fd, long offset, char *checksum){
+    struct stat st = {0};
+    fstat(fd, &st);
+    long total = st.st_size;
+    if (offset < 0 || offset > total)
+        offset = 0;
+
+    send_line(sock, id);
+    send_long(sock, offset);
+    send_long(sock, total);
+
+    off_t pos = offset;
+    while (pos < total){
+        if (sendfile(sock, fd, &pos, total - pos) <= 0)
+            break;
+    }
+    if (pos < total){
+        puts("Connection lost while sending transfer");
+        return 0;
+    }
+
+    send_line(sock, checksum);
+    wait_for_ack(sock);
+    return 1;
+}
+
+/**
+ * Path of the data staged under id, or NULL if there is none.
+ * Must be freed.
+ */
+char *staged_transfer(char *id){
+    if (!valid_transfer_id(id))
+        return NULL;
+    char *path = transfer_path(id, ".tar.gz");
+    if (access(path, F_OK) == -1){
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/**
+ * Keeps file as the data of a transfer until the receiver is done
+ * with it. An empty id is filled in with a new random one.
+ * Returns the staged path, which must be freed.
+ */
+char *stage_transfer(char *file, char *id){
+    mkdir(TRANSFER_DIR, 0755);
+    expire_transfers();
+
+    if (!*id){
+        int i;
+        for (i = 0; i < 16; i++)
+            sprintf(id + i, "%x", rand() % 16);
+    }
+    char *path = transfer_path(id, ".tar.gz");
+
+    // nothing to archive still makes an (empty) transfer
+    if (access(file, F_OK) == -1)
+        close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    else if (rename(file, path) == -1)
+        move_file(file, path);
+    return path;
+}
+
+/**
+ * Removes transfers left alone for longer than TRANSFER_TTL.
+ */
+void expire_transfers(){
+    DIR *dir = opendir(TRANSFER_DIR);
+    if (!dir)
+        return;
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir))){
+        if (entry->d_name[0] == '.')
+            continue;
+        char *path;
+        asprintf(&path, "%s/%s", TRANSFER_DIR, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) != -1 && now - st.st_mtime > TRANSFER_TTL)
+            remove(path);
+        free(path);
+    }
+    closedir(dir);
+}
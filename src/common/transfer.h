@@ -0,0 +1,50 @@
+#pragma once
+
+#include "helpers.h"
+
+// partial and staged transfer data, on both the client and the server
+#define TRANSFER_DIR ".transfers"
+#define TRANSFER_ID_MAX 64
+
+// received bytes are flushed and the resume offset recorded this often
+#define TRANSFER_SYNC_BYTES (8 * 1024 * 1024)
+
+// seconds before data nobody came back for is removed
+#define TRANSFER_TTL (24 * 60 * 60)
+
+#define TRANSFER_READ_SIZE (64 * 1024)
+
+/**
+ * The receiving side of a resumable transfer, recorded in
+ * .transfers/<name>.transfer as "<id> <key> <durable offset>".
+ * Received bytes go to .transfers/<name>.<id>.part.
+ */
+typedef struct transfer_t {
+    char *name;
+    char *record;
+
+    // the sender's name for the data; empty until it sent one
+    char id[TRANSFER_ID_MAX+1];
+
+    // digest of the request the data answers; a different
+    // request starts over
+    char key[HEXDIGEST_MAX+1];
+
+    // bytes known to be on disk, where a new attempt resumes
+    long durable;
+
+    char *part;
+} transfer_t;
+
+transfer_t *load_transfer(char *name, char *key);
+int recv_transfer(int sock, transfer_t *transfer);
+void finish_transfer(transfer_t *transfer);
+void clean_transfer(transfer_t *transfer);
+
+char *recv_transfer_request(int sock, long *offset);
+int send_transfer(int sock, char *id, char *path, long offset);
+void transfer_checksum(char *path, char *hexstring);
+int send_transfer_file(int sock, char *id, int fd, long offset, char *checksum);
+char *staged_transfer(char *id);
+char *stage_transfer(char *file, char *id);
+void expire_transfers();
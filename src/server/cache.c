@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "../common/transfer.h"
+
+// ======================================
+// Checkout archive cache
+// ======================================
+// A full checkout is an archive of the project's current snapshot,
+// and a snapshot never changes once published, so its archive is built
+// once and kept under the snapshot's id. Whatever changes the project
+// directory (a push, a rollback, a pending commit) only shows once a
+// new snapshot is published, which gets a new key. Ids start over with
+// the snapshots on server start, so the cache is emptied along with
+// them. The checksum the transfer ends with is kept with the archive,
+// so sending one is a sendfile of the file as is:
+//
+//     .archives/<project>/<key>/archive.tar.gz
+//     .archives/<project>/<key>/checksum
+//
+// An entry is put together in a temporary directory and renamed into
+// place, so the two always match; if another worker got there first,
+// its entry is kept.
+//
+// Hits touch the archive's mtime. When a new archive takes the cache
+// over ARCHIVE_CACHE_BYTES, the least recently used ones are removed.
+// The cache is only files, so every worker process shares it. A lookup
+// opens the archive and reads its checksum right away, and the archive
+// is sent from that fd, so an entry removed meanwhile is still sent
+// whole.
+
+/**
+ * Keys come from clients resuming a checkout and end up in paths.
+ */
+static int valid_key(char *key){
+    return strlen(key) == 32 && strspn(key, "0123456789abcdefABCDEF") == 32;
+}
+
+/**
+ * Opens the cached archive under key and reads the checksum kept with
+ * it into hexstring. Returns the archive's fd, which must be closed,
+ * or -1 if there is none.
+ */
+int cached_archive(char *project, char *key, char *hexstring){
+    if (!valid_key(key))
+        return -1;
+
+    // both files through the entry's directory: once it is removed,
+    // neither opens, so they can't come from two entries
+    char *dirname;
+    asprintf(&dirname, "%s/%s/%s", ARCHIVE_CACHE_DIR, project, key);
+    int dir = open(dirname, O_RDONLY | O_DIRECTORY);
+    free(dirname);
+    if (dir == -1)
+        return -1;
+    int fd = openat(dir, CACHE_ARCHIVE, O_RDONLY);
+    int checksum = openat(dir, CACHE_CHECKSUM, O_RDONLY);
+    close(dir);
+
+    FILE *f = checksum == -1 ? NULL : fdopen(checksum, "r");
+    int found = fd != -1 && f && fscanf(f, "%64s", hexstring) == 1;
+    if (f)
+        fclose(f);
+    else if (checksum != -1)
+        close(checksum);
+    if (!found){
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    futimens(fd, NULL);
+    return fd;
+}
+
+/**
+ * Removes an entry's directory; a client being sent its
+ * archive keeps reading it.
+ */
+static void remove_entry(char *dirname){
+    char *path;
+    asprintf(&path, "%s/%s", dirname, CACHE_ARCHIVE);
+    remove(path);
+    free(path);
+    asprintf(&path, "%s/%s", dirname, CACHE_CHECKSUM);
+    remove(path);
+    free(path);
+    rmdir(dirname);
+}
+
+static int compare_entries(const void *a, const void *b){
+    time_t x = ((cache_entry_t *) a)->used;
+    time_t y = ((cache_entry_t *) b)->used;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Removes the least recently used entries until the rest fit in
+ * ARCHIVE_CACHE_BYTES. A client still being sent one keeps reading it.
+ */
+static void evict_archives(){
+    int count = 0;
+    int max_count = 64;
+    cache_entry_t *entries = malloc(max_count * sizeof(cache_entry_t));
+    long total = 0;
+
+    DIR *cache = opendir(ARCHIVE_CACHE_DIR);
+    struct dirent *proj;
+    while (cache && (proj = readdir(cache))){
+        if (proj->d_name[0] == '.')
+            continue;
+        char *dirname;
+        asprintf(&dirname, "%s/%s", ARCHIVE_CACHE_DIR, proj->d_name);
+        DIR *dir = opendir(dirname);
+        struct dirent *de;
+        while (dir && (de = readdir(dir))){
+            // skips entries still being put together too
+            if (!valid_key(de->d_name))
+                continue;
+            if (count >= max_count){
+                max_count *= 2;
+                entries = realloc(entries, max_count * sizeof(cache_entry_t));
+            }
+            cache_entry_t *entry = &entries[count];
+            asprintf(&entry->path, "%s/%s", dirname, de->d_name);
+            char *archive;
+            asprintf(&archive, "%s/%s", entry->path, CACHE_ARCHIVE);
+            struct stat st = {0};
+            int found = stat(archive, &st) != -1;
+            free(archive);
+            if (!found){
+                free(entry->path);
+                continue;
+            }
+            entry->size = st.st_size;
+            entry->used = st.st_mtime;
+            total += st.st_size;
+            count++;
+        }
+        if (dir)
+            closedir(dir);
+        free(dirname);
+    }
+    if (cache)
+        closedir(cache);
+
+    qsort(entries, count, sizeof(cache_entry_t), compare_entries);
+    int i;
+    for (i = 0; i < count; i++){
+        if (total > ARCHIVE_CACHE_BYTES){
+            remove_entry(entries[i].path);
+            total -= entries[i].size;
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+/**
+ * Moves a built archive into the cache under key, then makes room for
+ * it. Returns it opened as cached_archive does.
+ */
+int cache_archive(char *project, char *key, char *built, char *hexstring){
+    // nothing to archive still makes an (empty) archive
+    if (access(built, F_OK) == -1)
+        close(open(built, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+    // put the entry together next to where it goes
+    char *temp;
+    asprintf(&temp, "%s/%s/%s.%d.%lx", ARCHIVE_CACHE_DIR, project, key, getpid(), (unsigned long) rand());
+    char *archive;
+    asprintf(&archive, "%s/%s", temp, CACHE_ARCHIVE);
+    mkpath(archive);
+    if (rename(built, archive) == -1)
+        move_file(built, archive);
+
+    transfer_checksum(archive, hexstring);
+    char *checksum;
+    asprintf(&checksum, "%s/%s", temp, CACHE_CHECKSUM);
+    int fd = open(checksum, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dprintf(fd, "%s\n", hexstring);
+    close(fd);
+    free(checksum);
+    free(archive);
+
+    // an entry someone else made meanwhile is as good as ours
+    char *dest;
+    asprintf(&dest, "%s/%s/%s", ARCHIVE_CACHE_DIR, project, key);
+    if (rename(temp, dest) == -1)
+        remove_entry(temp);
+    free(temp);
+    free(dest);
+
+    evict_archives();
+    return cached_archive(project, key, hexstring);
+}
+
+/**
+ * Archives are named after snapshots, which are removed on server
+ * start, so the archives go with them.
+ */
+void clean_cached_archives(){
+    char *cmd;
+    asprintf(&cmd, "rm -rf %s", ARCHIVE_CACHE_DIR);
+    system(cmd);
+    free(cmd);
+}
+
+/**
+ * Removes the archives of a destroyed project.
+ */
+void drop_cached_archives(char *project){
+    char *cmd;
+    asprintf(&cmd, "rm -rf %s/%s", ARCHIVE_CACHE_DIR, project);
+    system(cmd);
+    free(cmd);
+}
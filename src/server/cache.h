@@ -0,0 +1,27 @@
+#pragma once
+
+#include <time.h>
+
+#include "../common/helpers.h"
+
+// checkout archives, under ARCHIVE_CACHE_DIR/<project>/<key>/
+#define ARCHIVE_CACHE_DIR ".archives"
+#define CACHE_ARCHIVE "archive.tar.gz"
+#define CACHE_CHECKSUM "checksum"
+
+// total size the cached archives are kept under
+#define ARCHIVE_CACHE_BYTES (1024L * 1024 * 1024)
+
+/**
+ * A cached archive, as seen when making room for a new one.
+ */
+typedef struct cache_entry_t {
+    char *path;
+    long size;
+    time_t used;
+} cache_entry_t;
+
+int cached_archive(char *project, char *key, char *hexstring);
+int cache_archive(char *project, char *key, char *built, char *hexstring);
+void clean_cached_archives();
+void drop_cached_archives(char *project);
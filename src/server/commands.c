@@ -4,123 +4,486 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include "../common/helpers.h"
+#include "commands.h"
+#include "registry.h"
+
+/**
+ * Returns the hash tree of a snapshot's .Manifest, building it if it
+ * isn't the cached one. Pass it to release_project_tree when done.
+ */
+project_tree_t *project_tree(project_t *proj, snapshot_t *snap){
+    pthread_mutex_lock(&proj->tree_lock);
+    project_tree_t *tree = proj->tree;
+    if (!tree || tree->snapshot != snap->id){
+        char *manifest;
+        asprintf(&manifest, "%s/%s/.Manifest", snap->root, proj->name);
+        tree = malloc(sizeof(project_tree_t));
+        tree->root = build_merkle_tree(manifest, 0);
+        tree->snapshot = snap->id;
+        tree->refs = 0;
+        free(manifest);
+
+        // only a newer snapshot replaces the cached tree; a reader
+        // still on an older one gets a tree of its own
+        if (!proj->tree || proj->tree->snapshot < snap->id){
+            if (proj->tree && --proj->tree->refs == 0){
+                clean_merkle_tree(proj->tree->root);
+                free(proj->tree);
+            }
+            proj->tree = tree;
+            tree->refs++;
+        }
+    }
+    tree->refs++;
+    pthread_mutex_unlock(&proj->tree_lock);
+    return tree;
+}
+
+/**
+ * Lets go of a tree from project_tree, or of the cached one
+ * when the project entry is freed.
+ */
+void release_project_tree(project_t *proj, project_tree_t *tree){
+    pthread_mutex_lock(&proj->tree_lock);
+    int last = --tree->refs == 0;
+    pthread_mutex_unlock(&proj->tree_lock);
+    if (last){
+        clean_merkle_tree(tree->root);
+        free(tree);
+    }
+}
 
-void checkout(int sock, char *project){
-    send_directory(sock, project);
+/**
+ * Lets go of an archive sent to the client, removing it if the client
+ * got all of it, unless others still share it.
+ */
+static void release_transfer(char *id, char *tar, flight_t *flight, int finished){
+    if (flight)
+        leave_flight(flight, finished);
+    else if (finished && tar && !flight_uses(id))
+        remove(tar);
+    free(tar);
+}
+
+/**
+ * Opens the cached archive of a snapshot, kept under key, as
+ * cached_archive does. Checkouts that miss the cache at the same time
+ * share one build.
+ */
+static int checkout_archive(snapshot_t *snap, char *project, char *key, char *checksum){
+    int fd = cached_archive(project, key, checksum);
+    if (fd != -1)
+        return fd;
+
+    char *flight_key;
+    asprintf(&flight_key, "checkout %s %s", project, key);
+    int lead;
+    flight_t *flight = join_flight(flight_key, &lead);
+    if (lead){
+        printf("Caching the checkout archive of %s\n", project);
+        char *built = generate_directory_tar(snap->root, project);
+        fd = cache_archive(project, key, built, checksum);
+        free(built);
+        land_flight(flight, key);
+    } else {
+        puts("Sharing the archive of a checkout in progress");
+        fd = cached_archive(project, key, checksum);
+    }
+
+    // the archive lives in the cache, so leaving never removes it
+    leave_flight(flight, 1);
+    free(flight_key);
+
+    // evicted right away by others filling the cache, or too big to
+    // keep: send one of our own, which the client can't resume
+    if (fd == -1){
+        char *built = generate_directory_tar(snap->root, project);
+        transfer_checksum(built, checksum);
+        fd = open(built, O_RDONLY);
+        remove(built);
+        free(built);
+    }
+    return fd;
 }
 
-void update(int sock, char *project){
-    // send manifest
+void checkout(int sock, project_t *proj, snapshot_t *snap){
+    char *project = proj->name;
+
+    // paths a sparse checkout is limited to, if any
+    sparse_t *sparse = recv_sparse(sock, project);
+
+    // client hashes files with the project's hash as it extracts them
     char *manifest;
-    asprintf(&manifest, "%s/.Manifest", project);
-    send_file(manifest, sock, 0);
+    asprintf(&manifest, "%s/%s/.Manifest", snap->root, project);
+    send_line(sock, hash_algo_name(get_manifest_hash(manifest)));
     free(manifest);
+
+    // a client resuming an interrupted checkout gets the rest of
+    // the archive it started on; otherwise build one. a sparse
+    // checkout only gets the .Manifest and the matching files
+    long offset;
+    char id[TRANSFER_ID_MAX+1];
+    char *requested = recv_transfer_request(sock, &offset);
+    snprintf(id, sizeof(id), "%s", requested);
+    free(requested);
+    char *tar = staged_transfer(id);
+    if (!tar && sparse){
+        char *built = generate_sparse_tar(snap->root, project, sparse);
+        id[0] = '\0';
+        tar = stage_transfer(built, id);
+        free(built);
+        offset = 0;
+    }
+    clean_sparse(sparse);
+    if (tar){
+        // keep the archive until the client has it all
+        release_transfer(id, tar, NULL, send_transfer(sock, id, tar, offset) && recv_int(sock));
+        return;
+    }
+
+    // a full checkout is the cached archive of the snapshot, which
+    // stays in the cache once the client has it. it is sent from
+    // the fd opened here, even if it is evicted meanwhile
+    char checksum[HEXDIGEST_MAX+1];
+    int fd = cached_archive(project, id, checksum);
+    if (fd == -1){
+        char key[32+1];
+        // snapshot ids are unique until the server restarts, which
+        // empties the cache
+        snprintf(key, sizeof(key), "%032lx", (unsigned long) snap->id);
+        fd = checkout_archive(snap, project, key, checksum);
+        snprintf(id, sizeof(id), "%s", key);
+        offset = 0;
+    }
+    if (send_transfer_file(sock, id, fd, offset, checksum))
+        recv_int(sock);
+    close(fd);
 }
 
-void upgrade(int sock, char *project){
+void update(int sock, project_t *proj, snapshot_t *snap){
+    char *project = proj->name;
+    char *manifest;
+    asprintf(&manifest, "%s/%s/.Manifest", snap->root, project);
+
+    // send what changed since the client's manifest version
+    project_tree_t *tree = project_tree(proj, snap);
+    send_manifest_sync(sock, project, manifest, tree->root);
+    release_project_tree(proj, tree);
+    free(manifest);
+}
+
+void upgrade(int sock, project_t *proj, snapshot_t *snap){
+    char *project = proj->name;
 
     // recieve client .Update
     char update[15+1];
     gen_temp_filename(update);
-    recv_file(sock, update);
+    if (!recv_file(sock, update)){
+        remove(update);
+        return;
+    }
 
-    // generate tar of added/modified files and send to client
-    char *tar = generate_am_tar(update);
-    send_file(tar, sock, 0);
-    remove(tar);
+    // generate tar of added/modified files and send to client,
+    // or the rest of the one an interrupted upgrade started on
+    long offset;
+    char id[TRANSFER_ID_MAX+1];
+    char *requested = recv_transfer_request(sock, &offset);
+    snprintf(id, sizeof(id), "%s", requested);
+    free(requested);
+    char *tar = staged_transfer(id);
+    flight_t *flight = NULL;
+    if (!tar){
+        // clients upgrading from the same version send the same .Update,
+        // so those upgrading at the same time share one archive
+        char digest[32+1];
+        md5sum(update, digest);
+        char *key;
+        asprintf(&key, "upgrade %s %ld %s", project, snap->id, digest);
+        int lead;
+        flight = join_flight(key, &lead);
+        if (lead){
+            char *built = generate_am_tar(snap->root, update);
+            id[0] = '\0';
+            tar = stage_transfer(built, id);
+            free(built);
+            land_flight(flight, id);
+        } else {
+            snprintf(id, sizeof(id), "%s", flight->id);
+            tar = staged_transfer(id);
+        }
+        free(key);
+        offset = 0;
+    }
     remove(update);
-    free(tar);
+    if (!send_transfer(sock, id, tar, offset)){
+        release_transfer(id, tar, flight, 0);
+        return;
+    }
 
     // send manifest version to client
     char *manifest;
-    asprintf(&manifest, "%s/.Manifest", project);
+    asprintf(&manifest, "%s/%s/.Manifest", snap->root, project);
     send_int(sock, get_manifest_version(manifest));
     free(manifest);
+
+    // keep the archive until the client has it all
+    release_transfer(id, tar, flight, recv_int(sock));
 }
 
-void commit(int sock, char *project){
-    // send manifest
+void commit(int sock, project_t *proj, snapshot_t *snap){
+    char *project = proj->name;
+
+    // the client's .Manifest may be behind ours, as long as the history
+    // tells what changed since; its commit can't touch those paths
     char *manifest;
     asprintf(&manifest, "%s/.Manifest", project);
-    send_file(manifest, sock, 0);
+    int num_changed;
+    char **changed = changed_paths_since(project, recv_int(sock), get_manifest_version(manifest), &num_changed);
+    int algo = get_manifest_hash(manifest);
     free(manifest);
+    send_int(sock, changed != NULL);
+    if (!changed){
+        puts("Client .Manifest version doesn't match server's");
+        return;
+    }
+
+    // receive proposed .Commit and validate every entry against our manifest
+    char proposed[15+1];
+    gen_temp_filename(proposed);
+    if (!recv_file(sock, proposed)){
+        puts("Rejected client .Commit");
+        clean_paths(changed, num_changed);
+        remove(proposed);
+        return;
+    }
 
-    // receive client success msg on creating .Commit
-    if (!recv_int(sock)){
-        puts("Client encountered error when trying to .Commit");
+    char results[15+1];
+    gen_temp_filename(results);
+    project_tree_t *tree = project_tree(proj, snap);
+    int accepted = validate_commit_file(proposed, tree->root, algo, changed, num_changed, results);
+    release_project_tree(proj, tree);
+    clean_paths(changed, num_changed);
+    send_int(sock, accepted);
+    send_file(results, sock, 0);
+    remove(results);
+
+    if (!accepted){
+        puts("Rejected client .Commit");
+        remove(proposed);
         return;
     }
 
-    // receive client .Commit file
-    char *commit_path = gen_commit_filename(project);
-    recv_file(sock, commit_path);
-    free(commit_path);
+    // keep accepted .Commit until it's pushed
+    save_pending_commit(project, proposed);
     puts("Received new .Commit file");
 }
 
-void push(int sock, char *project){
+// ======================================
+// Push
+// ======================================
+// A push is received in two phases. The upload and the backups of the
+// pushed files are staged under .staging/<project>/<commit digest> without the
+// project lock, so others keep using the project however long that
+// takes. Only then is the project locked, to check the commit is still
+// pending and to move the staged files in.
+//
+// Pushes of commits made against the same version don't exclude each
+// other: one is only rejected if a path it changes was changed since
+// that version. Otherwise it is rebased, i.e. applied to the current
+// .Manifest as the next version.
+
+/**
+ * Takes the lock that keeps two pushes of the same commit from
+ * staging into the same place. Returns its fd.
+ */
+static int lock_staging(char *staging){
+    char *path;
+    asprintf(&path, "%s.lock", staging);
+    while (1){
+        // the last push of the project may remove the directory
+        mkpath(path);
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        flock(fd, LOCK_EX);
+
+        // the push before us may have removed it while we waited
+        struct stat st = {0};
+        fstat(fd, &st);
+        if (st.st_nlink > 0){
+            free(path);
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+static void unlock_staging(char *staging, int fd){
+    char *path;
+    asprintf(&path, "%s.lock", staging);
+    remove(path);
+    close(fd);
+
+    // only goes once no other push of the project is staging
+    *strrchr(path, '/') = '\0';
+    rmdir(path);
+    free(path);
+}
+
+void push(int sock, project_t *proj, snapshot_t *snap){
+    char *project = proj->name;
 
     // find out if a .Commit file md5sum in the current project matches
     // .Commit md5sum recieved from client
     char *client_commit_hash = recv_line(sock);
     char *commitMatch = commit_exists(project, client_commit_hash);
-    free(client_commit_hash);
 
     // if received commit has expired; inform client and close connection
     if(!commitMatch) {
+        free(client_commit_hash);
         send_int(sock, 0);
         return;
     }
     send_int(sock, 1);
 
-    // receive tar with changed files
-    char temp_tar[15+1];
-    gen_temp_filename(temp_tar);
-    recv_file(sock, temp_tar);
-
-    // untar files into project directory if we have non-empty tar
-    struct stat st = {0};
-    stat(temp_tar, &st);
-    if(st.st_size > 0){
-        char *untar_cmd;
-        asprintf(&untar_cmd, "tar xzf %s", temp_tar);
-        system(untar_cmd);
-        free(untar_cmd);
+    char *staging;
+    char *staged_backups;
+    asprintf(&staging, ".staging/%s/%s", project, client_commit_hash);
+    asprintf(&staged_backups, "%s.backups", staging);
+    int staging_lock = lock_staging(staging);
+
+    // receive tar with changed files. if an earlier push of this commit
+    // was cut off, only the part we don't have yet is sent
+    char *transfer_name;
+    asprintf(&transfer_name, "push.%s.%s", project, client_commit_hash);
+    transfer_t *transfer = load_transfer(transfer_name, client_commit_hash);
+    free(transfer_name);
+    free(client_commit_hash);
+    int received = recv_transfer(sock, transfer);
+    if (received == -1){
+        puts("Push interrupted; keeping what was received");
+        clean_transfer(transfer);
+        unlock_staging(staging, staging_lock);
+        free(staged_backups);
+        free(staging);
+        free(commitMatch);
+        return;
     }
 
-    // replace old .Manifest with new updated .Manifest from client
+    // untar files into the staging directory, hashing them as they are
+    // written, and back them up. they only replace project files if
+    // they all match the .Commit
     char *manifestPath;
-    asprintf(&manifestPath, "%s/.Manifest", project);
-    recv_file(sock, manifestPath);
+    asprintf(&manifestPath, "%s/%s/.Manifest", snap->root, project);
+    int algo = get_manifest_hash(manifestPath);
+    free(manifestPath);
 
-    // backup A/M files and remove D files
-    int version = get_manifest_version(manifestPath);
-    update_repo_from_commit(commitMatch, project, version);
-    free(commitMatch);
+    struct stat st = {0};
+    stat(transfer->part, &st);
+    archive_file_t *files = NULL;
+    int verified = received;
+    if(verified && st.st_size > 0){
+        verified = extract_archive(transfer->part, staging, algo, &files) &&
+                   verify_archive_files(files, commitMatch, 0, NULL, NULL);
+        if (verified)
+            backup_commit_files(commitMatch, staging, staged_backups);
+    }
+    finish_transfer(transfer);
+    clean_transfer(transfer);
 
-    // Expire all .Commit files for this project
-    remove_all_commits(project);
+    if (!verified){
+        puts("Pushed files don't match the .Commit");
+        send_int(sock, 0);
+    } else {
+        send_int(sock, 1);
+
+        // the client's new .Manifest tells which version it committed
+        // against; the server makes its own from the current one
+        char new_manifest[15+1];
+        gen_temp_filename(new_manifest);
+        int received_manifest = recv_file(sock, new_manifest);
+
+        // the commit is still pending unless a push changed one of its
+        // paths. it applies on top of whatever else was pushed since the
+        // version it was made against
+        asprintf(&manifestPath, "%s/.Manifest", project);
+        int base = received_manifest ? get_manifest_version(new_manifest) - 1 : -1;
+        remove(new_manifest);
+
+        // link the next snapshot before locking, so under the lock only
+        // the pushed paths have to be linked again
+        int num_pushed;
+        char **pushed = commit_paths(commitMatch, &num_pushed);
+        snapshot_t *draft = received_manifest ? draft_snapshot(project) : NULL;
+        int lock = lock_project(proj, 1);
+        int version = get_manifest_version(manifestPath) + 1;
+        int num_changed;
+        char **changed = changed_paths_since(project, base, version - 1, &num_changed);
+        int applied = changed && access(commitMatch, F_OK) != -1 &&
+                      !commit_conflicts(commitMatch, changed, num_changed);
+        if (changed)
+            clean_paths(changed, num_changed);
+        if (applied){
+            install_archive_files(files, staging);
+
+            // replace rather than rewrite, the old one is linked into a snapshot
+            rebase_manifest(manifestPath, commitMatch, new_manifest);
+            move_file(new_manifest, manifestPath);
+
+            // keep backups of A/M files and remove D files
+            update_repo_from_commit(commitMatch, project, version, staged_backups);
+
+            // expire pending .Commit files that can't be pushed anymore
+            remove_conflicting_commits(project, commitMatch);
+
+            // backup .Manifest
+            char *cmd;
+            asprintf(&cmd, "tar -czf backups/%s_%d %s", manifestPath, version, manifestPath);
+            system(cmd);
+            free(cmd);
+
+            // let readers see the new version before the client returns
+            publish_snapshot(project, draft, pushed, num_pushed);
+        } else {
+            puts("Pushed paths changed on the server since the commit");
+        }
+        unlock_project(proj, lock);
+        discard_snapshot(draft);
+        clean_paths(pushed, num_pushed);
+
+        // the client learns which version its push became
+        send_int(sock, applied ? version : 0);
+        free(manifestPath);
+    }
 
-    // backup .Manifest
+    // cleanup
+    clean_archive_files(files);
     char *cmd;
-    asprintf(&cmd, "tar -czf backups/%s_%d %s", manifestPath, version, manifestPath);
+    asprintf(&cmd, "rm -rf %s %s", staging, staged_backups);
     system(cmd);
     free(cmd);
-
-    // cleanup
-    free(manifestPath);
-    remove(temp_tar);
+    unlock_staging(staging, staging_lock);
+    free(staged_backups);
+    free(staging);
+    free(commitMatch);
 }
 
-void create(int sock, char *project){
-    // backup manifest
+void create(int sock, project_t *proj){
+    char *project = proj->name;
     char *manifest;
     asprintf(&manifest, "%s/.Manifest", project);
 
+    // record the requested content hash in the new .Manifest
+    char *hash_name = recv_line(sock);
+    int algo = parse_hash_algo(hash_name);
+    if (algo > HASH_MD5)
+        convert_manifest_hash(manifest, algo, 0, 0);
+    free(hash_name);
+
+    // backup manifest
+
     char *backup_manifest;
     asprintf(&backup_manifest, "backups/%s", manifest);
     mkpath(backup_manifest);
@@ -132,68 +495,52 @@ void create(int sock, char *project){
     free(cmd);
 
     // send requested .Manifest to client
+    publish_snapshot(project, NULL, NULL, 0);
     send_file(manifest, sock, 1);
     free(manifest);
 }
 
-void destroy(int sock, char *project){
+void destroy(int sock, project_t *proj){
+    char *project = proj->name;
+    remove_all_commits(project);
+    drop_cached_archives(project);
     char *cmd;
     asprintf(&cmd, "rm -rf %s", project);
     system(cmd);
     free(cmd);
-}
+    publish_snapshot(project, NULL, NULL, 0);
 
-void currentversion(int sock, char *project){
-    // send requested .Manifest to client
-    char *manifest;
-    asprintf(&manifest, "%s/.Manifest", project);
-    send_file(manifest, sock, 0);
-    free(manifest);
+    // connections still holding the entry keep it until they let go
+    remove_project(proj);
 }
 
-void history(int sock, char *project){
+void currentversion(int sock, project_t *proj, snapshot_t *snap){
+    char *project = proj->name;
     char *manifest;
-    asprintf(&manifest, "%s/.Manifest", project);
-    int version = get_manifest_version(manifest);
+    asprintf(&manifest, "%s/%s/.Manifest", snap->root, project);
+
+    // send what changed since the client's manifest version
+    project_tree_t *tree = project_tree(proj, snap);
+    send_manifest_sync(sock, project, manifest, tree->root);
+    release_project_tree(proj, tree);
     free(manifest);
+}
 
-    char tempfile[15+1];
-    gen_temp_filename(tempfile);
-    int fout = open(tempfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+void history(int sock, project_t *proj){
+    char *project = proj->name;
 
-    struct stat st = {0};
-    int i;
-    for (i = 1; i >= 0; i++){
-        char *backup;
-        asprintf(&backup, "history/%s/.Commit_%d", project, i);
-        if (stat(backup, &st) != -1){
-
-            // write version number
-            char *num;
-            asprintf(&num, "%d\n", i);
-            write(fout, num, strlen(num));
-            free(num);
-
-            // write file contents
-            int eof = 0;
-            int bytes_read = 0;
-            int fin = open(backup, O_RDONLY);
-            while (!eof){
-                char *buf = read_file_chunk(fin, &bytes_read, &eof);
-                write(fout, buf, bytes_read);
-            }
-            close(fin);
+    // receive requested range and path filter
+    int since = recv_int(sock);
+    int limit = recv_int(sock);
+    char *path = recv_line(sock);
 
-        } else
-            i = -10; // done
-        free(backup);
-    }
-    close(fout);
-    send_file(tempfile, sock, 0);
-    remove(tempfile);
+    // stream matching rows straight from the history log
+    send_history(sock, project, since, limit, path);
+    free(path);
 }
 
-void rollback(int sock, char *project){
+void rollback(int sock, project_t *proj){
+    char *project = proj->name;
     char *version = recv_line(sock);
 
     // check if project version exists
@@ -209,20 +556,65 @@ void rollback(int sock, char *project){
     }
     free(manifest_backup);
 
-    // delete old .Commit files in history
-    int i;
-    for (i = atoi(version) + 1; i >= 0; i++){
-        char *backup;
-        asprintf(&backup, "history/%s/.Commit_%d", project, i);
-        if (stat(backup, &st) != -1){
-            remove(backup);
-        } else
-            i = -10; // done
-        free(backup);
-    }
+    // forget newer versions in history
+    truncate_history(project, atoi(version));
 
     // execute rollback
     rollback_every_file(project, version);
+    publish_snapshot(project, NULL, NULL, 0);
     free(version);
     send_int(sock, exists);
 }
+
+void rehash(int sock, project_t *proj){
+    char *project = proj->name;
+    char *hash_name = recv_line(sock);
+    int algo = parse_hash_algo(hash_name);
+    free(hash_name);
+
+    char *manifest;
+    asprintf(&manifest, "%s/.Manifest", project);
+    int version = get_manifest_version(manifest);
+    int converted = algo != -1 && algo != get_manifest_hash(manifest);
+
+    // re-hash every file into a new project version
+    if (converted){
+        version++;
+        convert_manifest_hash(manifest, algo, version, 0);
+
+        // every digest changed; record them for history and delta syncs
+        char commit[15+1];
+        gen_temp_filename(commit);
+        int fout = open(commit, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        file_buf_t *info = init_file_buf(manifest);
+        read_file_until(info, '\n');
+        while (1){
+            read_file_until(info, '\n');
+            if (info->file_eof)
+                break;
+            manifest_line_t *ml = parse_manifest_line(info->data);
+            char *line = generate_manifest_line('M', ml->hexdigest, ml->version, ml->fname);
+            write(fout, line, strlen(line));
+            free(line);
+            clean_manifest_line(ml);
+        }
+        clean_file_buf(info);
+        close(fout);
+        append_history(project, version, commit);
+        remove(commit);
+
+        // pending .Commit files were made with the old hash
+        remove_all_commits(project);
+
+        // backup .Manifest
+        char *cmd;
+        asprintf(&cmd, "tar -czf backups/%s_%d %s", manifest, version, manifest);
+        system(cmd);
+        free(cmd);
+        publish_snapshot(project, NULL, NULL, 0);
+    }
+
+    send_int(sock, algo == -1 ? -1 : version);
+    send_int(sock, converted);
+    free(manifest);
+}
@@ -1,14 +1,38 @@
 #pragma once
 
 #include "../common/helpers.h"
+#include "../common/merkle.h"
+#include "../common/sync.h"
+#include "../common/history.h"
+#include "../common/digest.h"
+#include "../common/archive.h"
+#include "../common/sparse.h"
+#include "../common/transfer.h"
+#include "snapshot.h"
+#include "flight.h"
+#include "cache.h"
 
-void checkout(int sock, char *project);
-void update(int sock, char *project);
-void upgrade(int sock, char *project);
-void commit(int sock, char *project);
-void push(int sock, char *project);
-void create(int sock, char *project);
-void destroy(int sock, char *project);
-void currentversion(int sock, char *project);
-void history(int sock, char *project);
-void rollback(int sock, char *project);
+/**
+ * Hash tree of one snapshot's .Manifest, shared by the
+ * connections reading that snapshot.
+ */
+typedef struct project_tree_t {
+    merkle_node_t *root;
+    long snapshot;
+    int refs;
+} project_tree_t;
+
+project_tree_t *project_tree(project_t *proj, snapshot_t *snap);
+void release_project_tree(project_t *proj, project_tree_t *tree);
+
+void checkout(int sock, project_t *proj, snapshot_t *snap);
+void update(int sock, project_t *proj, snapshot_t *snap);
+void upgrade(int sock, project_t *proj, snapshot_t *snap);
+void commit(int sock, project_t *proj, snapshot_t *snap);
+void push(int sock, project_t *proj, snapshot_t *snap);
+void create(int sock, project_t *proj);
+void destroy(int sock, project_t *proj);
+void currentversion(int sock, project_t *proj, snapshot_t *snap);
+void history(int sock, project_t *proj);
+void rollback(int sock, project_t *proj);
+void rehash(int sock, project_t *proj);
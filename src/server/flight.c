@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "flight.h"
+
+// ======================================
+// Single-flight archives
+// ======================================
+// When a release ships, many clients check out the same snapshot at
+// once. Rather than each building its own archive, the first to ask
+// for one (the leader) builds and stages it, and everyone asking for
+// the same key meanwhile waits for it and sends that same staged file.
+// The archive is removed when the last of them is done, unless one
+// didn't receive all of it and may come back to resume.
+
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static flight_t *flights = NULL;
+
+/**
+ * Joins the flight for key, starting it if there is none. The leader
+ * gets *lead set and must build the archive and land_flight it; the
+ * others return once it has landed. Every call must be followed by
+ * leave_flight.
+ */
+flight_t *join_flight(char *key, int *lead){
+    pthread_mutex_lock(&flights_lock);
+    flight_t *flight = flights;
+    while (flight && strcmp(flight->key, key))
+        flight = flight->next;
+
+    *lead = !flight;
+    if (*lead){
+        flight = calloc(1, sizeof(flight_t));
+        flight->key = strdup(key);
+        pthread_cond_init(&flight->cond, NULL);
+        flight->next = flights;
+        flights = flight;
+    }
+    flight->refs++;
+    if (!*lead && !flight->landed)
+        printf("Waiting for the leader of %s\n", key);
+    while (!*lead && !flight->landed)
+        pthread_cond_wait(&flight->cond, &flights_lock);
+    pthread_mutex_unlock(&flights_lock);
+    return flight;
+}
+
+/**
+ * Hands the staged archive's id to everyone waiting on the flight.
+ */
+void land_flight(flight_t *flight, char *id){
+    pthread_mutex_lock(&flights_lock);
+    snprintf(flight->id, sizeof(flight->id), "%s", id);
+    flight->landed = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flights_lock);
+}
+
+/**
+ * Lets go of a flight, saying whether the client received all of the
+ * archive. The last one out removes it if everyone did.
+ */
+void leave_flight(flight_t *flight, int finished){
+    pthread_mutex_lock(&flights_lock);
+    if (!finished)
+        flight->incomplete = 1;
+    int last = --flight->refs == 0;
+    if (last){
+        flight_t **pos = &flights;
+        while (*pos != flight)
+            pos = &(*pos)->next;
+        *pos = flight->next;
+    }
+    pthread_mutex_unlock(&flights_lock);
+    if (!last)
+        return;
+
+    if (!flight->incomplete){
+        char *tar = staged_transfer(flight->id);
+        if (tar)
+            remove(tar);
+        free(tar);
+    }
+    pthread_cond_destroy(&flight->cond);
+    free(flight->key);
+    free(flight);
+}
+
+/**
+ * Returns whether a flight is still sending the staged transfer id,
+ * so a client resuming it mustn't remove it when done.
+ */
+int flight_uses(char *id){
+    pthread_mutex_lock(&flights_lock);
+    flight_t *flight = flights;
+    while (flight && strcmp(flight->id, id))
+        flight = flight->next;
+    pthread_mutex_unlock(&flights_lock);
+    return flight != NULL;
+}
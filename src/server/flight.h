@@ -0,0 +1,29 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "../common/transfer.h"
+
+/**
+ * An archive being built or sent for one (operation, project,
+ * snapshot). Connections asking for the same one share it.
+ */
+typedef struct flight_t {
+    char *key;
+
+    // the staged transfer; empty until the leader has built it
+    char id[TRANSFER_ID_MAX+1];
+    int landed;
+    pthread_cond_t cond;
+
+    // connections using it, and whether one didn't get all of it
+    int refs;
+    int incomplete;
+
+    struct flight_t *next;
+} flight_t;
+
+flight_t *join_flight(char *key, int *lead);
+void land_flight(flight_t *flight, char *id);
+void leave_flight(flight_t *flight, int finished);
+int flight_uses(char *id);
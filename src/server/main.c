@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,28 +7,38 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/wait.h>
 
+#include "cache.h"
 #include "commands.h"
+#include "registry.h"
+#include "scheduler.h"
 
-int server_fd;
-project_t *projects;
-pthread_mutex_t p_lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+int server_fd = -1;
+
+// worker processes serving the port, when there are several, and
+// the listening sockets not yet handed to one (-1 once handed over)
+static pid_t *workers = NULL;
+static int *listeners = NULL;
+static int num_workers = 0;
 
 void cleanup(){
     puts("Initiating cleanup on server termination...");
 
+    // stop the workers, which clean up after themselves
+    int i;
+    for (i = 0; i < num_workers; i++)
+        kill(workers[i], SIGINT);
+    for (i = 0; i < num_workers; i++)
+        waitpid(workers[i], NULL, 0);
+    free(workers);
+    free(listeners);
+
     // close sockets
     close(server_fd);
-    while (projects){
-        project_t *next = projects->next;
-        if (projects->sock)
-            close(projects->sock);
-        free(projects->name);
-        free(projects);
-        projects = next;
-    }
 
     // free data
+    clean_registry();
     puts("Done, thanks for waiting!");
 }
 
@@ -35,60 +46,69 @@ void sigint_handler(int s){
     exit(EXIT_SUCCESS);
 }
 
-project_t *get_proj_info(char *project){
+// how handle_connection locks the project around a command
+#define PROJECT_UNLOCKED 0
+#define PROJECT_SHARED 1
+#define PROJECT_EXCLUSIVE 2
 
-    // handle first project
-    if (!projects){
-        projects = calloc(1, sizeof(project_t));
-        projects->lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-        projects->name = strdup(project);
-        return projects;
-    }
+/**
+ * Returns how a command locks the project. Reads of the current
+ * snapshot need no lock, and push only locks it once its upload is
+ * staged. `history` reads the live log alongside other readers.
+ */
+int command_lock(char *cmd){
+    if (!strcmp(cmd, "checkout") || !strcmp(cmd, "update") || !strcmp(cmd, "upgrade") ||
+        !strcmp(cmd, "currentversion") || !strcmp(cmd, "push"))
+        return PROJECT_UNLOCKED;
+    if (!strcmp(cmd, "history"))
+        return PROJECT_SHARED;
+    return PROJECT_EXCLUSIVE;
+}
 
-    // search through linked list for matching project
-    project_t *match = NULL;
-    project_t *cur = projects;
-    while (cur->next){
-        if (!strcmp(cur->name, project)){
-            match = cur;
-            break;
+/**
+ * Pins the project's current snapshot, publishing the live directory
+ * first if it has none, as on first use after the server started.
+ * Returns NULL if the project is gone.
+ */
+snapshot_t *pin_project(project_t *proj, int write_locked){
+    snapshot_t *snap = pin_snapshot(proj->name);
+    if (!snap){
+        int lock = -1;
+        if (!write_locked)
+            lock = lock_project(proj, 1);
+        if (!(snap = pin_snapshot(proj->name))){
+            publish_snapshot(proj->name, NULL, NULL, 0);
+            snap = pin_snapshot(proj->name);
         }
-        cur = cur->next;
+        if (!write_locked)
+            unlock_project(proj, lock);
     }
-
-    if (!match && !strcmp(cur->name, project))
-        match = cur;
-
-    if (!match){
-        cur->next = calloc(1, sizeof(project_t));
-        match = cur->next;
-        match->lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-        match->name = strdup(project);
-    }
-    return match;
+    return snap;
 }
 
-void perform_cmd(int sock, char *cmd, char *proj){
+void perform_cmd(int sock, char *cmd, project_t *proj, snapshot_t *snap){
     if (!strcmp(cmd, "checkout")){
-        checkout(sock, proj);
+        checkout(sock, proj, snap);
     } else if (!strcmp(cmd, "update")){
-        update(sock, proj);
+        update(sock, proj, snap);
     } else if (!strcmp(cmd, "upgrade")){
-        upgrade(sock, proj);
+        upgrade(sock, proj, snap);
     } else if (!strcmp(cmd, "commit")){
-        commit(sock, proj);
+        commit(sock, proj, snap);
     } else if (!strcmp(cmd, "push")){
-        push(sock, proj);
+        push(sock, proj, snap);
     } else if (!strcmp(cmd, "create")){
         create(sock, proj);
     } else if (!strcmp(cmd, "destroy")){
         destroy(sock, proj);
     } else if (!strcmp(cmd, "currentversion")){
-        currentversion(sock, proj);
+        currentversion(sock, proj, snap);
     } else if (!strcmp(cmd, "history")){
         history(sock, proj);
     } else if (!strcmp(cmd, "rollback")){
         rollback(sock, proj);
+    } else if (!strcmp(cmd, "rehash")){
+        rehash(sock, proj);
     } else {
         printf("Invalid command: %s\n", cmd);
     }
@@ -98,95 +118,265 @@ void *handle_connection(void *sock_ptr){
 
     // initialize socket and per-thread random seed
     int sock = *((int *) sock_ptr);
+    free(sock_ptr);
     seed_rand();
 
-    // read command
-    char *command = recv_line(sock);
+    // commands are shared fairly between client addresses
+    struct sockaddr_in peer = {0};
+    socklen_t peer_len = sizeof(peer);
+    getpeername(sock, (struct sockaddr *) &peer, &peer_len);
+    unsigned long client = ntohl(peer.sin_addr.s_addr);
+
+    // clients may reuse the connection for several commands,
+    // and agents check an idle connection is in step with a ping
+    char *command;
+    while ((command = recv_command(sock))){
+        if (!strcmp(command, "ping")){
+            send_line(sock, "pong");
+            free(command);
+            continue;
+        }
 
-    // read client project. create if "create" command.
-    char *project = set_create_project(sock, !strcmp(command, "create"));
+        // read client project. create if "create" command.
+        char *project = set_create_project(sock, !strcmp(command, "create"));
 
-    // perform project locking and then run the command
-    if (project){
-        pthread_mutex_lock(&p_lock);
-        project_t *proj = get_proj_info(project);
-        pthread_mutex_unlock(&p_lock);
+        // wait for a slot, perform project locking and then run the command
+        int gone = 0;
+        if (project){
+            int class = command_class(command);
+            schedule_command(class, project, client);
+            project_t *proj = acquire_project(project);
+            int lock = command_lock(command);
+            int lock_fd = -1;
+            if (lock != PROJECT_UNLOCKED)
+                lock_fd = lock_project(proj, lock == PROJECT_EXCLUSIVE);
 
-        pthread_mutex_lock(&(proj->lock));
-        perform_cmd(sock, command, project);
-        pthread_mutex_unlock(&(proj->lock));
+            // history reads the live log, not a snapshot
+            snapshot_t *snap = NULL;
+            if (lock != PROJECT_SHARED)
+                snap = pin_project(proj, lock == PROJECT_EXCLUSIVE);
+            if (snap || lock == PROJECT_SHARED){
+                perform_cmd(sock, command, proj, snap);
+                if (snap)
+                    unpin_snapshot(project, snap);
+            } else {
+                printf("Project was destroyed: %s\n", project);
+                gone = 1;
+            }
+            if (connection_lost())
+                gone = 1;
+
+            if (lock != PROJECT_UNLOCKED)
+                unlock_project(proj, lock_fd);
+            release_project(proj);
+            finish_command(class);
+        }
+        free(command);
+        free(project);
+        if (gone)
+            break;
     }
 
     // cleanup
-    free(command);
-    free(project);
     close(sock);
     puts("Client disconnected");
     return 0;
 }
 
-int main(int argc, char *argv[]){
-
-    // verify port arg
-    if (argc < 2){
-        puts("Missing port argument");
-        exit(EXIT_FAILURE);
-    }
-
-    // register exit
-    if (atexit(cleanup) != 0) {
-        puts("atexit() registration failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // register sigint handler
-    signal(SIGINT, sigint_handler);
-
-    // initialize socket
-    struct sockaddr_in client, server;
-    socklen_t c = sizeof(struct sockaddr_in);
+/**
+ * Creates the listening socket. Workers each get their own on the
+ * same port with SO_REUSEPORT, and the kernel spreads clients over them.
+ */
+static int open_listener(int port, int reuse_port){
+    struct sockaddr_in server;
     server.sin_family = AF_INET;
     server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(atoi(argv[1]));
-    if (server.sin_port == 0 || server.sin_port > 65535) {
-        puts("Invalid port argument");
-        exit(EXIT_FAILURE);
-    }
+    server.sin_port = htons(port);
 
     // create, bind, and listen on socket
     int enable = 1;
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1){
+    // commands run with system() mustn't keep the port open
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1){
         puts("Couldn't create socket");
         exit(EXIT_FAILURE);
     }
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0){
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0){
         puts("setsockopt(SO_REUSEADDR) failed");
     }
-    if (bind(server_fd, (struct sockaddr *)&server, sizeof(server)) < 0){
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0){
+        puts("setsockopt(SO_REUSEPORT) failed");
+        exit(EXIT_FAILURE);
+    }
+    if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0){
         puts("Couldn't bind to port");
         exit(EXIT_FAILURE);
     }
-    if (listen(server_fd, 100) < 0){
+    if (listen(fd, 100) < 0){
         puts("Couldn't listen on socket");
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
 
-    puts("Server started! Waiting for connections...");
+/**
+ * Accepts clients on the listening socket, a thread each, until the
+ * process is told to stop.
+ */
+static void serve(int fd){
+    struct sockaddr_in client;
+    socklen_t c = sizeof(struct sockaddr_in);
+    server_fd = fd;
     while(1){
-        int client_fd = accept(server_fd, (struct sockaddr *) &client, &c);
+        // each thread gets its own copy; the next accept may come first
+        int *client_fd = malloc(sizeof(int));
+        *client_fd = accept4(server_fd, (struct sockaddr *) &client, &c, SOCK_CLOEXEC);
+        set_nodelay(*client_fd);
         pthread_t thread_id;
         puts("Client connected");
 
         // single thread
-        // handle_connection((void *) &client_fd);
+        // handle_connection((void *) client_fd);
 
         // multithreaded
         if(pthread_create(&thread_id, NULL,
-                          handle_connection, (void *) &client_fd) < 0){
+                          handle_connection, (void *) client_fd) < 0){
             puts("Couldn't create thread");
             exit(EXIT_FAILURE);
         }
+        pthread_detach(thread_id);
+    }
+}
+
+/**
+ * Forks worker i to serve its listening socket, listeners[i].
+ */
+static void start_worker(int i){
+    fflush(stdout);
+    int fd = listeners[i];
+    pid_t pid = fork();
+    if (pid == -1){
+        puts("Couldn't fork worker");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0){
+        // a sibling's listener left open here would stay in the port's
+        // group after the sibling dies, and the kernel would keep
+        // handing it clients nobody accepts
+        int j;
+        for (j = 0; j < num_workers; j++)
+            if (j != i && listeners[j] != -1)
+                close(listeners[j]);
+
+        // a worker only cleans up after itself
+        free(workers);
+        free(listeners);
+        workers = NULL;
+        listeners = NULL;
+        num_workers = 0;
+        serve(fd);
+    }
+    close(fd);
+    listeners[i] = -1;
+    workers[i] = pid;
+}
+
+int main(int argc, char *argv[]){
+
+    // optional number of worker processes
+    int opt;
+    int worker_count = 1;
+    while ((opt = getopt(argc, argv, "w:")) != -1){
+        if (opt != 'w' || (worker_count = atoi(optarg)) <= 0){
+            puts("Usage: WTFserver [-w <workers>] <port> [<metadata slots> <read slots> <write slots>]");
+            exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // verify port arg
+    if (argc < 2){
+        puts("Missing port argument");
+        exit(EXIT_FAILURE);
+    }
+    int port = atoi(argv[1]);
+    if (port <= 0 || port > 65535) {
+        puts("Invalid port argument");
+        exit(EXIT_FAILURE);
+    }
+
+    // optional slots of the metadata, read and write command classes
+    int slots[SCHED_CLASSES] = {SCHED_METADATA_SLOTS, SCHED_READ_SLOTS, SCHED_WRITE_SLOTS};
+    if (argc >= 2 + SCHED_CLASSES){
+        int i;
+        for (i = 0; i < SCHED_CLASSES; i++){
+            slots[i] = atoi(argv[2 + i]);
+            if (slots[i] <= 0){
+                puts("Invalid slots argument");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // register exit
+    if (atexit(cleanup) != 0) {
+        puts("atexit() registration failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // a client that goes away only ends its own connection
+    set_lost_connection_exits(0);
+
+    // log lines reach a redirected log as they happen
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    init_registry();
+    init_scheduler(slots[SCHED_METADATA], slots[SCHED_READ], slots[SCHED_WRITE]);
+
+    // register sigint handler
+    signal(SIGINT, sigint_handler);
+
+    // a client going away mid-transfer only ends its own connection
+    signal(SIGPIPE, SIG_IGN);
+
+    // a single process serves the port itself
+    if (worker_count == 1){
+        int fd = open_listener(port, 0);
+
+        // clients may already queue up while old snapshots are removed
+        clean_snapshots();
+        clean_cached_archives();
+        puts("Server started! Waiting for connections...");
+        serve(fd);
+    }
+
+    // otherwise every worker listens before old snapshots are removed
+    listeners = malloc(worker_count * sizeof(int));
+    int i;
+    for (i = 0; i < worker_count; i++)
+        listeners[i] = open_listener(port, 1);
+    clean_snapshots();
+    clean_cached_archives();
+
+    workers = calloc(worker_count, sizeof(pid_t));
+    num_workers = worker_count;
+    for (i = 0; i < worker_count; i++)
+        start_worker(i);
+    printf("Server started with %d workers! Waiting for connections...\n", worker_count);
+
+    // a worker that dies only takes its own clients along; replace it
+    while (1){
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1)
+            continue;
+        for (i = 0; i < num_workers && workers[i] != pid; i++);
+        if (i == num_workers)
+            continue;
+        printf("Worker %d exited, starting another\n", pid);
+        listeners[i] = open_listener(port, 1);
+        start_worker(i);
     }
     return 0;
 }
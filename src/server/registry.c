@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include "registry.h"
+#include "commands.h"
+
+// ======================================
+// Project registry
+// ======================================
+// Every connection looks up the project it works on. Projects are
+// spread over REGISTRY_STRIPES tables by name hash, each with its own
+// lock, so lookups of different projects rarely wait on each other and
+// each costs a bucket walk rather than a scan of every project.
+//
+// Entries are reference counted: acquire_project hands out a reference
+// that release_project gives back. `destroy` unlinks the entry with
+// remove_project, and the last connection still holding it frees it.
+// A later `create` of the same name gets a fresh entry.
+//
+// Entries only live in one process. When the server runs several
+// worker processes, lock_project also flocks the project's file under
+// PROJECT_LOCK_DIR, so a command changing a project excludes the
+// other workers too. The rwlock is still taken first; it keeps threads
+// of a worker from piling onto the flock and lets waiting writers go
+// ahead of new readers.
+
+static registry_stripe_t stripes[REGISTRY_STRIPES];
+
+static unsigned long hash_name(char *name){
+    unsigned long hash = 5381;
+    while (*name)
+        hash = hash * 33 + (unsigned char) *name++;
+    return hash;
+}
+
+static registry_stripe_t *stripe_of(unsigned long hash){
+    return &stripes[hash % REGISTRY_STRIPES];
+}
+
+static project_t *init_project(char *name){
+    project_t *proj = calloc(1, sizeof(project_t));
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&proj->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&proj->tree_lock, NULL);
+    proj->name = strdup(name);
+    return proj;
+}
+
+static void free_project(project_t *proj){
+    if (proj->tree)
+        release_project_tree(proj, proj->tree);
+    pthread_rwlock_destroy(&proj->lock);
+    pthread_mutex_destroy(&proj->tree_lock);
+    free(proj->name);
+    free(proj);
+}
+
+/**
+ * Doubles a stripe's table. Must be called with the stripe locked.
+ */
+static void grow_stripe(registry_stripe_t *stripe){
+    int old_num_buckets = stripe->num_buckets;
+    project_t **old_buckets = stripe->buckets;
+    stripe->num_buckets *= 2;
+    stripe->buckets = calloc(stripe->num_buckets, sizeof(project_t *));
+
+    int i;
+    for (i = 0; i < old_num_buckets; i++){
+        project_t *cur = old_buckets[i];
+        while (cur){
+            project_t *next = cur->next;
+            unsigned long b = hash_name(cur->name) / REGISTRY_STRIPES % stripe->num_buckets;
+            cur->next = stripe->buckets[b];
+            stripe->buckets[b] = cur;
+            cur = next;
+        }
+    }
+    free(old_buckets);
+}
+
+void init_registry(){
+    int i;
+    for (i = 0; i < REGISTRY_STRIPES; i++){
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        stripes[i].num_buckets = REGISTRY_INITIAL_BUCKETS;
+        stripes[i].buckets = calloc(REGISTRY_INITIAL_BUCKETS, sizeof(project_t *));
+        stripes[i].count = 0;
+    }
+}
+
+/**
+ * Returns the registry entry of a project, adding it if needed, with
+ * a reference taken. Pass it to release_project when done.
+ */
+project_t *acquire_project(char *name){
+    unsigned long hash = hash_name(name);
+    registry_stripe_t *stripe = stripe_of(hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    unsigned long b = hash / REGISTRY_STRIPES % stripe->num_buckets;
+    project_t *proj;
+    for (proj = stripe->buckets[b]; proj; proj = proj->next){
+        if (!strcmp(proj->name, name))
+            break;
+    }
+    if (!proj){
+        if (stripe->count >= stripe->num_buckets){
+            grow_stripe(stripe);
+            b = hash / REGISTRY_STRIPES % stripe->num_buckets;
+        }
+        proj = init_project(name);
+        proj->next = stripe->buckets[b];
+        stripe->buckets[b] = proj;
+        stripe->count++;
+    }
+    proj->refs++;
+    pthread_mutex_unlock(&stripe->lock);
+    return proj;
+}
+
+/**
+ * Gives back a reference from acquire_project.
+ */
+void release_project(project_t *proj){
+    registry_stripe_t *stripe = stripe_of(hash_name(proj->name));
+    pthread_mutex_lock(&stripe->lock);
+    int last = --proj->refs == 0 && proj->removed;
+    pthread_mutex_unlock(&stripe->lock);
+    if (last)
+        free_project(proj);
+}
+
+/**
+ * Takes a destroyed project out of the registry. The caller must hold
+ * a reference, so the entry lives on until that is released.
+ */
+void remove_project(project_t *proj){
+    unsigned long hash = hash_name(proj->name);
+    registry_stripe_t *stripe = stripe_of(hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    if (!proj->removed){
+        project_t **link = &stripe->buckets[hash / REGISTRY_STRIPES % stripe->num_buckets];
+        while (*link && *link != proj)
+            link = &(*link)->next;
+        if (*link){
+            *link = proj->next;
+            stripe->count--;
+        }
+        proj->next = NULL;
+        proj->removed = 1;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * Takes the project lock, shared or exclusive, in this process and
+ * across worker processes. Returns what to pass to unlock_project.
+ */
+int lock_project(project_t *proj, int exclusive){
+    if (exclusive)
+        pthread_rwlock_wrlock(&proj->lock);
+    else
+        pthread_rwlock_rdlock(&proj->lock);
+
+    // every holder opens its own, flocks of one open file are shared
+    char *path;
+    asprintf(&path, "%s/%s.lock", PROJECT_LOCK_DIR, proj->name);
+    mkpath(path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+    free(path);
+    return fd;
+}
+
+void unlock_project(project_t *proj, int fd){
+    close(fd);
+    pthread_rwlock_unlock(&proj->lock);
+}
+
+/**
+ * Frees every entry; only for server shutdown.
+ */
+void clean_registry(){
+    int i;
+    for (i = 0; i < REGISTRY_STRIPES; i++){
+        registry_stripe_t *stripe = &stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        int b;
+        for (b = 0; b < stripe->num_buckets; b++){
+            while (stripe->buckets[b]){
+                project_t *next = stripe->buckets[b]->next;
+                free_project(stripe->buckets[b]);
+                stripe->buckets[b] = next;
+            }
+        }
+        free(stripe->buckets);
+        stripe->buckets = NULL;
+        stripe->num_buckets = 0;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "../common/helpers.h"
+
+// independently locked parts of the registry
+#define REGISTRY_STRIPES 64
+#define REGISTRY_INITIAL_BUCKETS 16
+
+// lock files of the projects, flocked by every worker process
+#define PROJECT_LOCK_DIR ".locks"
+
+/**
+ * One part of the project registry: a chained hash table
+ * with its own lock, grown when it gets full.
+ */
+typedef struct registry_stripe_t {
+    pthread_mutex_t lock;
+    project_t **buckets;
+    int num_buckets;
+    int count;
+} registry_stripe_t;
+
+void init_registry();
+project_t *acquire_project(char *name);
+void release_project(project_t *proj);
+void remove_project(project_t *proj);
+int lock_project(project_t *proj, int exclusive);
+void unlock_project(project_t *proj, int fd);
+void clean_registry();
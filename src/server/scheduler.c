@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+// ======================================
+// Command scheduler
+// ======================================
+// Commands are split in three classes: metadata (currentversion,
+// history), bulk reads (checkout, update, upgrade) and writes (push,
+// commit, rollback, rehash, create, destroy). Each class has its own
+// slots, so a quick currentversion never waits behind checkouts and
+// pushes; those only wait for each other.
+//
+// When a class is full its commands queue up, and a freed slot goes to
+// the waiter with the earliest virtual start time (start-time fair
+// queueing). A command starts no earlier than where the last command
+// of its project, and of its client, ends. Every project and every
+// client gets an equal share of the slots, so one client hammering one
+// project doesn't starve the others. Projects and clients are hashed
+// into SCHED_FLOWS flows, so ones that collide share a flow.
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static sched_class_t classes[SCHED_CLASSES];
+static char *class_names[SCHED_CLASSES] = {"metadata", "read", "write"};
+
+static unsigned long hash_flow(char *name){
+    unsigned long hash = 5381;
+    while (*name)
+        hash = hash * 33 + (unsigned char) *name++;
+    return hash % SCHED_FLOWS;
+}
+
+void init_scheduler(int metadata_slots, int read_slots, int write_slots){
+    classes[SCHED_METADATA].slots = metadata_slots;
+    classes[SCHED_READ].slots = read_slots;
+    classes[SCHED_WRITE].slots = write_slots;
+}
+
+/**
+ * Returns the class a command is scheduled in.
+ */
+int command_class(char *cmd){
+    if (!strcmp(cmd, "checkout") || !strcmp(cmd, "update") || !strcmp(cmd, "upgrade"))
+        return SCHED_READ;
+    if (!strcmp(cmd, "currentversion") || !strcmp(cmd, "history"))
+        return SCHED_METADATA;
+
+    // everything else changes the project, and holds its write lock
+    return SCHED_WRITE;
+}
+
+/**
+ * Waits until the command gets a slot of its class.
+ * Every call must be followed by finish_command.
+ */
+void schedule_command(int class, char *project, unsigned long client){
+    sched_class_t *sched = &classes[class];
+    unsigned long *project_finish = &sched->project_finish[hash_flow(project)];
+    unsigned long *client_finish = &sched->client_finish[client % SCHED_FLOWS];
+
+    pthread_mutex_lock(&sched_lock);
+
+    // start after the flows' last commands, each costing one unit
+    unsigned long start = sched->vtime;
+    if (*project_finish > start)
+        start = *project_finish;
+    if (*client_finish > start)
+        start = *client_finish;
+    *project_finish = start + 1;
+    *client_finish = start + 1;
+
+    // a free slot nobody else is waiting for is taken right away
+    if (sched->running < sched->slots && !sched->waiting){
+        sched->running++;
+        if (start > sched->vtime)
+            sched->vtime = start;
+        pthread_mutex_unlock(&sched_lock);
+        return;
+    }
+
+    // otherwise queue up behind every earlier start
+    printf("Queued a %s command on %s\n", class_names[class], project);
+    sched_waiter_t waiter = {0};
+    pthread_cond_init(&waiter.cond, NULL);
+    waiter.start = start;
+    sched_waiter_t **pos = &sched->waiting;
+    while (*pos && (*pos)->start <= start)
+        pos = &(*pos)->next;
+    waiter.next = *pos;
+    *pos = &waiter;
+
+    while (!waiter.admitted)
+        pthread_cond_wait(&waiter.cond, &sched_lock);
+    pthread_mutex_unlock(&sched_lock);
+    pthread_cond_destroy(&waiter.cond);
+}
+
+/**
+ * Gives back the slot of a command, to the first waiter if any.
+ */
+void finish_command(int class){
+    sched_class_t *sched = &classes[class];
+    pthread_mutex_lock(&sched_lock);
+    sched->running--;
+    if (sched->waiting && sched->running < sched->slots){
+        sched_waiter_t *next = sched->waiting;
+        sched->waiting = next->next;
+        sched->running++;
+        if (next->start > sched->vtime)
+            sched->vtime = next->start;
+        next->admitted = 1;
+        pthread_cond_signal(&next->cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
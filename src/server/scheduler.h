@@ -0,0 +1,46 @@
+#pragma once
+
+#include <pthread.h>
+
+// classes of commands, each with its own queue and slots
+#define SCHED_METADATA 0
+#define SCHED_READ 1
+#define SCHED_WRITE 2
+#define SCHED_CLASSES 3
+
+// commands of a class run at the same time, unless given on the command line
+#define SCHED_METADATA_SLOTS 32
+#define SCHED_READ_SLOTS 8
+#define SCHED_WRITE_SLOTS 4
+
+// projects and clients are hashed into this many flows per class
+#define SCHED_FLOWS 256
+
+/**
+ * A command waiting for a slot of its class.
+ */
+typedef struct sched_waiter_t {
+    pthread_cond_t cond;
+    unsigned long start;
+    int admitted;
+    struct sched_waiter_t *next;
+} sched_waiter_t;
+
+/**
+ * Queue and slots of one class. Waiters are kept in order of their
+ * virtual start time; every flow remembers where its last command
+ * ends, so a busy flow's next one starts behind everyone else's.
+ */
+typedef struct sched_class_t {
+    int slots;
+    int running;
+    unsigned long vtime;
+    unsigned long project_finish[SCHED_FLOWS];
+    unsigned long client_finish[SCHED_FLOWS];
+    sched_waiter_t *waiting;
+} sched_class_t;
+
+void init_scheduler(int metadata_slots, int read_slots, int write_slots);
+int command_class(char *cmd);
+void schedule_command(int class, char *project, unsigned long client);
+void finish_command(int class);
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "../common/helpers.h"
+
+// ======================================
+// Project snapshots
+// ======================================
+// Commands that change a project (push, rollback, ...) work on the
+// live directory under the project's write lock, as before. Before one
+// answers the client, the directory is published: hard linked into a
+// new snapshot and made current by swapping a symlink, which readers
+// see all at once. Checkout, update and upgrade pin the current
+// snapshot and read only from it, so they take no project lock, can't
+// see a half applied change and don't hold up the next push.
+//
+// Hard links are only safe because writers never rewrite a file in
+// place: files are replaced by renaming a new one over them (see
+// move_file), and each write site in the server says so.
+//
+// A push doesn't copy the whole project under its lock. Before taking
+// it, the current snapshot is linked into a draft; under the lock only
+// the paths the push changed and the files at the top of the project
+// (.Manifest, pending .Commit files) are linked in again, and the
+// draft is renamed into place. If another change was published in
+// between, the draft is stale and the live directory is linked instead.
+//
+// A snapshot is removed once it is no longer current and nobody holds
+// the shared flock on its pin file. flock rather than a counter, so a
+// reader that dies can't keep one around.
+
+static char *snapshot_root(char *project, long id){
+    char *root;
+    asprintf(&root, "%s/%s/%ld", SNAPSHOT_DIR, project, id);
+    return root;
+}
+
+/**
+ * Returns the id of the project's current snapshot, or -1 if it
+ * has none.
+ */
+static long current_snapshot(char *project){
+    char *link;
+    asprintf(&link, "%s/%s/%s", SNAPSHOT_DIR, project, SNAPSHOT_CURRENT);
+    char target[32];
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    free(link);
+    if (len <= 0)
+        return -1;
+    target[len] = '\0';
+    return atol(target);
+}
+
+/**
+ * Removes a snapshot unless someone has it pinned.
+ */
+static void collect_snapshot(char *root){
+    char *pin;
+    asprintf(&pin, "%s/%s", root, SNAPSHOT_PIN);
+    int fd = open(pin, O_RDONLY);
+
+    // no pin file means it was never published
+    if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1){
+        close(fd);
+        free(pin);
+        return;
+    }
+
+    // readers that open the pin from here on see it's gone
+    remove(pin);
+    char *cmd;
+    asprintf(&cmd, "rm -rf %s", root);
+    system(cmd);
+    free(cmd);
+    if (fd != -1)
+        close(fd);
+    free(pin);
+}
+
+/**
+ * Removes every snapshot of the project but the current one
+ * that nobody has pinned.
+ */
+static void collect_snapshots(char *project){
+    char *dir;
+    asprintf(&dir, "%s/%s", SNAPSHOT_DIR, project);
+    long current = current_snapshot(project);
+
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL){
+        char *end;
+        long id = strtol(de->d_name, &end, 10);
+        if (end == de->d_name || *end || id == current)
+            continue;
+        char *root = snapshot_root(project, id);
+        collect_snapshot(root);
+        free(root);
+    }
+    if (d)
+        closedir(d);
+
+    // nothing left of a destroyed project
+    if (current == -1)
+        rmdir(dir);
+    free(dir);
+}
+
+/**
+ * Hard links every file under src into the same place under dst.
+ * Done here rather than with cp -al, so publishing doesn't fork.
+ */
+static void link_tree(char *src, char *dst){
+    struct stat st = {0};
+    stat(src, &st);
+    mkdir(dst, st.st_mode & 07777);
+
+    DIR *d = opendir(src);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL){
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        char *from;
+        char *to;
+        asprintf(&from, "%s/%s", src, de->d_name);
+        asprintf(&to, "%s/%s", dst, de->d_name);
+        if (lstat(from, &st) != -1 && S_ISDIR(st.st_mode))
+            link_tree(from, to);
+        else
+            link(from, to);
+        free(from);
+        free(to);
+    }
+    if (d)
+        closedir(d);
+}
+
+/**
+ * Makes the copy of a live path in a draft the same file again,
+ * or removes it if the live one is gone.
+ */
+static void relink_path(char *live, char *copy){
+    remove(copy);
+    if (access(live, F_OK) != -1){
+        mkpath(copy);
+        link(live, copy);
+    }
+}
+
+/**
+ * Brings a draft copied from the current snapshot up to date with the
+ * live directory, given the paths that changed since it was published.
+ */
+static void update_draft(char *project, snapshot_t *draft, char **paths, int count){
+    int i;
+    for (i = 0; i < count; i++){
+        char *copy;
+        asprintf(&copy, "%s/%s", draft->root, paths[i]);
+        relink_path(paths[i], copy);
+        free(copy);
+    }
+
+    // .Manifest and pending .Commit files change without being in a
+    // commit's paths, so relink whatever is at the top of the project
+    // that starts with a dot, and drop the ones that are gone
+    char *dirs[2] = { project, NULL };
+    asprintf(&dirs[1], "%s/%s", draft->root, project);
+    for (i = 0; i < 2; i++){
+        DIR *d = opendir(dirs[i]);
+        struct dirent *de;
+        while (d && (de = readdir(d)) != NULL){
+            if (de->d_name[0] != '.' || !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            char *live;
+            char *copy;
+            asprintf(&live, "%s/%s", project, de->d_name);
+            asprintf(&copy, "%s/%s", dirs[1], de->d_name);
+            relink_path(live, copy);
+            free(live);
+            free(copy);
+        }
+        if (d)
+            closedir(d);
+    }
+    free(dirs[1]);
+}
+
+/**
+ * Snapshots are copies of live directories, so ones left from an
+ * earlier run may be out of date. Called on server start.
+ */
+void clean_snapshots(){
+    char *cmd;
+    asprintf(&cmd, "rm -rf %s", SNAPSHOT_DIR);
+    system(cmd);
+    free(cmd);
+}
+
+/**
+ * Pins the project's current snapshot. Returns NULL if it has none
+ * yet; the caller then publishes one under the project's write lock.
+ * Pass the snapshot to unpin_snapshot when done.
+ */
+snapshot_t *pin_snapshot(char *project){
+    long id;
+    while ((id = current_snapshot(project)) != -1){
+        char *root = snapshot_root(project, id);
+        char *pin;
+        asprintf(&pin, "%s/%s", root, SNAPSHOT_PIN);
+        int fd = open(pin, O_RDONLY);
+        free(pin);
+
+        // a snapshot stops being current before it is removed, so
+        // if it was removed under us there is a newer one to pin
+        struct stat st = {0};
+        if (fd != -1){
+            flock(fd, LOCK_SH);
+            fstat(fd, &st);
+        }
+        if (st.st_nlink == 0){
+            if (fd != -1)
+                close(fd);
+            free(root);
+            if (current_snapshot(project) == id)
+                return NULL;
+            continue;
+        }
+
+        snapshot_t *snap = malloc(sizeof(snapshot_t));
+        snap->id = id;
+        snap->root = root;
+        snap->pin = fd;
+        return snap;
+    }
+    return NULL;
+}
+
+/**
+ * Lets go of a snapshot, removing it if it was the last
+ * reader of one that is no longer current.
+ */
+void unpin_snapshot(char *project, snapshot_t *snap){
+    flock(snap->pin, LOCK_UN);
+    close(snap->pin);
+    if (current_snapshot(project) != snap->id)
+        collect_snapshot(snap->root);
+    free(snap->root);
+    free(snap);
+}
+
+/**
+ * Links the project's current snapshot into a draft for the next one,
+ * taking no lock. Returns NULL if there is no current snapshot. Pass
+ * the draft to publish_snapshot, and then to discard_snapshot.
+ */
+snapshot_t *draft_snapshot(char *project){
+    snapshot_t *base = pin_snapshot(project);
+    if (!base)
+        return NULL;
+
+    // not a number, so collect_snapshots leaves it alone
+    snapshot_t *draft = malloc(sizeof(snapshot_t));
+    draft->id = base->id;
+    asprintf(&draft->root, "%s/%s/draft.%d.%lx", SNAPSHOT_DIR, project, getpid(), (unsigned long) rand());
+    draft->pin = -1;
+    mkdir(draft->root, 0755);
+
+    char *src;
+    char *dst;
+    asprintf(&src, "%s/%s", base->root, project);
+    asprintf(&dst, "%s/%s", draft->root, project);
+    link_tree(src, dst);
+    free(src);
+    free(dst);
+    unpin_snapshot(project, base);
+    return draft;
+}
+
+/**
+ * Removes a draft that wasn't published, and frees it.
+ */
+void discard_snapshot(snapshot_t *draft){
+    if (!draft)
+        return;
+    if (draft->root){
+        char *cmd;
+        asprintf(&cmd, "rm -rf %s", draft->root);
+        system(cmd);
+        free(cmd);
+        free(draft->root);
+    }
+    free(draft);
+}
+
+/**
+ * Makes the live project directory the current snapshot, or drops
+ * the current one if the project was destroyed. Must be called with
+ * the project locked for writing.
+ *
+ * Given a draft and the paths changed since it was made, only those
+ * are linked again; without one, every file of the project is.
+ */
+void publish_snapshot(char *project, snapshot_t *draft, char **paths, int count){
+    char *current;
+    asprintf(&current, "%s/%s/%s", SNAPSHOT_DIR, project, SNAPSHOT_CURRENT);
+
+    struct stat st = {0};
+    if (stat(project, &st) == -1){
+        remove(current);
+        collect_snapshots(project);
+        free(current);
+        return;
+    }
+
+    // ids only grow, even past snapshots of a destroyed project
+    // that were still pinned when it was created again
+    long base = current_snapshot(project);
+    long id = base + 1;
+    char *root = snapshot_root(project, id);
+    while (stat(root, &st) != -1){
+        free(root);
+        root = snapshot_root(project, ++id);
+    }
+
+    // a draft of the current snapshot only lacks the changed paths.
+    // one of an older snapshot misses a whole change, so then the
+    // live directory is linked into the new snapshot
+    char *pin;
+    asprintf(&pin, "%s/%s", root, SNAPSHOT_PIN);
+    if (draft && draft->root && draft->id == base){
+        update_draft(project, draft, paths, count);
+        rename(draft->root, root);
+        free(draft->root);
+        draft->root = NULL;
+    } else {
+        mkpath(pin);
+        char *dir;
+        asprintf(&dir, "%s/%s", root, project);
+        link_tree(project, dir);
+        free(dir);
+    }
+    close(open(pin, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    free(pin);
+
+    // swap the link so readers see the whole change at once
+    char *link;
+    asprintf(&link, "%s.tmp", current);
+    char target[32];
+    snprintf(target, sizeof(target), "%ld", id);
+    remove(link);
+    symlink(target, link);
+    rename(link, current);
+    free(link);
+
+    collect_snapshots(project);
+    free(root);
+    free(current);
+}
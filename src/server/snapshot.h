@@ -0,0 +1,28 @@
+#pragma once
+
+// published copies of every project, under SNAPSHOT_DIR/<project>/<id>
+#define SNAPSHOT_DIR ".snapshots"
+
+// link to the id readers start on, and the file they pin it with
+#define SNAPSHOT_CURRENT "current"
+#define SNAPSHOT_PIN ".pin"
+
+/**
+ * A published, read-only copy of a project directory. Its root
+ * holds the project directory under its usual name, so paths in
+ * manifests and archives are the same as for the live one.
+ */
+typedef struct snapshot_t {
+    long id;
+    char *root;
+
+    // shared lock on the pin file keeps the copy from being removed
+    int pin;
+} snapshot_t;
+
+void clean_snapshots();
+snapshot_t *pin_snapshot(char *project);
+void unpin_snapshot(char *project, snapshot_t *snap);
+snapshot_t *draft_snapshot(char *project);
+void discard_snapshot(snapshot_t *draft);
+void publish_snapshot(char *project, snapshot_t *draft, char **paths, int count);
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# same command without and then through the agent
+cd ../client
+expected="$(../../bin/WTF currentversion hash_dir)"
+../../bin/WTF agent start
+[[ -S .agent.sock ]] || exit 1
+result_first="$(../../bin/WTF currentversion hash_dir)"
+result_pooled="$(../../bin/WTF currentversion hash_dir)"
+../../bin/WTF currentversion nonexistentProj && exit 1
+result_after_error="$(../../bin/WTF currentversion hash_dir)"
+../../bin/WTF agent stop
+sleep .1
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ ! -e .agent.sock ]] && [[ "$expected" == "$result_first" ]] && \
+	[[ "$expected" == "$result_pooled" ]] && [[ "$expected" == "$result_after_error" ]]
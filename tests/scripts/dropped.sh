@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project at version 1 with a pending commit
+cd ../client
+../../bin/WTF create drop_dir
+echo "one" > drop_dir/file
+../../bin/WTF add drop_dir drop_dir/file
+../../bin/WTF commit drop_dir
+../../bin/WTF push drop_dir
+echo "two" > drop_dir/file
+../../bin/WTF commit drop_dir
+digest="$(md5sum drop_dir/.Commit | cut -d' ' -f1 | tr a-f A-F)"
+
+# every line sent is ACKed; reading the ACKs keeps the fake clients
+# in step, so each goes away at the point it says
+
+# a commit that goes away while the server waits for its version
+exec 3<>/dev/tcp/localhost/5000
+printf 'commit\n' >&3
+head -c 4 <&3 > /dev/null
+printf 'drop_dir\n' >&3
+head -c 8 <&3 > /dev/null
+printf 'ACK\0' >&3
+exec 3>&-
+
+# a push that answers with garbage instead of an ACK
+exec 3<>/dev/tcp/localhost/5000
+printf 'push\n' >&3
+head -c 4 <&3 > /dev/null
+printf 'drop_dir\n' >&3
+head -c 8 <&3 > /dev/null
+printf 'NAK\0' >&3
+exec 3>&-
+
+# a push that goes away once asked for its upload
+exec 3<>/dev/tcp/localhost/5000
+printf 'push\n' >&3
+head -c 4 <&3 > /dev/null
+printf 'drop_dir\n' >&3
+head -c 8 <&3 > /dev/null
+printf 'ACK\0%s\n' "$digest" >&3
+head -c 8 <&3 > /dev/null
+printf 'ACK\0' >&3
+head -c 2 <&3 > /dev/null
+exec 3>&-
+
+# the server is still up, and the commit is still pending
+result_alive="$(kill -0 $pid && echo alive)"
+../../bin/WTF push drop_dir
+result_version="$(head -n 1 ../server/drop_dir/.Manifest)"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_alive" == "alive" ]] && [[ "$result_version" == "2 drop_dir" ]]
@@ -0,0 +1,121 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 > forged.log &
+pid=$!
+for i in $(seq 1 300); do
+	grep -q "Server started" forged.log && break
+	sleep .1
+done
+
+# project at version 2, where file1 changed
+cd ../client
+../../bin/WTF create forge_dir
+echo "one" > forge_dir/file1
+echo "two" > forge_dir/file2
+echo "three" > forge_dir/file3
+../../bin/WTF add forge_dir forge_dir/file1
+../../bin/WTF add forge_dir forge_dir/file2
+../../bin/WTF add forge_dir forge_dir/file3
+../../bin/WTF commit forge_dir
+../../bin/WTF push forge_dir
+echo "more" >> forge_dir/file1
+../../bin/WTF commit forge_dir
+../../bin/WTF push forge_dir
+
+# every line and number sent is ACKed, and every one received is
+# answered with an ACK, which keeps the fake client in step
+send_int(){
+	printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' $(($1 >> 24 & 255)) $(($1 >> 16 & 255)) \
+		$(($1 >> 8 & 255)) $(($1 & 255)))" >&3
+	head -c 4 <&3 > /dev/null
+}
+recv_int(){
+	head -c 4 <&3 | od -An -tu4 --endian=big | tr -d ' '
+	printf 'ACK\0' >&3
+}
+
+# files are checked against the xxh64 of their bytes, which the client
+# puts in a .Manifest that uses it
+xxh64(){
+	mkdir -p sums
+	printf '0 sums xxh64\n' > sums/.Manifest
+	cp $1 sums/file
+	../../bin/WTF add sums sums/file > /dev/null
+	grep "sums/file" sums/.Manifest | cut -d ' ' -f 2
+	rm -rf sums
+}
+
+# commits the given .Commit as made against the given version, without
+# the client's own checks. Prints the server's answer
+forge_commit(){
+	exec 3<>/dev/tcp/localhost/5000
+	printf 'commit\n' >&3
+	head -c 4 <&3 > /dev/null
+	printf 'forge_dir\n' >&3
+	head -c 8 <&3 > /dev/null
+	printf 'ACK\0' >&3
+	send_int $1
+	if [[ "$(recv_int)" == 0 ]]; then
+		echo "stale"
+		exec 3>&-
+		return
+	fi
+
+	printf "$2" > forged
+	send_int 0
+	send_int $(stat -c %s forged)
+	cat forged >&3
+	printf '%s\n' "$(xxh64 forged)" >&3
+	head -c 8 <&3 > /dev/null
+	rm forged
+
+	echo "accepted $(recv_int)"
+	recv_int > /dev/null
+	size="$(recv_int)"
+	head -c $size <&3
+	IFS= read -r -u 3 checksum
+	printf 'ACK\0' >&3
+	printf 'ACK\0' >&3
+	exec 3>&-
+}
+md5(){
+	echo "$1" | md5sum | cut -d ' ' -f 1 | tr a-f A-F
+}
+
+# a commit against a version the history doesn't lead from
+result_stale="$(forge_commit 7 "A $(md5 new) 0 forge_dir/file4\n")"
+
+# a commit against version 1 with an entry for each way it can be wrong,
+# and one that is fine
+result_forged="$(forge_commit 1 "M $(md5 changed) 2 forge_dir/file1
+M $(md5 changed) 5 forge_dir/file2
+A $(md5 new) 0 forge_dir/file3
+D $(md5 gone) 0 forge_dir/file4
+A ABCD 0 forge_dir/file5
+A $(md5 new) 0 forge_dir/file6\n")"
+expected_forged='accepted 0
+rejected M forge_dir/file1: changed on server since last update
+rejected M forge_dir/file2: modified on server since last update
+rejected A forge_dir/file3: already on server
+rejected D forge_dir/file4: not on server
+rejected A forge_dir/file5: digest is not the project'"'"'s content hash
+ok A forge_dir/file6'
+
+# neither is kept, and the server still takes a real one
+result_pending="$(ls -a ../server/forge_dir | grep -c "^.Commit_")"
+echo "four" > forge_dir/file4
+../../bin/WTF add forge_dir forge_dir/file4
+../../bin/WTF commit forge_dir
+../../bin/WTF push forge_dir
+result_version="$(head -n 1 ../server/forge_dir/.Manifest)"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+rm -f ../server/forged.log
+
+[[ "$result_stale" == "stale" ]] && [[ "$result_forged" == "$expected_forged" ]] && \
+	[[ "$result_pending" == 0 ]] && [[ "$result_version" == "3 forge_dir" ]]
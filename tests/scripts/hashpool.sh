@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# status is local, no server needed
+cd tests_out/client
+mkdir -p pool_dir
+
+# small files the workers hash eight at a time, and large ones they hash
+# one by one, more than enough for the batch to be split up
+for i in $(seq 1 200); do
+	head -c $((i * 37)) /dev/urandom > pool_dir/small$i
+done
+for i in $(seq 1 6); do
+	head -c $((1024 * 1024 + i)) /dev/urandom > pool_dir/large$i
+done
+
+digests(){
+	md5sum pool_dir/small* pool_dir/large* | while read digest fname; do
+		echo "$(echo "$digest" | tr a-f A-F) $fname"
+	done
+}
+
+# one of each listed with a digest it doesn't have
+echo "1 pool_dir" > pool_dir/.Manifest
+digests | while read digest fname; do
+	[[ "$fname" == "pool_dir/small100" ]] || [[ "$fname" == "pool_dir/large3" ]] && \
+		digest="$(echo "$digest" | rev)"
+	echo "- $digest 1 $fname" >> pool_dir/.Manifest
+done
+
+# with more workers than this machine may have cores, every digest
+# still lands on its own file
+result_status="$(WTF_CORES=16 ../../bin/WTF status pool_dir | grep -v "Command completed" | sort)"
+expected_status='M pool_dir/large3
+M pool_dir/small100'
+result_index="$(tail -n +2 pool_dir/.Index | cut -d ' ' -f 1,8 | sort)"
+expected_index="$(digests | sort)"
+
+rm -rf pool_dir
+
+[[ "$result_status" == "$expected_status" ]] && [[ "$result_index" == "$expected_index" ]]
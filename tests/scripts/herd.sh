@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# start server with a tar that, while the test holds herd.lock,
+# waits for it before archiving a snapshot
+cd tests_out/server
+mkdir -p herd_bin
+cat > herd_bin/tar << EOF
+#!/bin/bash
+[[ "\$*" == *.snapshots* ]] && flock $PWD/herd.lock true
+exec $(command -v tar) "\$@"
+EOF
+chmod +x herd_bin/tar
+PATH="$PWD/herd_bin:$PATH" ../../bin/WTFserver 5000 > herd.log &
+pid=$!
+exec 4> herd.lock
+
+# project with several large files
+cd ../client
+../../bin/WTF create herd_dir
+for i in $(seq 1 16); do
+	head -c 1000000 /dev/urandom > herd_dir/file$i
+	../../bin/WTF add herd_dir herd_dir/file$i
+done
+../../bin/WTF commit herd_dir
+../../bin/WTF push herd_dir
+
+# several clients check it out while the first one's archive is
+# held up, so the others wait for it
+cd ..
+flock 4
+for i in $(seq 1 4); do
+	mkdir -p client7/$i
+	(cd client7/$i && ../../../bin/WTF configure localhost 5000 && ../../../bin/WTF checkout herd_dir) &
+	pids="$pids $!"
+done
+for i in $(seq 1 300); do
+	[[ "$(grep -c "Waiting for the leader of checkout herd_dir" server/herd.log)" == 3 ]] && break
+	sleep .1
+done
+flock -u 4
+wait $pids
+
+# a later checkout is sent the same archive again
+mkdir -p client7/5
+cd client7/5
+../../../bin/WTF configure localhost 5000
+../../../bin/WTF checkout herd_dir
+cd ../..
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+shared="$(grep -c "Sharing the archive" server/herd.log)"
+built="$(grep -c "Caching the checkout archive" server/herd.log)"
+exec 4>&-
+rm -rf server/herd.log server/herd.lock server/herd_bin
+
+for i in $(seq 1 5); do
+	diff -r -x .Manifest -x .Index client/herd_dir client7/$i/herd_dir > /dev/null || exit 1
+done
+[[ "$shared" == 3 ]] && [[ "$built" == 1 ]] && [[ "$(ls server/.archives/herd_dir | wc -l)" == 1 ]] && \
+	[[ -z "$(ls server/.transfers)" ]]
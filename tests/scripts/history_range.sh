@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# start client
+cd ../client
+result_since="$(../../bin/WTF history huffman_dir --since 3)"
+expected_since='Server connected
+
+4
+D F5AC8127B3B6B85CDC13F237C6005D80 1 huffman_dir/file1
+5
+M 1FFB2614C326255B00E3D94DDED89DAF 1 huffman_dir/file2
+
+Command completed successfully'
+
+result_path="$(../../bin/WTF history huffman_dir --limit 1 --path huffman_dir/file1)"
+expected_path='Server connected
+
+4
+D F5AC8127B3B6B85CDC13F237C6005D80 1 huffman_dir/file1
+
+Command completed successfully'
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_since" == "$expected_since" ]] && [[ "$result_path" == "$expected_path" ]]
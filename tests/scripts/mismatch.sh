@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project at version 1
+cd ../client
+../../bin/WTF create match_dir
+echo "one" > match_dir/file1
+echo "two" > match_dir/file2
+../../bin/WTF add match_dir match_dir/file1
+../../bin/WTF add match_dir match_dir/file2
+../../bin/WTF commit match_dir
+../../bin/WTF push match_dir
+
+# a file changed after its commit no longer matches it once the server
+# has it, so the push is refused and the commit kept
+echo "three" >> match_dir/file1
+../../bin/WTF commit match_dir
+echo "four" >> match_dir/file1
+../../bin/WTF push match_dir
+result_push=$?
+result_push_version="$(head -n 1 ../server/match_dir/.Manifest)"
+result_push_file="$(cat ../server/match_dir/file1)"
+result_push_commit="$(ls match_dir/.Commit)"
+
+# committed again, it goes through
+../../bin/WTF commit match_dir
+../../bin/WTF push match_dir
+result_version="$(head -n 1 ../server/match_dir/.Manifest)"
+
+# a file that changed on the server behind its .Manifest's back doesn't
+# match it once the client has it, so the checkout fails
+echo "five" > ../server/match_dir/file2
+mkdir -p ../client7
+cd ../client7
+../../bin/WTF configure localhost 5000
+result_checkout="$(../../bin/WTF checkout match_dir)"
+result_checkout_status=$?
+rm -rf match_dir
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_push" != 0 ]] && [[ "$result_push_version" == "1 match_dir" ]] && \
+	[[ "$result_push_file" == "one" ]] && [[ "$result_push_commit" == "match_dir/.Commit" ]] && \
+	[[ "$result_version" == "2 match_dir" ]] && [[ "$result_checkout_status" != 0 ]] && \
+	[[ "$result_checkout" == *"Checksum mismatch: match_dir/file2"* ]]
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# status is local, no server needed
+cd tests_out/client
+mkdir -p racy_dir
+echo "same" > racy_dir/file
+digest="$(md5sum racy_dir/file | cut -d ' ' -f 1 | tr a-f A-F)"
+printf '1 racy_dir\n- %s 1 racy_dir/file\n' "$digest" > racy_dir/.Manifest
+
+# an .Index whose entry matches the file's stat data but holds another
+# digest, written at the given time
+bogus="$(echo "other" | md5sum | cut -d ' ' -f 1 | tr a-f A-F)"
+write_index(){
+	local mtime ctime size inode
+	read mtime ctime size inode <<< "$(stat -c '%.9Y %.9Z %s %i' racy_dir/file)"
+	printf 'md5\n%s %s %s %s %s %s %s racy_dir/file\n' "$bogus" ${mtime%.*} ${mtime#*.} \
+		${ctime%.*} ${ctime#*.} $size $inode > racy_dir/.Index
+	touch -d "@$1" racy_dir/.Index
+}
+mtime="$(stat -c %.9Y racy_dir/file)"
+
+# written in the same tick as the file, the entry can't tell whether the
+# file changed again after it was hashed, so it is hashed again
+write_index $mtime
+result_racy="$(../../bin/WTF status racy_dir)"
+result_racy_index="$(grep -c "^$digest .* racy_dir/file$" racy_dir/.Index)"
+
+# written a second later, the entry is trusted as it is
+write_index $((${mtime%.*} + 1))
+result_settled="$(../../bin/WTF status racy_dir)"
+
+rm -rf racy_dir
+
+[[ "$result_racy" == "Command completed successfully" ]] && [[ "$result_racy_index" == 1 ]] && \
+	[[ "$result_settled" == "M racy_dir/file"* ]]
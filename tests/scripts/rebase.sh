@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project with two files at version 1, checked out twice
+cd ../client
+../../bin/WTF create rebase_dir
+echo "a1" > rebase_dir/a
+echo "b1" > rebase_dir/b
+../../bin/WTF add rebase_dir rebase_dir/a
+../../bin/WTF add rebase_dir rebase_dir/b
+../../bin/WTF commit rebase_dir
+../../bin/WTF push rebase_dir
+cd ..
+mkdir client6
+cd client6
+../../bin/WTF configure localhost 5000
+../../bin/WTF checkout rebase_dir
+
+# both commit against version 1, each changing its own file
+cd ../client
+echo "a2" > rebase_dir/a
+../../bin/WTF commit rebase_dir
+cd ../client6
+echo "b2" > rebase_dir/b
+../../bin/WTF commit rebase_dir
+
+# the second push is applied on top of the first
+cd ../client
+../../bin/WTF push rebase_dir
+cd ../client6
+result_rebased="$(../../bin/WTF push rebase_dir | grep "Pushed as")"
+
+# a client behind the server can still commit and push other paths
+cd ../client
+echo "a3" > rebase_dir/a
+../../bin/WTF commit rebase_dir
+../../bin/WTF push rebase_dir
+
+# update brings in the other pushes
+cd ../client6
+../../bin/WTF update rebase_dir
+../../bin/WTF upgrade rebase_dir
+
+# a change to a path pushed since the client's version is rejected
+cd ../client
+echo "b3" > rebase_dir/b
+result_conflict="$(../../bin/WTF commit rebase_dir | grep "rejected")"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_rebased" == "Pushed as version 3 on top of other changes; update to get them." ]] && \
+	[[ "$result_conflict" == "rejected M rebase_dir/b: changed on server since last update" ]] && \
+	[[ "$(head -n 1 ../server/rebase_dir/.Manifest)" == "4 rebase_dir" ]] && \
+	[[ "$(cat ../server/rebase_dir/a ../server/rebase_dir/b)" == "a3"$'\n'"b2" ]] && \
+	cmp -s ../client6/rebase_dir/.Manifest ../server/rebase_dir/.Manifest && \
+	[[ "$(cat ../client6/rebase_dir/a)" == "a3" ]] && \
+	[[ -z "$(ls -A ../server/rebase_dir | grep .Commit_)" ]] && \
+	[[ ! -s ../server/history/rebase_dir/.Pending ]]
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# start client
+cd ../client
+../../bin/WTF create hash_dir --hash xxh64
+echo "hello" > hash_dir/file1
+../../bin/WTF add hash_dir hash_dir/file1
+../../bin/WTF commit hash_dir
+../../bin/WTF push hash_dir
+result_xxh64="$(cat hash_dir/.Manifest)"
+
+../../bin/WTF rehash hash_dir blake2s
+result_blake2s="$(cat hash_dir/.Manifest)"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+expected_xxh64='1 hash_dir xxh64
+- E4C191D091BD8853 0 hash_dir/file1'
+expected_blake2s='2 hash_dir blake2s
+- 3969B3926654065966B6F8D9A65789B0F76D56E1E2AB67DD94FAA770959187CA 0 hash_dir/file1'
+[[ "$result_xxh64" == "$expected_xxh64" ]] && [[ "$result_blake2s" == "$expected_blake2s" ]] && \
+	diff -q hash_dir/.Manifest ../server/hash_dir/.Manifest
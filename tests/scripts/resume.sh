@@ -0,0 +1,33 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project with a file large enough to be flushed partway through
+cd ../client
+../../bin/WTF create big_dir
+head -c 20000000 /dev/urandom > big_dir/big
+../../bin/WTF add big_dir big_dir/big
+../../bin/WTF commit big_dir
+../../bin/WTF push big_dir
+
+# checkout dies once 12MiB of the archive are written
+cd ..
+mkdir client4
+cd client4
+../../bin/WTF configure localhost 5000
+(ulimit -f 12288; ../../bin/WTF checkout big_dir) 2>/dev/null
+[[ ! -e big_dir ]] || exit 1
+
+# the next checkout resumes after the last flushed 8MiB
+result_resume="$(../../bin/WTF checkout big_dir | grep "Resuming")"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_resume" == Resuming\ transfer\ at\ 8388608\ of* ]] && cmp -s big_dir/big ../client/big_dir/big && \
+	[[ -z "$(ls .transfers)" ]] && [[ -z "$(ls ../server/.transfers)" ]] && [[ -z "$(ls ../client/.transfers)" ]]
@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# start server with a single slot for pushes
+cd tests_out/server
+../../bin/WTFserver 5000 4 2 1 > sched.log &
+pid=$!
+
+# two projects at version 1, each with a pending commit
+cd ../client
+for project in sched_dir sched2_dir; do
+	../../bin/WTF create $project
+	echo "one" > $project/file
+	../../bin/WTF add $project $project/file
+	../../bin/WTF commit $project
+	../../bin/WTF push $project
+	echo "two" > $project/file
+	../../bin/WTF commit $project
+done
+digest="$(md5sum sched_dir/.Commit | cut -d' ' -f1 | tr a-f A-F)"
+
+# a push that holds the only push slot while its upload stalls. every
+# line is ACKed, so reading the ACKs keeps the fake client in step; the
+# server answers the digest once the push has its slot, and then waits
+# for the ACK of its transfer request, which never comes
+exec 3<>/dev/tcp/localhost/5000
+printf 'push\n' >&3
+head -c 4 <&3 > /dev/null
+printf 'sched_dir\n' >&3
+head -c 8 <&3 > /dev/null
+printf 'ACK\0%s\n' "$digest" >&3
+head -c 8 <&3 > /dev/null
+printf 'ACK\0' >&3
+
+# a push of the other project queues up for the slot
+queued="$(grep -c "Queued a write command on sched2_dir" ../server/sched.log)"
+timeout 30 ../../bin/WTF push sched2_dir > ../server/sched_push.out 3>&- &
+push_pid=$!
+for i in $(seq 1 300); do
+	[[ "$(grep -c "Queued a write command on sched2_dir" ../server/sched.log)" -gt "$queued" ]] && break
+	sleep .1
+done
+result_waiting="$(head -n 1 ../server/sched2_dir/.Manifest)"
+
+# metadata and reads don't wait behind it
+result_version="$(timeout 5 ../../bin/WTF currentversion sched2_dir | grep "sched2_dir/file")"
+cd ../client5
+rm -rf sched2_dir
+timeout 5 ../../bin/WTF checkout sched2_dir
+result_checkout="$(cat sched2_dir/file)"
+
+# the stalled push goes away, and the waiting one goes through
+exec 3>&-
+wait $push_pid
+result_pushed="$(head -n 1 ../server/sched2_dir/.Manifest)"
+rm -f ../server/sched_push.out ../server/sched.log
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_waiting" == "1 sched2_dir" ]] && [[ "$result_version" == "0 sched2_dir/file" ]] && \
+	[[ "$result_checkout" == "one" ]] && [[ "$result_pushed" == "2 sched2_dir" ]]
@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project at version 1
+cd ../client
+../../bin/WTF create snap_dir
+echo "one" > snap_dir/file
+../../bin/WTF add snap_dir snap_dir/file
+../../bin/WTF commit snap_dir
+../../bin/WTF push snap_dir
+
+# a commit that stalls once it holds the project's write lock:
+# it sends the command and project, then no .Manifest version yet
+exec 3<>/dev/tcp/localhost/5000
+printf 'commit\n' >&3
+sleep .2
+printf 'snap_dir\n' >&3
+sleep .2
+printf 'ACK\0' >&3
+sleep .2
+
+# checkout reads the published snapshot without waiting for it
+cd ..
+mkdir client5
+cd client5
+../../bin/WTF configure localhost 5000
+timeout 10 ../../bin/WTF checkout snap_dir
+result_stalled="$(cat snap_dir/file)"
+
+# let the stalled commit fail on a .Manifest version the server doesn't have
+printf '\0\0\0\143' >&3
+sleep .2
+printf 'ACK\0' >&3
+exec 3>&-
+
+# a finished push is seen by the next checkout
+cd ../client
+echo "two" > snap_dir/file
+echo "extra" > snap_dir/extra
+../../bin/WTF add snap_dir snap_dir/extra
+../../bin/WTF commit snap_dir
+../../bin/WTF push snap_dir
+cd ../client5
+rm -rf snap_dir
+../../bin/WTF checkout snap_dir
+result_pushed="$(cat snap_dir/file)"
+
+# pushes publish from a draft of the last snapshot; it must end up
+# linking the same files as the live directory, removals included
+live=../server/snap_dir
+published=../server/.snapshots/snap_dir/current/snap_dir
+result_added="$(diff -r $live $published && stat -c %i $live/extra $published/extra | uniq | wc -l)"
+cd ../client
+../../bin/WTF remove snap_dir snap_dir/extra
+../../bin/WTF commit snap_dir
+../../bin/WTF push snap_dir
+cd ../client5
+result_removed="$(diff -r $live $published && ls $published)"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+# only the current snapshot is left once nobody reads older ones
+[[ "$result_stalled" == "one" ]] && [[ "$result_pushed" == "two" ]] && \
+	[[ "$result_added" == 1 ]] && [[ "$result_removed" == "file" ]] && \
+	[[ "$(ls ../server/.snapshots/snap_dir | wc -l)" == 2 ]] && [[ -L ../server/.snapshots/snap_dir/current ]]
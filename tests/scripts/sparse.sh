@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project with two directories
+cd ../client
+../../bin/WTF create sparse_dir
+mkdir -p sparse_dir/src/lib sparse_dir/docs
+echo "lib" > sparse_dir/src/lib/lib.c
+echo "readme" > sparse_dir/docs/readme
+../../bin/WTF add sparse_dir sparse_dir/src/lib/lib.c
+../../bin/WTF add sparse_dir sparse_dir/docs/readme
+../../bin/WTF commit sparse_dir
+../../bin/WTF push sparse_dir
+
+# check out only src/
+cd ..
+mkdir client3
+cd client3
+../../bin/WTF configure localhost 5000
+../../bin/WTF checkout sparse_dir --path src/...
+result_checkout="$(find sparse_dir -type f ! -name '.Index' | sort)"
+result_status="$(../../bin/WTF status sparse_dir | grep -v "Command completed")"
+../../bin/WTF add sparse_dir sparse_dir/docs/readme && exit 1
+
+# changes to both directories only reach src/ here
+cd ../client
+echo "lib v2" > sparse_dir/src/lib/lib.c
+echo "readme v2" > sparse_dir/docs/readme
+../../bin/WTF commit sparse_dir
+../../bin/WTF push sparse_dir
+cd ../client3
+../../bin/WTF update sparse_dir
+../../bin/WTF upgrade sparse_dir
+result_lib="$(cat sparse_dir/src/lib/lib.c)"
+
+# a commit from here only looks at src/
+echo "lib v3" > sparse_dir/src/lib/lib.c
+result_commit="$(../../bin/WTF commit sparse_dir | grep "^[AMD] ")"
+../../bin/WTF push sparse_dir
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+expected_checkout='sparse_dir/.Manifest
+sparse_dir/.Sparse
+sparse_dir/src/lib/lib.c'
+expected_commit='M sparse_dir/src/lib/lib.c'
+
+[[ "$result_checkout" == "$expected_checkout" ]] && [[ -z "$result_status" ]] && \
+	[[ "$(cat sparse_dir/.Sparse)" == "src/..." ]] && [[ "$result_lib" == "lib v2" ]] && \
+	[[ ! -e sparse_dir/docs ]] && [[ "$result_commit" == "$expected_commit" ]] && \
+	diff -q sparse_dir/.Manifest ../server/sparse_dir/.Manifest
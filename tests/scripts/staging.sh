@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 &
+pid=$!
+
+# project at version 1 with a pending commit
+cd ../client
+../../bin/WTF create stage_dir
+echo "one" > stage_dir/file
+../../bin/WTF add stage_dir stage_dir/file
+../../bin/WTF commit stage_dir
+../../bin/WTF push stage_dir
+echo "two" > stage_dir/file
+../../bin/WTF commit stage_dir
+digest="$(md5sum stage_dir/.Commit | cut -d' ' -f1 | tr a-f A-F)"
+
+# a push of it that stalls while its upload is being staged:
+# it answers the transfer request, then sends no transfer id yet
+exec 3<>/dev/tcp/localhost/5000
+printf 'push\n' >&3
+sleep .2
+printf 'stage_dir\n' >&3
+sleep .2
+printf 'ACK\0' >&3
+sleep .2
+printf '%s\n' "$digest" >&3
+sleep .2
+printf 'ACK\0' >&3
+sleep .2
+printf 'ACK\0' >&3
+sleep .2
+printf 'ACK\0' >&3
+sleep .2
+
+# another client can still commit, which needs the project lock
+cd ../client5
+../../bin/WTF checkout stage_dir
+echo "three" > stage_dir/file
+result_commit="$(timeout 10 ../../bin/WTF commit stage_dir | grep "^M ")"
+
+# the stalled push stages under its project
+result_staging="$(ls ../server/.staging/stage_dir)"
+
+# the stalled push gives up on an invalid transfer id
+printf 'none-\n' >&3
+sleep .2
+printf '\0\0\0\0\0\0\0\0' >&3
+sleep .2
+printf '\0\0\0\0\0\0\0\0' >&3
+sleep .2
+exec 3>&-
+
+# the first commit is still pending and is pushed; the other one expires
+cd ../client
+../../bin/WTF push stage_dir
+cd ../client5
+result_expired="$(../../bin/WTF push stage_dir | grep "rejected")"
+cd ../client
+result_version="$(head -n 1 ../server/stage_dir/.Manifest)"
+result_file="$(cat ../server/stage_dir/file)"
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+
+[[ "$result_commit" == "M stage_dir/file" ]] && [[ "$result_staging" == "$digest.lock" ]] && \
+	[[ "$result_expired" == "Client push rejected" ]] && \
+	[[ "$result_version" == "2 stage_dir" ]] && [[ "$result_file" == "two" ]] && \
+	[[ -z "$(ls ../server/.staging)" ]]
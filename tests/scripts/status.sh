@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# status is local, no server needed
+cd tests_out/client
+../../bin/WTF monitor hash_dir &
+pid=$!
+sleep .2
+
+result_clean="$(../../bin/WTF status hash_dir)"
+cursor="$(head -1 hash_dir/.Index)"
+echo "changed" > hash_dir/file1
+result_changed="$(../../bin/WTF status hash_dir)"
+
+# stop monitor
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+echo "hello" > hash_dir/file1
+
+[[ "$result_clean" == "Command completed successfully" ]] && \
+	[[ "$(echo $cursor | wc -w)" == 3 ]] && \
+	[[ "$result_changed" == "M hash_dir/file1"* ]]
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# start server
+cd tests_out/server
+../../bin/WTFserver 5000 > sync.log &
+pid=$!
+for i in $(seq 1 300); do
+	grep -q "Server started" sync.log && break
+	sleep .1
+done
+
+# the .Manifest a sync leaves the second client with, upgraded or not:
+# the server's, though files it added come last and marked "A"
+same_manifest(){
+	[[ "$(head -n 1 sync_dir/.Manifest)" == "$(head -n 1 ../server/sync_dir/.Manifest)" ]] && \
+		diff <(tail -n +2 sync_dir/.Manifest | cut -d ' ' -f 2- | sort) \
+		<(tail -n +2 ../server/sync_dir/.Manifest | cut -d ' ' -f 2- | sort) > /dev/null
+}
+
+# project at version 1, checked out by a second client
+cd ../client
+../../bin/WTF create sync_dir
+mkdir -p sync_dir/sub
+echo "one" > sync_dir/file1
+echo "two" > sync_dir/file2
+echo "three" > sync_dir/sub/file3
+../../bin/WTF add sync_dir sync_dir/file1
+../../bin/WTF add sync_dir sync_dir/file2
+../../bin/WTF add sync_dir sync_dir/sub/file3
+../../bin/WTF commit sync_dir
+../../bin/WTF push sync_dir
+mkdir -p ../client7
+cd ../client7
+../../bin/WTF configure localhost 5000
+../../bin/WTF checkout sync_dir
+
+# up to date, nothing is sent
+../../bin/WTF update sync_dir
+result_not_modified="$(grep -c "The .Manifest of sync_dir is not modified" ../server/sync.log)"
+result_not_modified_update="$(cat sync_dir/.Update)"
+same_manifest
+result_not_modified_manifest=$?
+
+# a few versions later, with files changed, removed and added
+cd ../client
+echo "more" >> sync_dir/file1
+../../bin/WTF remove sync_dir sync_dir/file2
+../../bin/WTF commit sync_dir
+../../bin/WTF push sync_dir
+echo "four" > sync_dir/sub/file4
+../../bin/WTF add sync_dir sync_dir/sub/file4
+echo "more" >> sync_dir/sub/file3
+../../bin/WTF commit sync_dir
+../../bin/WTF push sync_dir
+
+# the history covers the second client's version, so it is sent the
+# changes since then
+cd ../client7
+../../bin/WTF update sync_dir
+../../bin/WTF upgrade sync_dir
+result_delta="$(grep -c "Sending the changes to sync_dir since version 1" ../server/sync.log)"
+same_manifest
+result_delta_manifest=$?
+
+# rolled back past the second client's version, the history can't take
+# it there, so the hash trees are compared
+../../bin/WTF rollback sync_dir 1
+../../bin/WTF update sync_dir
+../../bin/WTF upgrade sync_dir
+result_tree="$(grep -c "Sending the hash tree of sync_dir" ../server/sync.log)"
+same_manifest
+result_tree_manifest=$?
+
+# kill server
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+rm -f ../server/sync.log
+
+[[ "$result_not_modified" == 1 ]] && [[ "$result_not_modified_update" == "" ]] && \
+	[[ "$result_not_modified_manifest" == 0 ]] && [[ "$result_delta" == 1 ]] && \
+	[[ "$result_delta_manifest" == 0 ]] && [[ "$result_tree" == 1 ]] && \
+	[[ "$result_tree_manifest" == 0 ]]
@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# start server with two worker processes
+cd tests_out/server
+../../bin/WTFserver -w 2 5000 > workers.log &
+pid=$!
+for i in $(seq 1 300); do
+	grep -q "Server started" workers.log && break
+	sleep .1
+done
+
+# project at version 1
+cd ../client
+../../bin/WTF create work_dir
+echo "one" > work_dir/file
+../../bin/WTF add work_dir work_dir/file
+../../bin/WTF commit work_dir
+../../bin/WTF push work_dir
+
+# the test holds the project's lock file the way a command in another
+# worker would. reads of the live history wait for it whichever worker
+# they land on, until all four show up as waiters in /proc/locks
+lock=../server/.locks/work_dir.lock
+exec 4> $lock
+flock 4
+inode="$(stat -c %i $lock)"
+mkdir -p ../client7
+for i in $(seq 1 4); do
+	../../bin/WTF history work_dir > ../client7/history$i 4>&- &
+	pids="$pids $!"
+done
+for i in $(seq 1 300); do
+	[[ "$(grep -c -- "-> FLOCK.*:$inode " /proc/locks)" == 4 ]] && break
+	sleep .1
+done
+result_blocked="$(grep -l "Command completed" ../client7/history* | wc -l)"
+
+# letting go of it lets the reads go on
+exec 4>&-
+wait $pids
+result_read="$(grep -l "Command completed" ../client7/history* | wc -l)"
+
+# kill each worker in turn, the last started first, as the ones before
+# it are where its listener could leak: it is replaced, and the socket
+# it listened on isn't left open anywhere, so every new connection is
+# served
+result_served=0
+for victim in $(pgrep -P $pid | sort -rn); do
+	kill -KILL $victim
+	for i in $(seq 1 300); do
+		grep -q "Worker $victim exited" ../server/workers.log && break
+		sleep .1
+	done
+	for i in $(seq 1 8); do
+		timeout 10 ../../bin/WTF currentversion work_dir | grep -q "work_dir/file" && \
+			result_served=$((result_served + 1))
+	done
+done
+result_workers="$(pgrep -P $pid | wc -l)"
+echo "two" > work_dir/file
+../../bin/WTF commit work_dir
+../../bin/WTF push work_dir
+result_version="$(head -n 1 ../server/work_dir/.Manifest)"
+
+# kill server, which stops its workers
+children="$(pgrep -P $pid)"
+sleep .1
+kill -INT $pid 2>/dev/null
+wait $pid 2>/dev/null
+rm -f ../server/workers.log
+for child in $children; do
+	kill -0 $child 2>/dev/null && exit 1
+done
+
+[[ "$result_blocked" == 0 ]] && [[ "$result_read" == 4 ]] && [[ "$result_served" == 16 ]] && \
+	[[ "$result_workers" == 2 ]] && [[ "$result_version" == "2 work_dir" ]]